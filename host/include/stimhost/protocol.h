@@ -0,0 +1,112 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      The terminal protocol of the stimulator in host mode ('HM 1')
+
+   Contains:
+      The byte stream of a board is split in text lines and binary
+      acquisition blocks ('AQ'). A line is a response line, the prompt
+      line 'TERM>' which ends every response, or an event that the
+      board sends on its own (START, FINISH, NewPeriod, ...).
+      Lines of a board in a daisy chain start with '#<address> '.
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#ifndef STIMHOST_PROTOCOL_H_
+#define STIMHOST_PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace stim
+{
+
+/*--------------------------------------------------
+ An event line: 'FINISH 2' is name "FINISH", values {2}
+ --------------------------------------------------*/
+struct Event
+{
+   int               board = 0;         /* chain address, 0: standalone */
+   std::string       name;
+   std::vector<long> values;
+   std::string       line;              /* as received, without the prefix */
+};
+
+/*--------------------------------------------------
+ A binary acquisition block (see "Analog acquisition" in README.md)
+ --------------------------------------------------*/
+struct SampleBlock
+{
+   std::uint8_t               sequence = 0;
+   std::vector<std::uint16_t> words;
+
+   static bool isMarker( std::uint16_t w )          { return (w & 0x8000) != 0; }
+   static unsigned markerChannel( std::uint16_t w ) { return (w & 0x7FFF) + 1; }
+   static unsigned input( std::uint16_t w )         { return (w >> 12) & 0x7; }
+   static unsigned value( std::uint16_t w )         { return w & 0x0FFF; }
+   static bool isSample( std::uint16_t w )          { return !isMarker( w ) && (value( w ) <= 1023); }
+};
+
+/*--------------------------------------------------
+ Splits the received bytes in lines and blocks. A block can only
+ start at the start of a line (host mode has no pulse characters).
+ XON/XOFF and other control characters in lines are dropped.
+ --------------------------------------------------*/
+class StreamParser
+{
+public:
+   using LineHandler = std::function<void( const std::string & )>;
+   using BlockHandler = std::function<void( const SampleBlock & )>;
+
+   StreamParser( LineHandler onLine, BlockHandler onBlock );
+
+   void feed( const std::uint8_t *data, std::size_t size );
+   unsigned badBlocks() const { return badBlocks_; }
+
+private:
+   enum class State { Text, BlockSequence, BlockCount, BlockData, BlockCheck };
+
+   void blockByte( std::uint8_t b );
+
+   LineHandler  onLine_;
+   BlockHandler onBlock_;
+   State        state_ = State::Text;
+   std::string  line_;
+   SampleBlock  block_;
+   std::size_t  blockBytes_ = 0;        /* data bytes expected */
+   std::vector<std::uint8_t> data_;
+   unsigned     badBlocks_ = 0;
+};
+
+/*--------------------------------------------------
+ Remove a chain prefix '#<address> ' (address in *board, else 0)
+ --------------------------------------------------*/
+std::string stripBoardPrefix( const std::string &line, int *board );
+
+/*--------------------------------------------------
+ The prompt line that ends a response
+ --------------------------------------------------*/
+bool isPrompt( const std::string &line );
+
+/*--------------------------------------------------
+ An event line (true) is parsed into ev
+ --------------------------------------------------*/
+bool parseEvent( const std::string &line, Event &ev );
+
+/*--------------------------------------------------
+ A response line telling the command failed
+ --------------------------------------------------*/
+bool isErrorLine( const std::string &line );
+
+} // namespace stim
+
+#endif /* STIMHOST_PROTOCOL_H_ */
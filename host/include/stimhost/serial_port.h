@@ -0,0 +1,61 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Raw serial port (POSIX termios) for the host library
+
+   Contains:
+      8N1, no flow control, no character translation. Any tty device
+      can be used, also a pseudo terminal standing in for a board.
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#ifndef STIMHOST_SERIAL_PORT_H_
+#define STIMHOST_SERIAL_PORT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace stim
+{
+
+class SerialPort
+{
+public:
+   SerialPort() = default;
+   ~SerialPort();
+   SerialPort( const SerialPort & ) = delete;
+   SerialPort &operator=( const SerialPort & ) = delete;
+
+   /*--------------------------------------------------
+    Open the device at a baudrate; throws std::system_error, or
+    std::invalid_argument for a baudrate the tty can not do
+    --------------------------------------------------*/
+   void open( const std::string &device, unsigned baud );
+   void close();
+   bool isOpen() const { return fd_ >= 0; }
+
+   /*--------------------------------------------------
+    Write all bytes (waits while the driver is full)
+    --------------------------------------------------*/
+   void write( const void *data, std::size_t size );
+
+   /*--------------------------------------------------
+    Read what is there, waiting at most timeoutMs for the first
+    byte; returns the count (0: timeout)
+    --------------------------------------------------*/
+   std::size_t read( std::uint8_t *buffer, std::size_t max, int timeoutMs );
+
+private:
+   int fd_ = -1;
+};
+
+} // namespace stim
+
+#endif /* STIMHOST_SERIAL_PORT_H_ */
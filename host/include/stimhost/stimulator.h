@@ -0,0 +1,149 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Host control of a stimulator board over its serial terminal
+
+   Contains:
+      Commands are pipelined: they are sent without waiting for the
+      prompt of the previous one. The board answers in order, so the
+      responses are matched to the commands in a FIFO. The bytes of the
+      commands in flight are limited (window) so the receive buffer of
+      the board (128 bytes) never overflows; this replaces XON/XOFF,
+      which host mode switches off.
+      In a daisy chain (Options::boards) the commands must carry an
+      address ('@2 SV 1,10,10'); a broadcast ('@0 ...') is answered by
+      every board, so its response ends with the last of their prompts.
+      A reader thread parses the responses, the events and the
+      acquisition blocks; the event and sample handlers are called
+      from that thread.
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#ifndef STIMHOST_STIMULATOR_H_
+#define STIMHOST_STIMULATOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stimhost/protocol.h"
+#include "stimhost/serial_port.h"
+
+namespace stim
+{
+
+/*--------------------------------------------------
+ The response of one command (without the prompt line)
+ --------------------------------------------------*/
+struct Response
+{
+   std::string              command;
+   std::vector<std::string> lines;
+   bool                     ok = true;  /* no error line */
+};
+
+class Stimulator
+{
+public:
+   struct Options
+   {
+      std::string               device;
+      unsigned                  baud = 38400;
+      std::size_t               window = 64;  /* command bytes in flight */
+      std::chrono::milliseconds timeout{ 2000 };
+      unsigned                  boards = 0;   /* boards in a daisy chain, 0: standalone */
+   };
+
+   using EventHandler = std::function<void( const Event & )>;
+   using SampleHandler = std::function<void( const SampleBlock & )>;
+
+   explicit Stimulator( Options options );
+   ~Stimulator();
+   Stimulator( const Stimulator & ) = delete;
+   Stimulator &operator=( const Stimulator & ) = delete;
+
+   /*--------------------------------------------------
+    Open the port, start the reader and switch the board to host
+    mode; throws on failure (or when the board does not answer)
+    --------------------------------------------------*/
+   void open();
+   void close();
+
+   /*--------------------------------------------------
+    Send a command (without line end); waits only while the window
+    is full. The future gets the response (of all boards for a
+    broadcast in a chain)
+    --------------------------------------------------*/
+   std::future<Response> send( const std::string &command );
+
+   /*--------------------------------------------------
+    Send and wait for the response; throws std::runtime_error on a
+    timeout
+    --------------------------------------------------*/
+   Response call( const std::string &command );
+
+   /*--------------------------------------------------
+    Handlers; set them before open()
+    --------------------------------------------------*/
+   void onEvent( EventHandler handler ) { eventHandler_ = std::move( handler ); }
+   void onSamples( SampleHandler handler ) { sampleHandler_ = std::move( handler ); }
+
+   /*--------------------------------------------------
+    Wait for an event by name (and channel: the first value, 0 is
+    any) received after the last call; false on a timeout
+    --------------------------------------------------*/
+   bool waitEvent( const std::string &name, long channel, std::chrono::milliseconds timeout );
+
+   unsigned badBlocks() const { return parser_.badBlocks(); }
+
+private:
+   struct Pending
+   {
+      Response                response;
+      std::size_t             bytes = 0;
+      unsigned                prompts = 1;  /* still to come */
+      std::promise<Response>  promise;
+   };
+
+   unsigned promptsOf( const std::string &command ) const;
+
+   void readerLoop();
+   void handleLine( const std::string &raw );
+   void handleBlock( const SampleBlock &block );
+   void failPending( const std::string &why );
+
+   Options                 options_;
+   SerialPort              port_;
+   StreamParser            parser_;
+   EventHandler            eventHandler_;
+   SampleHandler           sampleHandler_;
+
+   std::mutex              mutex_;
+   std::condition_variable changed_;
+   std::deque<Pending>     pending_;
+   std::size_t             inFlight_ = 0;
+   std::deque<Event>       events_;     /* for waitEvent */
+   std::vector<int>        hostModeBoards_;  /* 'Host mode: 1' seen (chain addresses) */
+   unsigned                hostModePrompts_ = 0;
+   bool                    synced_ = false;  /* host mode confirmed (by all boards) */
+
+   std::thread             reader_;
+   std::atomic<bool>       running_{ false };
+};
+
+} // namespace stim
+
+#endif /* STIMHOST_STIMULATOR_H_ */
@@ -0,0 +1,245 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      The terminal protocol of the stimulator in host mode ('HM 1')
+
+   Contains:
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#include "stimhost/protocol.h"
+
+#include <cctype>
+#include <cstdlib>
+
+namespace stim
+{
+
+namespace
+{
+
+constexpr std::uint8_t BLOCK_SYNC = 0xA5;   /* ADC_BLOCKSYNC of the firmware */
+constexpr std::size_t  BLOCK_MAXWORDS = 64;
+
+/* Lines the board sends on its own; "LOAD OK" and "EEPROM written" have two words */
+const char *const eventNames[] =
+{
+   "START", "FINISH", "NewPeriod", "AUTOSTART", "BOOT", "INVALID", "TRIGGER", "SYNC",
+   "LATE", "OPEN", "SHORT", "LOAD", "UNBALANCED", "EEPROM"
+};
+
+std::string trim( const std::string &s )
+{
+   std::size_t begin = 0;
+   std::size_t end = s.size();
+
+   while ( (begin < end) && std::isspace( static_cast<unsigned char>( s[begin] ) ) )
+   {
+      begin++;
+   }
+   while ( (end > begin) && std::isspace( static_cast<unsigned char>( s[end - 1] ) ) )
+   {
+      end--;
+   }
+   return s.substr( begin, end - begin );
+}
+
+} // namespace
+
+/***------------------------ StreamParser -------------------------------***/
+
+StreamParser::StreamParser( LineHandler onLine, BlockHandler onBlock )
+   : onLine_( std::move( onLine ) ), onBlock_( std::move( onBlock ) )
+{
+}
+
+void StreamParser::feed( const std::uint8_t *data, std::size_t size )
+{
+   for ( std::size_t i = 0; i < size; i++ )
+   {
+      std::uint8_t b = data[i];
+
+      if ( state_ != State::Text )
+      {
+         blockByte( b );
+         continue;
+      }
+      if ( (b == BLOCK_SYNC) && line_.empty() )
+      {
+         state_ = State::BlockSequence;
+         continue;
+      }
+      if ( b == '\n' )
+      {
+         if ( !line_.empty() && onLine_ )
+         {
+            onLine_( line_ );
+         }
+         line_.clear();
+      }
+      else if ( (b >= 0x20) && (b < 0x7F) )
+      {
+         line_ += static_cast<char>( b );
+      }
+      /* CR, XON/XOFF, BELL and other control characters are dropped */
+   }
+}
+
+/*--------------------------------------------------
+ sync, sequence, count, count words (low byte first), xor check
+ --------------------------------------------------*/
+void StreamParser::blockByte( std::uint8_t b )
+{
+   switch ( state_ )
+   {
+      case State::BlockSequence :
+         block_.sequence = b;
+         state_ = State::BlockCount;
+         break;
+      case State::BlockCount :
+         if ( (b == 0) || (b > BLOCK_MAXWORDS) )
+         {
+            badBlocks_++;               /* not a block: back to text */
+            state_ = State::Text;
+            break;
+         }
+         blockBytes_ = static_cast<std::size_t>( b ) * 2;
+         data_.clear();
+         data_.push_back( block_.sequence );
+         data_.push_back( b );
+         state_ = State::BlockData;
+         break;
+      case State::BlockData :
+         data_.push_back( b );
+         if ( data_.size() == blockBytes_ + 2 )
+         {
+            state_ = State::BlockCheck;
+         }
+         break;
+      case State::BlockCheck :
+      {
+         std::uint8_t check = 0;
+         for ( std::uint8_t d : data_ )
+         {
+            check ^= d;
+         }
+         state_ = State::Text;
+         if ( check != b )
+         {
+            badBlocks_++;
+            break;
+         }
+         block_.words.clear();
+         for ( std::size_t i = 2; i + 1 < data_.size(); i += 2 )
+         {
+            block_.words.push_back( static_cast<std::uint16_t>( data_[i] | (data_[i + 1] << 8) ) );
+         }
+         if ( onBlock_ )
+         {
+            onBlock_( block_ );
+         }
+         break;
+      }
+      default:
+         state_ = State::Text;
+         break;
+   }
+}
+
+/***------------------------ Line classification ------------------------***/
+
+std::string stripBoardPrefix( const std::string &line, int *board )
+{
+   std::size_t i = 1;
+
+   *board = 0;
+   if ( line.empty() || (line[0] != '#') )
+   {
+      return line;
+   }
+   while ( (i < line.size()) && std::isdigit( static_cast<unsigned char>( line[i] ) ) )
+   {
+      i++;
+   }
+   if ( (i == 1) || (i >= line.size()) || (line[i] != ' ') )
+   {
+      return line;
+   }
+   *board = std::atoi( line.c_str() + 1 );
+   return line.substr( i + 1 );
+}
+
+bool isPrompt( const std::string &line )
+{
+   return trim( line ) == "TERM>";
+}
+
+bool parseEvent( const std::string &line, Event &ev )
+{
+   std::string text = trim( line );
+   std::size_t end = text.find( ' ' );
+   std::string first = text.substr( 0, end );
+   bool        known = false;
+
+   for ( const char *name : eventNames )
+   {
+      known = known || (first == name);
+   }
+   if ( !known )
+   {
+      return false;
+   }
+   ev.name = first;
+   ev.values.clear();
+   ev.line = text;
+   if ( (first == "LOAD") || (first == "EEPROM") )
+   {
+      if ( (text.compare( 0, 7, "LOAD OK" ) != 0) && (text != "EEPROM written") )
+      {
+         return false;
+      }
+      ev.name = text.substr( 0, (first == "LOAD") ? 7 : 14 );
+      end = (first == "LOAD") ? 7 : std::string::npos;
+   }
+   while ( end != std::string::npos )
+   {
+      const char *start = text.c_str() + end;
+      char       *stop;
+      long       value;
+
+      while ( (*start == ' ') || (*start == ',') )
+      {
+         start++;
+      }
+      if ( *start == '\0' )
+      {
+         break;
+      }
+      value = std::strtol( start, &stop, 10 );
+      if ( stop == start )
+      {
+         break;
+      }
+      ev.values.push_back( value );
+      end = static_cast<std::size_t>( stop - text.c_str() );
+   }
+   return true;
+}
+
+bool isErrorLine( const std::string &line )
+{
+   std::string text = trim( line );
+
+   return ( (text.size() >= 5) && (text.compare( text.size() - 5, 5, "error" ) == 0) ) ||
+          (text.compare( 0, 15, "Unknown command" ) == 0) ||
+          (text.compare( 0, 7, "Refused" ) == 0) ||
+          (text.compare( 0, 11, "EEPROM busy" ) == 0);
+}
+
+} // namespace stim
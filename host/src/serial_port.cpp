@@ -0,0 +1,183 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Raw serial port (POSIX termios) for the host library
+
+   Contains:
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#include "stimhost/serial_port.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <system_error>
+#include <termios.h>
+#include <unistd.h>
+
+namespace stim
+{
+
+namespace
+{
+
+/*--------------------------------------------------
+ termios speed of a baudrate (the standard ones only)
+ --------------------------------------------------*/
+speed_t speedOf( unsigned baud )
+{
+   switch ( baud )
+   {
+      case 300 :     return B300;
+      case 1200 :    return B1200;
+      case 2400 :    return B2400;
+      case 4800 :    return B4800;
+      case 9600 :    return B9600;
+      case 19200 :   return B19200;
+      case 38400 :   return B38400;
+      case 57600 :   return B57600;
+      case 115200 :  return B115200;
+      case 230400 :  return B230400;
+#ifdef B500000
+      case 500000 :  return B500000;
+#endif
+#ifdef B1000000
+      case 1000000 : return B1000000;
+#endif
+#ifdef B2000000
+      case 2000000 : return B2000000;
+#endif
+      default:
+         throw std::invalid_argument( "baudrate not supported by termios: " + std::to_string( baud ) );
+   }
+}
+
+[[noreturn]] void throwErrno( const std::string &what )
+{
+   throw std::system_error( errno, std::generic_category(), what );
+}
+
+} // namespace
+
+SerialPort::~SerialPort()
+{
+   close();
+}
+
+/*--------------------------------------------------
+ Open and set raw 8N1; no XON/XOFF: the acquisition blocks are
+ binary, the library limits what it sends instead
+ --------------------------------------------------*/
+void SerialPort::open( const std::string &device, unsigned baud )
+{
+   struct termios tio;
+   speed_t        speed = speedOf( baud );
+
+   close();
+   fd_ = ::open( device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK );
+   if ( fd_ < 0 )
+   {
+      throwErrno( "open " + device );
+   }
+   if ( tcgetattr( fd_, &tio ) != 0 )
+   {
+      int error = errno;
+      close();
+      errno = error;
+      throwErrno( "tcgetattr " + device );
+   }
+   cfmakeraw( &tio );
+   tio.c_cflag |= CLOCAL | CREAD;
+   tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+   tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+   tio.c_cc[VMIN] = 0;
+   tio.c_cc[VTIME] = 0;
+   cfsetispeed( &tio, speed );
+   cfsetospeed( &tio, speed );
+   if ( tcsetattr( fd_, TCSANOW, &tio ) != 0 )
+   {
+      int error = errno;
+      close();
+      errno = error;
+      throwErrno( "tcsetattr " + device );
+   }
+   tcflush( fd_, TCIOFLUSH );
+}
+
+void SerialPort::close()
+{
+   if ( fd_ >= 0 )
+   {
+      ::close( fd_ );
+      fd_ = -1;
+   }
+}
+
+void SerialPort::write( const void *data, std::size_t size )
+{
+   const std::uint8_t *p = static_cast<const std::uint8_t *>( data );
+
+   while ( size > 0 )
+   {
+      ssize_t n = ::write( fd_, p, size );
+      if ( n < 0 )
+      {
+         if ( errno == EINTR )
+         {
+            continue;
+         }
+         if ( errno == EAGAIN )
+         {
+            struct pollfd pfd = { fd_, POLLOUT, 0 };
+            (void) ::poll( &pfd, 1, 100 );
+            continue;
+         }
+         throwErrno( "write" );
+      }
+      p += n;
+      size -= static_cast<std::size_t>( n );
+   }
+}
+
+std::size_t SerialPort::read( std::uint8_t *buffer, std::size_t max, int timeoutMs )
+{
+   struct pollfd pfd = { fd_, POLLIN, 0 };
+   int           ready = ::poll( &pfd, 1, timeoutMs );
+
+   if ( ready < 0 )
+   {
+      if ( errno == EINTR )
+      {
+         return 0;
+      }
+      throwErrno( "poll" );
+   }
+   if ( (ready == 0) || ((pfd.revents & POLLIN) == 0) )
+   {
+      if ( (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0 )
+      {
+         throw std::system_error( EIO, std::generic_category(), "serial port closed" );
+      }
+      return 0;
+   }
+   ssize_t n = ::read( fd_, buffer, max );
+   if ( n < 0 )
+   {
+      if ( (errno == EAGAIN) || (errno == EINTR) )
+      {
+         return 0;
+      }
+      throwErrno( "read" );
+   }
+   return static_cast<std::size_t>( n );
+}
+
+} // namespace stim
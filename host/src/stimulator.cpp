@@ -0,0 +1,297 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Host control of a stimulator board over its serial terminal
+
+   Contains:
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#include "stimhost/stimulator.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace stim
+{
+
+namespace
+{
+
+constexpr std::size_t EVENT_QUEUE = 256;    /* events kept for waitEvent */
+constexpr int         READ_POLL_MS = 50;    /* reader checks for close */
+
+} // namespace
+
+Stimulator::Stimulator( Options options )
+   : options_( std::move( options ) ),
+     parser_( [this]( const std::string &line ) { handleLine( line ); },
+              [this]( const SampleBlock &block ) { handleBlock( block ); } )
+{
+}
+
+Stimulator::~Stimulator()
+{
+   close();
+}
+
+/*--------------------------------------------------
+ Open and switch to host mode. A CR first ends any partial line in
+ the board; the echo of the interactive mode is ignored until the
+ 'Host mode: 1' answer and its prompt are seen (of every board in a
+ chain)
+ --------------------------------------------------*/
+void Stimulator::open()
+{
+   std::string enter = (options_.boards != 0) ? "\r@0 HM 1\r" : "\rHM 1\r";
+
+   close();
+   port_.open( options_.device, options_.baud );
+   synced_ = false;
+   hostModeBoards_.clear();
+   hostModePrompts_ = 0;
+   running_ = true;
+   reader_ = std::thread( &Stimulator::readerLoop, this );
+   port_.write( enter.data(), enter.size() );
+
+   std::unique_lock<std::mutex> lock( mutex_ );
+   if ( !changed_.wait_for( lock, options_.timeout, [this] { return synced_ || !running_; } ) || !synced_ )
+   {
+      lock.unlock();
+      close();
+      throw std::runtime_error( "no answer from the stimulator on " + options_.device );
+   }
+}
+
+/*--------------------------------------------------
+ Back to interactive mode (not waited for) and stop
+ --------------------------------------------------*/
+void Stimulator::close()
+{
+   std::string leave = (options_.boards != 0) ? "@0 HM 0\r" : "HM 0\r";
+
+   if ( running_ && synced_ )
+   {
+      try
+      {
+         port_.write( leave.data(), leave.size() );
+      }
+      catch ( const std::exception & )
+      {
+         /* closing anyway */
+      }
+   }
+   running_ = false;
+   if ( reader_.joinable() )
+   {
+      reader_.join();
+   }
+   port_.close();
+   failPending( "stimulator closed" );
+}
+
+std::future<Response> Stimulator::send( const std::string &command )
+{
+   std::string line = command + "\r";
+   Pending     pending;
+
+   pending.response.command = command;
+   pending.bytes = line.size();
+   pending.prompts = promptsOf( command );
+   std::future<Response> future = pending.promise.get_future();
+
+   std::unique_lock<std::mutex> lock( mutex_ );
+   changed_.wait( lock, [this, &line] {
+      return !running_ || (inFlight_ == 0) || ((inFlight_ + line.size()) <= options_.window);
+   } );
+   if ( !running_ )
+   {
+      throw std::runtime_error( "stimulator not open" );
+   }
+   inFlight_ += pending.bytes;
+   pending_.push_back( std::move( pending ) );
+   port_.write( line.data(), line.size() );   /* under the lock: keeps the FIFO order */
+   return future;
+}
+
+/*--------------------------------------------------
+ Prompts that end the response: one, or one per board for a
+ broadcast ('@0') in a chain
+ --------------------------------------------------*/
+unsigned Stimulator::promptsOf( const std::string &command ) const
+{
+   std::size_t i = 0;
+
+   if ( options_.boards == 0 )
+   {
+      return 1;
+   }
+   while ( (i < command.size()) && std::isspace( static_cast<unsigned char>( command[i] ) ) )
+   {
+      i++;
+   }
+   if ( (i + 1 >= command.size()) || (command[i] != '@') ||
+        !std::isdigit( static_cast<unsigned char>( command[i + 1] ) ) ||
+        (std::strtoul( command.c_str() + i + 1, nullptr, 10 ) != 0) )
+   {
+      return 1;
+   }
+   return options_.boards;
+}
+
+Response Stimulator::call( const std::string &command )
+{
+   std::future<Response> future = send( command );
+
+   if ( future.wait_for( options_.timeout ) != std::future_status::ready )
+   {
+      throw std::runtime_error( "no response to '" + command + "'" );
+   }
+   return future.get();
+}
+
+bool Stimulator::waitEvent( const std::string &name, long channel, std::chrono::milliseconds timeout )
+{
+   std::unique_lock<std::mutex> lock( mutex_ );
+   auto deadline = std::chrono::steady_clock::now() + timeout;
+
+   for ( ;; )
+   {
+      while ( !events_.empty() )
+      {
+         Event ev = std::move( events_.front() );
+         events_.pop_front();
+         if ( (ev.name == name) &&
+              ((channel == 0) || (!ev.values.empty() && (ev.values[0] == channel))) )
+         {
+            return true;
+         }
+      }
+      if ( !running_ || (changed_.wait_until( lock, deadline ) == std::cv_status::timeout) )
+      {
+         return false;
+      }
+   }
+}
+
+/***------------------------ Reader thread ------------------------------***/
+
+void Stimulator::readerLoop()
+{
+   std::uint8_t buffer[256];
+
+   try
+   {
+      while ( running_ )
+      {
+         std::size_t n = port_.read( buffer, sizeof(buffer), READ_POLL_MS );
+         parser_.feed( buffer, n );
+      }
+   }
+   catch ( const std::exception &e )
+   {
+      running_ = false;
+      failPending( e.what() );
+   }
+   changed_.notify_all();
+}
+
+/*--------------------------------------------------
+ A prompt ends the response of the oldest command (the last prompt
+ of a broadcast); events go to the handler; other lines belong to
+ the oldest command
+ --------------------------------------------------*/
+void Stimulator::handleLine( const std::string &raw )
+{
+   Event ev;
+   int   board;
+   std::string line = stripBoardPrefix( raw, &board );
+
+   std::unique_lock<std::mutex> lock( mutex_ );
+   if ( !synced_ )
+   {
+      if ( line.compare( 0, 12, "Host mode: 1" ) == 0 )
+      {
+         hostModeBoards_.push_back( board );  /* answer seen; its prompt follows */
+      }
+      else if ( isPrompt( line ) &&
+                (std::find( hostModeBoards_.begin(), hostModeBoards_.end(), board ) != hostModeBoards_.end()) )
+      {
+         hostModePrompts_++;
+         if ( hostModePrompts_ >= std::max( options_.boards, 1u ) )
+         {
+            synced_ = true;
+            changed_.notify_all();
+         }
+      }
+      return;
+   }
+   if ( isPrompt( line ) )
+   {
+      if ( !pending_.empty() && (--pending_.front().prompts == 0) )
+      {
+         Pending done = std::move( pending_.front() );
+         pending_.pop_front();
+         inFlight_ -= done.bytes;
+         done.promise.set_value( std::move( done.response ) );
+         changed_.notify_all();
+      }
+      return;
+   }
+   if ( parseEvent( line, ev ) )
+   {
+      ev.board = board;
+      if ( events_.size() >= EVENT_QUEUE )
+      {
+         events_.pop_front();
+      }
+      events_.push_back( ev );
+      changed_.notify_all();
+      lock.unlock();
+      if ( eventHandler_ )
+      {
+         eventHandler_( ev );
+      }
+      return;
+   }
+   if ( !pending_.empty() )
+   {
+      Response &response = pending_.front().response;
+      response.lines.push_back( line );
+      if ( isErrorLine( line ) )
+      {
+         response.ok = false;
+      }
+   }
+}
+
+void Stimulator::handleBlock( const SampleBlock &block )
+{
+   if ( sampleHandler_ )
+   {
+      sampleHandler_( block );
+   }
+}
+
+void Stimulator::failPending( const std::string &why )
+{
+   std::lock_guard<std::mutex> lock( mutex_ );
+
+   while ( !pending_.empty() )
+   {
+      pending_.front().promise.set_exception( std::make_exception_ptr( std::runtime_error( why ) ) );
+      pending_.pop_front();
+   }
+   inFlight_ = 0;
+   changed_.notify_all();
+}
+
+} // namespace stim
@@ -0,0 +1,433 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Tests of the daisy chain input of the firmware (src/chain.c)
+
+   Contains:
+      chain.c is built once per board (the functions renamed per copy,
+      so every board has its own state) on a fake serial port: a
+      receive and a transmit ring per board, the transmit ring of a board
+      feeding the receive ring of the next one, a few characters per loop
+      pass. The boards also give output of their own, which must never
+      get into a forwarded line.
+      test_chain <case>: lines, long
+      The exit code is 0 when the case passes.
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "serial.h"
+#include "chain.h"
+
+#define CHAIN_BOARD( n ) \
+   void vChainInit_##n( uint8_t uAddress ); \
+   bool fChainInput_##n( char *pcCommand, uint8_t uSize );
+
+CHAIN_BOARD( 1 )
+CHAIN_BOARD( 2 )
+CHAIN_BOARD( 3 )
+CHAIN_BOARD( 4 )
+}
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK( cond ) \
+   do \
+   { \
+      if ( !(cond) ) \
+      { \
+         std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond "\n"; \
+         failures++; \
+      } \
+   } while ( 0 )
+
+constexpr size_t RXSIZE = 128;          /* as SERIAL_RXBUFFERSIZE */
+constexpr size_t TXSIZE = 128;          /* as SERIAL_TXBUFFERSIZE */
+constexpr size_t WIRE = 8;              /* characters per link in a loop pass */
+constexpr size_t HOSTWIRE = 4;          /* the host leaves room for the output of the boards */
+constexpr size_t BOARDS = 4;
+
+/*--------------------------------------------------
+ One board: its serial rings and the chain.c copy it runs
+ --------------------------------------------------*/
+struct Board
+{
+   void                     (*init)( uint8_t ) = nullptr;
+   bool                     (*input)( char *, uint8_t ) = nullptr;
+   uint8_t                  address = 0;
+   std::deque<uint8_t>      rx;
+   std::deque<uint8_t>      tx;
+   uint8_t                  *hold = nullptr;
+   uint8_t                  holdSize = 0;
+   uint8_t                  holdLength = 0;
+   unsigned                 rxOverflow = 0;
+   unsigned                 txOverflow = 0;
+   unsigned                 heldWaits = 0;          /* waits for room while streaming */
+   unsigned                 heldLines = 0;          /* own lines held during a long line */
+   std::vector<std::string> commands;
+};
+
+Board boards[BOARDS];
+Board       *current = nullptr;         /* the board running chain.c */
+std::string host;                       /* received by the host from the last board */
+
+/*--------------------------------------------------
+ One character over the link from board i to the next one (or the host)
+ --------------------------------------------------*/
+void wire( size_t i )
+{
+   uint8_t  c = boards[i].tx.front();
+
+   boards[i].tx.pop_front();
+   if ( i == (BOARDS - 1) )
+   {
+      host += static_cast<char>( c );
+   }
+   else if ( boards[i + 1].rx.size() < RXSIZE )
+   {
+      boards[i + 1].rx.push_back( c );
+   }
+   else
+   {
+      boards[i + 1].rxOverflow++;
+   }
+}
+
+void putTx( Board &b, uint8_t c )
+{
+   if ( b.tx.size() < TXSIZE )
+   {
+      b.tx.push_back( c );
+   }
+   else
+   {
+      b.txOverflow++;
+   }
+}
+
+/*--------------------------------------------------
+ Own output of a board, as vSerialPutChar: prefix, and held while
+ chain.c holds it
+ --------------------------------------------------*/
+void ownOutput( Board &b, const std::string &line )
+{
+   std::string text = "#" + std::to_string( b.address ) + " " + line + "\r\n";
+
+   b.heldLines += (b.hold != nullptr) ? 1 : 0;
+   for ( char c : text )
+   {
+      if ( b.hold != nullptr )
+      {
+         if ( b.holdLength < b.holdSize )
+         {
+            b.hold[b.holdLength++] = static_cast<uint8_t>( c );
+         }
+         else
+         {
+            b.txOverflow++;
+         }
+      }
+      else
+      {
+         putTx( b, static_cast<uint8_t>( c ) );
+      }
+   }
+}
+
+/*--------------------------------------------------
+ A loop pass of all boards: the host sends, every board handles its
+ input (a command is answered with 'R <command>'), every link
+ carries WIRE characters. Every eventEvery passes (0: never) each
+ board reports 'EVENT <n>' of its own
+ --------------------------------------------------*/
+void pass( std::string &send, unsigned eventEvery, unsigned &passes, unsigned *events )
+{
+   char  command[64];
+
+   for ( size_t n = 0; (n < HOSTWIRE) && !send.empty() && (boards[0].rx.size() < RXSIZE); n++ )
+   {
+      boards[0].rx.push_back( static_cast<uint8_t>( send[0] ) );
+      send.erase( 0, 1 );
+   }
+   passes++;
+   for ( size_t i = 0; i < BOARDS; i++ )
+   {
+      current = &boards[i];
+      if ( boards[i].input( command, sizeof(command) ) )
+      {
+         boards[i].commands.push_back( command );
+         ownOutput( boards[i], std::string( "R " ) + command );
+      }
+      if ( (eventEvery != 0) && ((passes % eventEvery) == 0) )
+      {
+         ownOutput( boards[i], "EVENT " + std::to_string( events[i]++ ) );
+      }
+      current = nullptr;
+   }
+   for ( size_t i = BOARDS; i-- > 0; )
+   {
+      for ( size_t n = 0; (n < WIRE) && !boards[i].tx.empty(); n++ )
+      {
+         wire( i );
+      }
+   }
+}
+
+/*--------------------------------------------------
+ Reset all boards (addresses 1..BOARDS) and the host
+ --------------------------------------------------*/
+void setup()
+{
+   void (* const inits[BOARDS])( uint8_t ) = { vChainInit_1, vChainInit_2, vChainInit_3, vChainInit_4 };
+   bool (* const inputs[BOARDS])( char *, uint8_t ) = { fChainInput_1, fChainInput_2, fChainInput_3, fChainInput_4 };
+
+   host.clear();
+   for ( size_t i = 0; i < BOARDS; i++ )
+   {
+      Board &b = boards[i];
+
+      b.init = inits[i];
+      b.input = inputs[i];
+      b.rx.clear();
+      b.tx.clear();
+      b.rxOverflow = b.txOverflow = b.heldWaits = b.heldLines = 0;
+      b.commands.clear();
+      b.address = static_cast<uint8_t>( i + 1 );
+      current = &b;
+      b.init( b.address );
+      current = nullptr;
+   }
+}
+
+/*--------------------------------------------------
+ Run until everything sent has gone around the chain
+ --------------------------------------------------*/
+unsigned run( std::string send, unsigned eventEvery, unsigned *events )
+{
+   unsigned passes = 0;
+   bool     busy = true;
+
+   while ( busy && (passes < 100000) )
+   {
+      pass( send, eventEvery, passes, events );
+      busy = !send.empty();
+      for ( const Board &b : boards )
+      {
+         busy = busy || !b.rx.empty() || !b.tx.empty() || (b.holdLength != 0);
+      }
+   }
+   return passes;
+}
+
+/*--------------------------------------------------
+ The lines the host received
+ --------------------------------------------------*/
+std::vector<std::string> hostLines()
+{
+   std::vector<std::string> lines;
+   size_t start = 0;
+   size_t end;
+
+   while ( (end = host.find( "\r\n", start )) != std::string::npos )
+   {
+      lines.push_back( host.substr( start, end - start ) );
+      start = end + 2;
+   }
+   CHECK( start == host.size() );       /* nothing after the last line */
+   return lines;
+}
+
+bool hasLine( const std::vector<std::string> &lines, const std::string &line )
+{
+   for ( const std::string &l : lines )
+   {
+      if ( l == line )
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+/*--------------------------------------------------
+ Addressed, broadcast and other lines
+ --------------------------------------------------*/
+void testLines()
+{
+   setup();
+   (void) run( "@2 ve\r\n@0 st\r\n@9 xx\r\nplain text\r\n@3:sv 1,10\n", 0, nullptr );
+
+   CHECK( (boards[0].commands == std::vector<std::string>{ "ST" }) );
+   CHECK( (boards[1].commands == std::vector<std::string>{ "VE", "ST" }) );
+   CHECK( (boards[2].commands == std::vector<std::string>{ "ST", "SV 1,10" }) );
+   CHECK( (boards[3].commands == std::vector<std::string>{ "ST" }) );
+
+   std::vector<std::string> lines = hostLines();
+   CHECK( lines.size() == 9 );
+   CHECK( hasLine( lines, "@0 st" ) );
+   CHECK( hasLine( lines, "@9 xx" ) );
+   CHECK( hasLine( lines, "plain text" ) );
+   CHECK( !hasLine( lines, "@2 ve" ) );
+   CHECK( !hasLine( lines, "@3:sv 1,10" ) );
+   CHECK( hasLine( lines, "#2 R VE" ) );
+   CHECK( hasLine( lines, "#3 R SV 1,10" ) );
+   for ( size_t i = 0; i < BOARDS; i++ )
+   {
+      CHECK( hasLine( lines, "#" + std::to_string( i + 1 ) + " R ST" ) );
+   }
+}
+
+/*--------------------------------------------------
+ Lines up to and longer than MAXFORWARDLENGTH, while all boards
+ report events of their own: every line arrives in one piece and no
+ character is lost
+ --------------------------------------------------*/
+void testLong()
+{
+   const std::string collected = "@2 " + std::string( MAXFORWARDLENGTH - 4, 'C' );  /* 95: still collected */
+   const std::string streamed = "@2 " + std::string( MAXFORWARDLENGTH - 3, 'S' );   /* 96: streamed */
+   const std::string longer = "@0 " + std::string( 300, 'L' );
+   unsigned events[BOARDS] = {};
+
+   CHECK( collected.size() == (MAXFORWARDLENGTH - 1) );
+   setup();
+   (void) run( collected + "\r\n" + streamed + "\r\n" + longer + "\r\n@2 ve\r\n", 20, events );
+
+   CHECK( boards[1].commands.size() == 2 );   /* the collected one and VE */
+   CHECK( (boards[1].commands.size() == 2) && (boards[1].commands[1] == "VE") );
+   CHECK( boards[0].commands.empty() );       /* the long broadcast is no command */
+   CHECK( boards[2].commands.empty() );
+   CHECK( boards[3].commands.empty() );
+
+   std::vector<std::string> lines = hostLines();
+   CHECK( !hasLine( lines, collected ) );
+   CHECK( hasLine( lines, streamed ) );
+   CHECK( hasLine( lines, longer ) );
+   std::map<std::string, unsigned> eventLines;
+   for ( const std::string &l : lines )
+   {
+      if ( l.find( "EVENT" ) != std::string::npos )
+      {
+         eventLines[l]++;
+      }
+   }
+   unsigned total = 0;
+   for ( size_t i = 0; i < BOARDS; i++ )
+   {
+      CHECK( boards[i].rxOverflow == 0 );
+      CHECK( boards[i].txOverflow == 0 );
+      CHECK( boards[i].heldLines != 0 );      /* events during the long lines */
+      CHECK( boards[i].heldWaits == 0 );      /* streaming never waits */
+      total += events[i];
+   }
+   CHECK( eventLines.size() == total );       /* each one once, in one piece */
+   CHECK( lines.size() == (total + 4) );      /* 2 long, 1 streamed, R VE and R <collected> */
+}
+
+} // namespace
+
+/***------------------------ The fake serial port -----------------------***/
+/*--------------------------------------------------
+ As in serial.c, for the board running chain.c
+ --------------------------------------------------*/
+extern "C" uint8_t uSerialGetChar( uint8_t *uRcv )
+{
+   if ( current->rx.empty() )
+   {
+      return RESULT_ERROR;
+   }
+   *uRcv = current->rx.front();
+   current->rx.pop_front();
+   return RESULT_SUCCESS;
+}
+
+extern "C" uint8_t uSerialGetFree( void )
+{
+   return static_cast<uint8_t>( TXSIZE - current->tx.size() );
+}
+
+extern "C" uint8_t uSerialPutRaw( const uint8_t *pBuffer, uint8_t uCount )
+{
+   for ( uint8_t i = 0; i < uCount; i++ )
+   {
+      putTx( *current, pBuffer[i] );
+   }
+   return uCount;
+}
+
+/*--------------------------------------------------
+ The link goes on while the board waits
+ --------------------------------------------------*/
+extern "C" bool fSerialWaitFree( uint8_t uBytes )
+{
+   size_t i = static_cast<size_t>( current - boards );
+
+   current->heldWaits += (current->hold != nullptr) ? 1 : 0;
+   while ( (TXSIZE - current->tx.size()) < uBytes )
+   {
+      wire( i );
+   }
+   return true;
+}
+
+extern "C" void vSerialHoldOutput( uint8_t *pBuffer, uint8_t uSize )
+{
+   uint8_t  *held = current->hold;
+
+   current->hold = nullptr;
+   if ( (held != nullptr) && (current->holdLength != 0) )
+   {
+      (void) fSerialWaitFree( current->holdLength );
+      (void) uSerialPutRaw( held, current->holdLength );
+   }
+   current->holdLength = 0;
+   current->holdSize = uSize;
+   current->hold = pBuffer;
+}
+
+int main( int argc, char *argv[] )
+{
+   const struct
+   {
+      const char *name;
+      void       (*run)();
+   } cases[] =
+   {
+      { "lines", testLines },
+      { "long",  testLong },
+   };
+   bool found = false;
+
+   for ( const auto &c : cases )
+   {
+      if ( (argc < 2) || (std::strcmp( argv[1], c.name ) == 0) )
+      {
+         found = true;
+         c.run();
+      }
+   }
+   if ( !found )
+   {
+      std::cerr << "usage: test_chain [lines|long]\n";
+      return 2;
+   }
+   return (failures == 0) ? 0 : 1;
+}
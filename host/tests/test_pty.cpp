@@ -0,0 +1,479 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Tests of the host library against a pseudo terminal
+
+   Contains:
+      A fake board on the master side of a pty answers like the
+      firmware in host mode (or like a daisy chain of boards); the
+      library opens the slave side as its serial port.
+      test_pty <case>: pipeline, window, events, blocks, errors, chain
+      The exit code is 0 when the case passes.
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "stimhost/stimulator.h"
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK( cond ) \
+   do \
+   { \
+      if ( !(cond) ) \
+      { \
+         std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond "\n"; \
+         failures++; \
+      } \
+   } while ( 0 )
+
+/*--------------------------------------------------
+ A board (or a chain of boards) on the master side of a pty.
+ Every command line is answered with 'R <command>' and the prompt;
+ the test commands EV, AQ and XX give events, blocks and an error.
+ While held, lines are received but not answered
+ --------------------------------------------------*/
+class FakeBoard
+{
+public:
+   explicit FakeBoard( std::vector<int> chain = {} ) : chain_( std::move( chain ) )
+   {
+      master_ = posix_openpt( O_RDWR | O_NOCTTY );
+      if ( (master_ < 0) || (grantpt( master_ ) != 0) || (unlockpt( master_ ) != 0) )
+      {
+         std::perror( "posix_openpt" );
+         std::exit( 2 );
+      }
+      device_ = ptsname( master_ );
+      keep_ = ::open( device_.c_str(), O_RDWR | O_NOCTTY );  /* no hangup between opens */
+      running_ = true;
+      thread_ = std::thread( &FakeBoard::loop, this );
+   }
+
+   ~FakeBoard()
+   {
+      running_ = false;
+      thread_.join();
+      ::close( keep_ );
+      ::close( master_ );
+   }
+
+   const std::string &device() const { return device_; }
+
+   void hold( bool on )
+   {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      held_ = on;
+   }
+
+   /* bytes of the lines received but not answered yet, at most */
+   std::size_t maxOutstanding()
+   {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      return maxOutstanding_;
+   }
+
+   std::size_t linesWaiting()
+   {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      return lines_.size();
+   }
+
+   std::size_t bytesReceived()
+   {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      return received_;
+   }
+
+   /* a block as the firmware sends it; bad: wrong checksum */
+   static std::string block( std::uint8_t sequence, const std::vector<std::uint16_t> &words, bool bad )
+   {
+      std::string  out;
+      std::uint8_t check = static_cast<std::uint8_t>( sequence ^ words.size() );
+
+      out += static_cast<char>( 0xA5 );
+      out += static_cast<char>( sequence );
+      out += static_cast<char>( words.size() );
+      for ( std::uint16_t w : words )
+      {
+         out += static_cast<char>( w & 0xFF );
+         out += static_cast<char>( w >> 8 );
+         check ^= static_cast<std::uint8_t>( (w & 0xFF) ^ (w >> 8) );
+      }
+      out += static_cast<char>( bad ? (check ^ 0x5A) : check );
+      return out;
+   }
+
+private:
+   void loop()
+   {
+      std::uint8_t buffer[256];
+      std::string  partial;
+
+      while ( running_ )
+      {
+         struct pollfd pfd = { master_, POLLIN, 0 };
+         if ( ::poll( &pfd, 1, 10 ) > 0 )
+         {
+            ssize_t n = ::read( master_, buffer, sizeof(buffer) );
+            std::lock_guard<std::mutex> lock( mutex_ );
+            for ( ssize_t i = 0; i < n; i++ )
+            {
+               received_++;
+               partial += static_cast<char>( buffer[i] );
+               if ( buffer[i] == '\r' )
+               {
+                  lines_.push_back( partial );
+                  outstanding_ += partial.size();
+                  maxOutstanding_ = std::max( maxOutstanding_, outstanding_ );
+                  partial.clear();
+               }
+            }
+         }
+         answer();
+      }
+   }
+
+   void answer()
+   {
+      std::string out;
+
+      {
+         std::lock_guard<std::mutex> lock( mutex_ );
+         if ( held_ || lines_.empty() )
+         {
+            return;
+         }
+         std::string line = lines_.front();
+         lines_.erase( lines_.begin() );
+         outstanding_ -= line.size();
+         line.pop_back();               /* the CR */
+         if ( chain_.empty() )
+         {
+            out = respond( line, "" );
+         }
+         else
+         {
+            out = respondChain( line );
+         }
+      }
+      write( out );
+   }
+
+   /* standalone: an address is ignored, an empty line gives a prompt */
+   std::string respond( std::string line, const std::string &prefix )
+   {
+      std::string out;
+
+      if ( !line.empty() && (line[0] == '@') )
+      {
+         line = line.substr( std::min( line.size(), line.find( ' ' ) + 1 ) );
+      }
+      if ( line == "HM 1" )
+      {
+         out += prefix + "Host mode: 1\r\n";
+      }
+      else if ( line == "EV" )
+      {
+         out += prefix + "R EV\r\n" + prefix + "START 1\r\n" + prefix + "FINISH 1\r\n";
+      }
+      else if ( line == "AQ" )
+      {
+         out += block( 7, { 0x0123, 0x8001, 0x13FF }, false );
+         out += block( 8, { 0x0011, 0x0013 }, true );
+         out += prefix + "R AQ\r\n";
+         out += block( 9, { 0x1011, 0x0013 }, false );
+      }
+      else if ( line == "XX" )
+      {
+         out += prefix + "Unknown command\r\n";
+      }
+      else if ( !line.empty() )
+      {
+         out += prefix + "R " + line + "\r\n";
+      }
+      return out + prefix + "TERM>\r\n";
+   }
+
+   /* chain: '@<address> ' for one board, '@0 ' for all; others are lost */
+   std::string respondChain( const std::string &line )
+   {
+      std::string out;
+      int         address;
+
+      if ( (line.size() < 2) || (line[0] != '@') )
+      {
+         return line.empty() ? "" : line + "\r\n";   /* forwarded around */
+      }
+      address = std::atoi( line.c_str() + 1 );
+      for ( int board : chain_ )
+      {
+         if ( (address == 0) || (address == board) )
+         {
+            out += respond( line, "#" + std::to_string( board ) + " " );
+         }
+      }
+      return out;
+   }
+
+   void write( const std::string &out )
+   {
+      std::size_t done = 0;
+
+      while ( done < out.size() )
+      {
+         ssize_t n = ::write( master_, out.data() + done, out.size() - done );
+         if ( n <= 0 )
+         {
+            std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+            continue;
+         }
+         done += static_cast<std::size_t>( n );
+      }
+   }
+
+   std::vector<int>         chain_;
+   int                      master_ = -1;
+   int                      keep_ = -1;
+   std::string              device_;
+   std::thread              thread_;
+   std::atomic<bool>        running_{ false };
+   std::mutex               mutex_;
+   std::vector<std::string> lines_;
+   bool                     held_ = false;
+   std::size_t              outstanding_ = 0;
+   std::size_t              maxOutstanding_ = 0;
+   std::size_t              received_ = 0;
+};
+
+stim::Stimulator::Options optionsFor( const FakeBoard &board )
+{
+   stim::Stimulator::Options options;
+
+   options.device = board.device();
+   options.timeout = std::chrono::milliseconds( 3000 );
+   return options;
+}
+
+/*--------------------------------------------------
+ Commands are sent before the previous ones are answered, and every
+ response goes to its own command
+ --------------------------------------------------*/
+void testPipeline()
+{
+   FakeBoard        board;
+   stim::Stimulator stim( optionsFor( board ) );
+   std::vector<std::future<stim::Response>> futures;
+
+   stim.open();
+   board.hold( true );
+   for ( int i = 0; i < 5; i++ )
+   {
+      futures.push_back( stim.send( "SV " + std::to_string( i + 1 ) + ",10,10" ) );
+   }
+   std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );
+   CHECK( board.linesWaiting() == 5 );  /* all sent, none answered */
+   board.hold( false );
+   for ( int i = 0; i < 5; i++ )
+   {
+      stim::Response response = futures[i].get();
+      CHECK( response.ok );
+      CHECK( response.command == "SV " + std::to_string( i + 1 ) + ",10,10" );
+      CHECK( (response.lines.size() == 1) && (response.lines[0] == "R " + response.command) );
+   }
+}
+
+/*--------------------------------------------------
+ At most 64 command bytes are in flight; send() waits for room
+ --------------------------------------------------*/
+void testWindow()
+{
+   FakeBoard        board;
+   stim::Stimulator stim( optionsFor( board ) );
+   std::vector<std::future<stim::Response>> futures;
+   std::size_t      total = 0;
+
+   stim.open();
+   std::size_t atOpen = board.bytesReceived();
+   board.hold( true );
+   auto sender = std::async( std::launch::async, [&] {
+      for ( int i = 0; i < 20; i++ )
+      {
+         std::string command = "ST 1,0," + std::to_string( 10 + i ) + ",0,10,100";
+         total += command.size() + 1;
+         futures.push_back( stim.send( command ) );
+      }
+   } );
+   std::this_thread::sleep_for( std::chrono::milliseconds( 300 ) );
+   CHECK( sender.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::timeout );  /* waiting */
+   CHECK( board.bytesReceived() - atOpen <= 64 );
+   board.hold( false );
+   sender.get();
+   for ( int i = 0; i < 20; i++ )
+   {
+      stim::Response response = futures[i].get();
+      CHECK( response.lines.size() == 1 );
+      CHECK( response.lines[0] == "R " + response.command );
+   }
+   CHECK( board.bytesReceived() - atOpen == total );
+   CHECK( board.maxOutstanding() <= 64 );
+}
+
+/*--------------------------------------------------
+ START and FINISH go to the handler and waitEvent, not to the
+ response
+ --------------------------------------------------*/
+void testEvents()
+{
+   FakeBoard        board;
+   stim::Stimulator stim( optionsFor( board ) );
+   std::mutex       mutex;
+   std::vector<std::string> names;
+
+   stim.onEvent( [&]( const stim::Event &ev ) {
+      std::lock_guard<std::mutex> lock( mutex );
+      names.push_back( ev.name + " " + std::to_string( ev.values.empty() ? -1 : ev.values[0] ) );
+   } );
+   stim.open();
+   stim::Response response = stim.call( "EV" );
+   CHECK( (response.lines.size() == 1) && (response.lines[0] == "R EV") );
+   CHECK( stim.waitEvent( "START", 1, std::chrono::milliseconds( 1000 ) ) );
+   CHECK( stim.waitEvent( "FINISH", 1, std::chrono::milliseconds( 1000 ) ) );
+   std::lock_guard<std::mutex> lock( mutex );
+   CHECK( (names.size() == 2) && (names[0] == "START 1") && (names[1] == "FINISH 1") );
+}
+
+/*--------------------------------------------------
+ Blocks between the lines are decoded; one with a bad checksum is
+ counted and dropped, and does not disturb the lines
+ --------------------------------------------------*/
+void testBlocks()
+{
+   FakeBoard        board;
+   stim::Stimulator stim( optionsFor( board ) );
+   std::mutex       mutex;
+   std::vector<stim::SampleBlock> blocks;
+
+   stim.onSamples( [&]( const stim::SampleBlock &block ) {
+      std::lock_guard<std::mutex> lock( mutex );
+      blocks.push_back( block );
+   } );
+   stim.open();
+   stim::Response response = stim.call( "AQ" );
+   CHECK( (response.lines.size() == 1) && (response.lines[0] == "R AQ") );
+   CHECK( stim.badBlocks() == 1 );
+   std::lock_guard<std::mutex> lock( mutex );
+   CHECK( blocks.size() == 2 );
+   if ( blocks.size() == 2 )
+   {
+      CHECK( blocks[0].sequence == 7 );
+      CHECK( (blocks[0].words == std::vector<std::uint16_t>{ 0x0123, 0x8001, 0x13FF }) );
+      CHECK( stim::SampleBlock::isSample( blocks[0].words[0] ) && (stim::SampleBlock::value( blocks[0].words[0] ) == 0x123) );
+      CHECK( stim::SampleBlock::isMarker( blocks[0].words[1] ) && (stim::SampleBlock::markerChannel( blocks[0].words[1] ) == 2) );
+      CHECK( (stim::SampleBlock::input( blocks[0].words[2] ) == 1) && !stim::SampleBlock::isSample( 0x0FFF ) );
+      CHECK( blocks[1].sequence == 9 );
+      CHECK( (blocks[1].words == std::vector<std::uint16_t>{ 0x1011, 0x0013 }) );  /* XON/XOFF values are data */
+   }
+}
+
+/*--------------------------------------------------
+ An error line marks the response as failed
+ --------------------------------------------------*/
+void testErrors()
+{
+   FakeBoard        board;
+   stim::Stimulator stim( optionsFor( board ) );
+
+   stim.open();
+   CHECK( !stim.call( "XX" ).ok );
+   CHECK( stim.call( "VE" ).ok );
+}
+
+/*--------------------------------------------------
+ Chain of three boards: a broadcast ends with the prompts of all of
+ them, so the next response is not taken by its remaining prompts
+ --------------------------------------------------*/
+void testChain()
+{
+   FakeBoard                 board( { 1, 2, 3 } );
+   stim::Stimulator::Options options = optionsFor( board );
+
+   options.boards = 3;
+   stim::Stimulator stim( options );
+   stim.open();
+   std::future<stim::Response> all = stim.send( "@0 OF" );
+   std::future<stim::Response> one = stim.send( "@2 VE" );
+   stim::Response response = all.get();
+   CHECK( response.lines.size() == 3 );
+   CHECK( std::count( response.lines.begin(), response.lines.end(), "R OF" ) == 3 );
+   response = one.get();
+   CHECK( (response.lines.size() == 1) && (response.lines[0] == "R VE") );
+}
+
+} // namespace
+
+int main( int argc, char *argv[] )
+{
+   const struct
+   {
+      const char *name;
+      void       (*run)();
+   } cases[] =
+   {
+      { "pipeline", testPipeline },
+      { "window",   testWindow },
+      { "events",   testEvents },
+      { "blocks",   testBlocks },
+      { "errors",   testErrors },
+      { "chain",    testChain },
+   };
+   bool found = false;
+
+   for ( const auto &c : cases )
+   {
+      if ( (argc < 2) || (std::strcmp( argv[1], c.name ) == 0) )
+      {
+         found = true;
+         try
+         {
+            c.run();
+         }
+         catch ( const std::exception &e )
+         {
+            std::cerr << c.name << ": " << e.what() << "\n";
+            failures++;
+         }
+      }
+   }
+   if ( !found )
+   {
+      std::cerr << "usage: test_pty [pipeline|window|events|blocks|errors|chain]\n";
+      return 2;
+   }
+   return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,204 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Command line control of a stimulator board
+
+   Contains:
+      stimctl [options] [command ...]
+      The commands (from the arguments, or one per line from stdin) are
+      sent pipelined; every response is printed after '> <command>'.
+      Events are printed with '! ' in front (-e). Afterwards it can wait
+      for an event (-u) or listen for some time (-t). The exit code is 1
+      when a command failed or the awaited event did not come.
+
+   Module:
+      stimhost
+
+------------------------------------------------------------------------------
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "stimhost/stimulator.h"
+
+namespace
+{
+
+void usage()
+{
+   std::cerr <<
+      "usage: stimctl [-d device] [-b baud] [-w window] [-n boards] [-e]\n"
+      "               [-u event[,channel]] [-t seconds] [-a file] [command ...]\n"
+      "  -d  serial device (default /dev/ttyUSB0), a pseudo terminal works as well\n"
+      "  -b  baudrate (default 38400)\n"
+      "  -w  command bytes in flight (default 64)\n"
+      "  -n  boards in a daisy chain (commands need '@<address> ', '@0' is all)\n"
+      "  -e  print the events (START, FINISH, NewPeriod, ...)\n"
+      "  -u  wait for an event after the commands, f.i. FINISH,1\n"
+      "  -t  seconds to wait for -u, or to listen without -u (default 10 with -u)\n"
+      "  -a  write the acquisition blocks to a file, one word per line\n"
+      "  without commands they are read from stdin, one per line\n";
+}
+
+} // namespace
+
+int main( int argc, char *argv[] )
+{
+   stim::Stimulator::Options options;
+   bool                      printEvents = false;
+   std::string               waitName;
+   long                      waitChannel = 0;
+   int                       seconds = -1;
+   std::string               sampleFile;
+   std::vector<std::string>  commands;
+   std::mutex                outputMutex;
+   int                       opt;
+
+   options.device = "/dev/ttyUSB0";
+   while ( (opt = getopt( argc, argv, "d:b:w:n:eu:t:a:h" )) != -1 )
+   {
+      switch ( opt )
+      {
+         case 'd' : options.device = optarg; break;
+         case 'b' : options.baud = static_cast<unsigned>( std::strtoul( optarg, nullptr, 10 ) ); break;
+         case 'w' : options.window = std::strtoul( optarg, nullptr, 10 ); break;
+         case 'n' : options.boards = static_cast<unsigned>( std::strtoul( optarg, nullptr, 10 ) ); break;
+         case 'e' : printEvents = true; break;
+         case 'u' :
+         {
+            std::string arg = optarg;
+            std::size_t comma = arg.find( ',' );
+            waitName = arg.substr( 0, comma );
+            if ( comma != std::string::npos )
+            {
+               waitChannel = std::strtol( arg.c_str() + comma + 1, nullptr, 10 );
+            }
+            break;
+         }
+         case 't' : seconds = std::atoi( optarg ); break;
+         case 'a' : sampleFile = optarg; break;
+         default:
+            usage();
+            return 2;
+      }
+   }
+   for ( int i = optind; i < argc; i++ )
+   {
+      commands.emplace_back( argv[i] );
+   }
+   if ( optind == argc )
+   {
+      std::string line;
+      while ( std::getline( std::cin, line ) )
+      {
+         if ( !line.empty() )
+         {
+            commands.push_back( line );
+         }
+      }
+   }
+
+   std::ofstream samples;
+   if ( !sampleFile.empty() )
+   {
+      samples.open( sampleFile );
+      if ( !samples )
+      {
+         std::cerr << "stimctl: can not write " << sampleFile << "\n";
+         return 2;
+      }
+   }
+
+   stim::Stimulator board( options );
+   if ( printEvents )
+   {
+      board.onEvent( [&outputMutex]( const stim::Event &ev ) {
+         std::lock_guard<std::mutex> lock( outputMutex );
+         std::cout << "! " << ev.line << "\n" << std::flush;
+      } );
+   }
+   if ( samples.is_open() )
+   {
+      board.onSamples( [&samples]( const stim::SampleBlock &block ) {
+         for ( std::uint16_t w : block.words )
+         {
+            if ( stim::SampleBlock::isMarker( w ) )
+            {
+               samples << "M " << stim::SampleBlock::markerChannel( w ) << "\n";
+            }
+            else if ( stim::SampleBlock::isSample( w ) )
+            {
+               samples << "S " << stim::SampleBlock::input( w ) << " " << stim::SampleBlock::value( w ) << "\n";
+            }
+            else
+            {
+               samples << "N " << stim::SampleBlock::input( w ) << "\n";
+            }
+         }
+      } );
+   }
+
+   int result = 0;
+   try
+   {
+      std::vector<std::future<stim::Response>> futures;
+
+      board.open();
+      for ( const std::string &command : commands )
+      {
+         futures.push_back( board.send( command ) );
+      }
+      for ( auto &future : futures )
+      {
+         if ( future.wait_for( options.timeout ) != std::future_status::ready )
+         {
+            throw std::runtime_error( "no response from the stimulator" );
+         }
+         stim::Response response = future.get();
+         std::lock_guard<std::mutex> lock( outputMutex );
+         std::cout << "> " << response.command << "\n";
+         for ( const std::string &line : response.lines )
+         {
+            std::cout << line << "\n";
+         }
+         std::cout << std::flush;
+         if ( !response.ok )
+         {
+            result = 1;
+         }
+      }
+      if ( !waitName.empty() )
+      {
+         if ( !board.waitEvent( waitName, waitChannel, std::chrono::seconds( (seconds < 0) ? 10 : seconds ) ) )
+         {
+            std::cerr << "stimctl: no " << waitName << " event\n";
+            result = 1;
+         }
+      }
+      else if ( seconds > 0 )
+      {
+         std::this_thread::sleep_for( std::chrono::seconds( seconds ) );
+      }
+      board.close();
+   }
+   catch ( const std::exception &e )
+   {
+      std::cerr << "stimctl: " << e.what() << "\n";
+      return 2;
+   }
+   if ( board.badBlocks() != 0 )
+   {
+      std::cerr << "stimctl: " << board.badBlocks() << " bad acquisition blocks\n";
+   }
+   return result;
+}
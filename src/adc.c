@@ -0,0 +1,329 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements the synchronous acquisition of analog inputs
+
+   Contains:
+      Timer1 (the fine time base of the pulses) compare B starts every
+      conversion, so the samples are on the same clock as the stimulus.
+      The compare B interrupt advances OCR1B by one period; the ADC
+      interrupt puts the sample in a ring and switches to the next input.
+      Pulse starts are put in the same ring as marker words, between the
+      samples before and after the pulse.
+      The main loop sends the ring in binary blocks:
+        ADC_BLOCKSYNC, sequence, word count, words (low byte first), checksum
+      The checksum is the xor of sequence, count and the data bytes.
+      The output monitor borrows the ADC for two fast conversions in
+      each phase of a pulse; the acquisition puts ADC_NOSAMPLE for a conversion that
+      could not be made, so the time grid of the samples stays intact.
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _lint
+ #ifdef ____ATTR_PURE__
+   #undef __ATTR_PURE__
+ #endif
+ #ifdef __attribute__
+   #undef __attribute__
+ #endif
+ #define __ATTR_PURE__
+ #define __attribute__(var)
+#endif
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "board.h"
+#include "serial.h"
+#include "adc.h"
+
+/***------------------------- Defines -----------------------------------***/
+
+#if (((1 << MONITOR_VOLTAGE_INPUT) | (1 << MONITOR_CURRENT_INPUT)) & ADC_INPUTS) != 0
+#error "The output monitor uses an input of the acquisition (AQ)"
+#endif
+
+#define ADC_RINGSIZE       128          /* words; power of 2 */
+#define RINGMASK           (ADC_RINGSIZE - 1)
+#define TIMER1_HZ          250000UL     /* timer1 counts/s (4us) */
+#define ADC_PRESCALER      ((1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0))  /* 125kHz: 104us/conversion */
+#define ADC_TRIGGER_COMPB  ((1 << ADTS2) | (1 << ADTS0))  /* timer1 compare match B */
+#define MONITOR_PRESCALER  ((1 << ADPS2) | (1 << ADPS0))  /* 500kHz: 26us/conversion, 8 bits */
+
+/* Output monitor conversions */
+#define MONITOR_IDLE       0
+#define MONITOR_VOLTAGE    1
+#define MONITOR_CURRENT    2
+#define MONITOR_DONE       3
+
+/***----------------------- Local Types ---------------------------------***/
+
+/***------------------------- Local Data --------------------------------***/
+
+static uint16_t            uAdcRate;         /* conversions/s, 0: off */
+static uint8_t             uAdcInputs;       /* inputs used (bit mask) */
+static volatile uint16_t   uAdcPeriod;       /* timer1 counts between conversions */
+static volatile uint8_t    uAdcInput;        /* input of the running conversion */
+static volatile uint16_t   uAdcRing[ADC_RINGSIZE];
+static volatile uint8_t    uRingHead;        /* next word to write (interrupts) */
+static uint8_t             uRingTail;        /* next word to send (main loop) */
+static volatile uint16_t   uAdcLost;         /* words lost: ring full */
+static uint16_t            uAdcBlocks;       /* blocks sent */
+static uint8_t             uBlockSequence;
+static volatile uint8_t    uMonitorState;    /* MONITOR_IDLE .. MONITOR_DONE */
+static volatile uint16_t   uMonitorVoltage;
+static volatile uint16_t   uMonitorCurrent;
+
+/***------------------------ Local functions ----------------------------***/
+/*--------------------------------------------------
+ Put a word in the ring (interrupts are disabled)
+ --------------------------------------------------*/
+static void vRingPut( uint16_t uWord )
+{
+   uint8_t  uNext = (uRingHead + 1) & RINGMASK;
+
+   if ( uNext == uRingTail )
+   {
+      uAdcLost += (uAdcLost != UINT16_MAX);
+      return;
+   }
+   uAdcRing[uRingHead] = uWord;
+   uRingHead = uNext;
+}
+
+/*--------------------------------------------------
+ The next input after uInput in the mask
+ --------------------------------------------------*/
+static uint8_t uNextInput( uint8_t uInput )
+{
+   do
+   {
+      uInput = (uInput + 1) & 7;
+   } while ( (uAdcInputs & (1 << uInput)) == 0 );
+   return uInput;
+}
+
+/*--------------------------------------------------
+ Back to the acquisition (or ADC off) after the monitor
+ --------------------------------------------------*/
+static void vResumeAcquisition( void )
+{
+   if ( uAdcRate != 0 )
+   {
+      ADMUX = (1 << REFS0) | uAdcInput;
+      ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADIF) | ADC_PRESCALER;
+   }
+   else
+   {
+      ADCSRA = 0;
+   }
+}
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Start (or stop with rate 0) the acquisition. The ring is emptied
+ --------------------------------------------------*/
+void vAdcStart( uint16_t uRate, uint8_t uInputs )
+{
+   cli();
+   TIMSK1 &= ~(1 << OCIE1B);
+   ADCSRA = 0;                          /* ADC off */
+   uRingHead = 0;
+   uRingTail = 0;
+   uAdcLost = 0;
+   uAdcRate = 0;
+   uMonitorState = MONITOR_IDLE;
+   DIDR0 &= ~uAdcInputs;                /* digital input buffers back on */
+   uAdcInputs = 0;
+   uInputs &= ADC_INPUTS;
+   if ( (uRate != 0) && (uInputs != 0) )
+   {
+      uAdcRate = uRate;
+      uAdcInputs = uInputs;
+      uAdcPeriod = (uint16_t) (TIMER1_HZ / uRate);
+      uAdcInput = uNextInput( 7 );      /* the lowest input */
+      DIDR0 |= uInputs;                 /* no digital input buffer */
+      ADMUX = (1 << REFS0) | uAdcInput; /* AVcc reference */
+      ADCSRB = ADC_TRIGGER_COMPB;
+      OCR1B = TCNT1 + uAdcPeriod;
+      TIFR1 = (1 << OCF1B);             /* clear OCF1B by writing a 1 */
+      TIMSK1 |= (1 << OCIE1B);
+      ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADIF) | ADC_PRESCALER;
+   }
+   sei();
+}
+
+void vAdcGetSetup( uint16_t *puRate, uint8_t *puInputs )
+{
+   *puRate = uAdcRate;
+   *puInputs = uAdcInputs;
+}
+
+bool fAdcRunning( void )
+{
+   return (uAdcRate != 0);
+}
+
+/*--------------------------------------------------
+ Pulse start marker
+ --------------------------------------------------*/
+void vAdcMark( uint8_t channel )
+{
+   if ( uAdcRate != 0 )
+   {
+      ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+      {
+         vRingPut( ADC_MARKER | channel );
+      }
+   }
+}
+
+/*--------------------------------------------------
+ Output monitor: start the voltage conversion; the interrupt
+ does the current next. Not when a conversion is running
+ --------------------------------------------------*/
+bool fAdcMonitorStart( void )
+{
+   bool  fStarted = false;
+
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+   {
+      if ( ((ADCSRA & (1 << ADSC)) == 0) && (uMonitorState == MONITOR_IDLE) )
+      {
+         DIDR0 |= ((1 << MONITOR_VOLTAGE_INPUT) | (1 << MONITOR_CURRENT_INPUT)) & 0x3F;  /* A6, A7 have none */
+         ADMUX = (1 << REFS0) | MONITOR_VOLTAGE_INPUT;
+         ADCSRA = (1 << ADEN) | (1 << ADIE) | (1 << ADIF) | MONITOR_PRESCALER;
+         ADCSRA |= (1 << ADSC);
+         uMonitorState = MONITOR_VOLTAGE;
+         fStarted = true;
+      }
+   }
+   return fStarted;
+}
+
+bool fAdcMonitorTake( uint16_t *puVoltage, uint16_t *puCurrent )
+{
+   bool  fDone = false;
+
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+   {
+      if ( uMonitorState == MONITOR_DONE )
+      {
+         *puVoltage = uMonitorVoltage;
+         *puCurrent = uMonitorCurrent;
+         uMonitorState = MONITOR_IDLE;
+         fDone = true;
+      }
+   }
+   return fDone;
+}
+
+/*--------------------------------------------------
+ Statistics since the last call
+ --------------------------------------------------*/
+void vAdcGetStats( uint16_t *puBlocks, uint16_t *puLost )
+{
+   *puBlocks = uAdcBlocks;
+   uAdcBlocks = 0;
+   cli();
+   *puLost = uAdcLost;
+   uAdcLost = 0;
+   sei();
+}
+
+/*--------------------------------------------------
+ Send a block when there is a full one and room in the
+ transmit buffer
+ --------------------------------------------------*/
+void vDoAdc( void )
+{
+   uint8_t  acBlock[ADC_BLOCKWORDS * 2 + 4];
+   uint8_t  uCheck;
+   uint8_t  uLength;
+   uint8_t  i;
+   uint16_t uWord;
+
+   if ( (uAdcRate == 0) ||
+        (((uRingHead - uRingTail) & RINGMASK) < ADC_BLOCKWORDS) ||
+        (uSerialGetFree() < sizeof(acBlock)) )
+   {
+      return;
+   }
+   acBlock[0] = ADC_BLOCKSYNC;
+   acBlock[1] = uBlockSequence;
+   acBlock[2] = ADC_BLOCKWORDS;
+   uCheck = uBlockSequence ^ ADC_BLOCKWORDS;
+   uLength = 3;
+   for ( i = 0; i < ADC_BLOCKWORDS; i++ )
+   {
+      uWord = uAdcRing[uRingTail];      /* the ISR does not write here */
+      uRingTail = (uRingTail + 1) & RINGMASK;
+      acBlock[uLength++] = (uint8_t) uWord;
+      acBlock[uLength++] = (uint8_t) (uWord >> 8);
+      uCheck ^= (uint8_t) uWord ^ (uint8_t) (uWord >> 8);
+   }
+   acBlock[uLength++] = uCheck;
+   (void) uSerialPutRaw( acBlock, uLength );
+   uBlockSequence++;
+   uAdcBlocks += (uAdcBlocks != UINT16_MAX);
+}
+
+/***------------------------ Interrupt functions ------------------------***/
+/*--------------------------------------------------
+ Timer1 compare B: the conversion was started; next moment.
+ Running this interrupt clears OCF1B for the next auto trigger
+ --------------------------------------------------*/
+#ifdef _lint
+void TIMER1_COMPB_vect( void )
+#else
+ISR(TIMER1_COMPB_vect)
+#endif
+{
+   OCR1B += uAdcPeriod;
+   if ( (uMonitorState == MONITOR_VOLTAGE) || (uMonitorState == MONITOR_CURRENT) )
+   {
+      vRingPut( ((uint16_t) uAdcInput << ADC_INPUTSHIFT) | ADC_NOSAMPLE );
+      uAdcInput = uNextInput( uAdcInput );  /* no conversion: keep the sequence */
+   }
+}
+
+/*--------------------------------------------------
+ Conversion complete: store and select the next input
+ --------------------------------------------------*/
+#ifdef _lint
+void ADC_vect( void )
+#else
+ISR(ADC_vect)
+#endif
+{
+   uint16_t uSample = ADC;
+
+   if ( uMonitorState == MONITOR_VOLTAGE )
+   {
+      uMonitorVoltage = uSample;
+      ADMUX = (1 << REFS0) | MONITOR_CURRENT_INPUT;
+      ADCSRA |= (1 << ADSC);
+      uMonitorState = MONITOR_CURRENT;
+      return;
+   }
+   if ( uMonitorState == MONITOR_CURRENT )
+   {
+      uMonitorCurrent = uSample;
+      uMonitorState = MONITOR_DONE;
+      vResumeAcquisition();
+      return;
+   }
+   vRingPut( ((uint16_t) uAdcInput << ADC_INPUTSHIFT) | uSample );
+   uAdcInput = uNextInput( uAdcInput );
+   ADMUX = (1 << REFS0) | uAdcInput;    /* used by the next conversion */
+}
+
+/* EOF */
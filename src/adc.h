@@ -0,0 +1,69 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements the synchronous acquisition of analog inputs
+
+   Contains:
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+#ifndef ADC_H_
+#define ADC_H_
+
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+
+/***------------------------- Defines ------------------------------------***/
+
+#define ADC_INPUTS         0x03         /* inputs that can be used: A0 (PC0), A1 (PC1) */
+#define ADC_RATEMIN        4            /* conversions/s; timer1 compare B range */
+#define ADC_RATEMAX        5000
+
+#define ADC_BLOCKSYNC      0xA5         /* first byte of a binary block */
+#define ADC_BLOCKWORDS     16           /* words in a block */
+
+/* A word in a block: a sample with the input number, or a pulse marker */
+#define ADC_MARKER         0x8000       /* | channel (0..): pulse start */
+#define ADC_INPUTSHIFT     12           /* sample: input << 12 | 10 bit value */
+#define ADC_NOSAMPLE       0x0FFF       /* | input << 12: skipped for the monitor */
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Start the acquisition at uRate conversions/s, alternating over the
+ inputs in uInputs (bit mask of ADC_INPUTS); uRate 0 stops
+ --------------------------------------------------*/
+extern void vAdcStart( uint16_t uRate, uint8_t uInputs );
+extern void vAdcGetSetup( uint16_t *puRate, uint8_t *puInputs );
+extern bool fAdcRunning( void );
+
+/*--------------------------------------------------
+ Mark the start of a pulse in the sample stream
+ --------------------------------------------------*/
+extern void vAdcMark( uint8_t channel );
+
+/*--------------------------------------------------
+ Output monitor: convert the voltage and current sense inputs now
+ (in the background, the acquisition pauses); false when the ADC is
+ busy. Take the result after the phase; false when there is none
+ --------------------------------------------------*/
+extern bool fAdcMonitorStart( void );
+extern bool fAdcMonitorTake( uint16_t *puVoltage, uint16_t *puCurrent );
+
+/*--------------------------------------------------
+ Blocks sent and words lost (ring full) since the last call
+ --------------------------------------------------*/
+extern void vAdcGetStats( uint16_t *puBlocks, uint16_t *puLost );
+
+/*--------------------------------------------------
+ From the main loop: send the full blocks
+ --------------------------------------------------*/
+extern void vDoAdc( void );
+
+#endif /* ADC_H_ */
@@ -26,9 +26,12 @@
  #define __attribute__(var)
 #endif
 #include <avr/interrupt.h>
+#include <avr/wdt.h>
 #include <stdint.h>
 #include <avr/pgmspace.h>
 #include "board.h"
+#include "sync.h"
+#include "waveform.h"
 
 /***------------------------- Defines ------------------------------------***/
 
@@ -44,42 +47,55 @@ SPI devices defines
 #define mcp2510_select()   PORTB &= ~(1 << MCP2510_CS)
 #define mcp2510_deselect() PORTB |= (1 << MCP2510_CS)
 
-#define MCP42100_CS        2            /* port PB2 selects MCP42100 */
 #define COMMAND_P0         0x11         /* command to set potentiometer P0  */
 #define COMMAND_P1         0x12         /* command to set potentiometer P1  */
 #define COMMAND_P01        0x13         /* command to set potentiometer P0 and P1  */
 
-#define mcp42100_select()   PORTB &= ~(1 << MCP42100_CS)
-#define mcp42100_deselect() PORTB |= (1 << MCP42100_CS)
-
 /* The macro version */
 #define vXmtSPI(dat)       {SPDR=(dat); loop_until_bit_is_set(SPSR,SPIF);}
 
 //#define vXmtSPI(dat)       {(void)dat;}
 /*--------------------------------------------------
-channel selects and direction ports for the H-bridges
- port is PD for A, C, D. port is PB for B
+ Drivers generated from the board description (board.h). A channel
+ is named by the port and enable bit of its H-bridge
  --------------------------------------------------*/
-#define A_Enable           2
-#define B_Enable           1
-#define C_Enable           6
-#define D_Enable           4
-#define A_Direction        3
-#define B_Direction        0
-#define C_Direction        7
-#define D_Direction        5
-
-
-#define SetPD(pin)         PORTD |= (1 << pin)
-#define ResetPD(pin)       PORTD &= ~(1 << pin)
-#define SetPB(pin)         PORTB |= (1 << pin)
-#define ResetPB(pin)       PORTB &= ~(1 << pin)
+#define CH_ENUM(port, en, dir, csport, cs, wiper)    CHANNEL_##port##en,
+
+#define CH_PORTINIT(port, en, dir, csport, cs, wiper) \
+    DDR##port |= (1 << (en)) | (1 << (dir)); \
+    PORT##port |= (1 << (dir)); \
+    DDR##csport |= (1 << (cs)); \
+    PORT##csport |= (1 << (cs));
+
+#define CH_POSITIVE(port, en, dir, csport, cs, wiper) \
+    case CHANNEL_##port##en : \
+       PORT##port &= ~(1 << (dir)); \
+       PORT##port |= (1 << (en)); \
+       break;
+
+#define CH_NEGATIVE(port, en, dir, csport, cs, wiper) \
+    case CHANNEL_##port##en : \
+       PORT##port |= (1 << (dir)); \
+       PORT##port |= (1 << (en)); \
+       break;
+
+#define CH_CLEAR(port, en, dir, csport, cs, wiper) \
+    case CHANNEL_##port##en :  PORT##port &= ~(1 << (en)); break;
+
+#define CH_VOLTAGE(port, en, dir, csport, cs, wiper) \
+    case CHANNEL_##port##en : \
+       PORT##csport &= ~(1 << (cs)); \
+       vWritePot( uCode, (wiper) ); \
+       PORT##csport |= (1 << (cs)); \
+       break;
 
 /***------------------------- Types -------------------------------------***/
 
 /***----------------------- Local Types ---------------------------------***/
+enum eBoardChannel { BOARD_CHANNELS( CH_ENUM ) };    /* a double pin gives an error */
 
 /***------------------------- Local Data --------------------------------***/
+static uint8_t  uPinsLast;              /* auxiliary port at the last pin change */
 
 /***------------------------ Global Data --------------------------------***/
 
@@ -111,13 +127,12 @@ static void vInitMCP( void )
 #endif
 
 /*--------------------------------------------------
-write data to MCP42100 potentiometer
+write data to a MCP42xxx potentiometer (the chip is selected)
  --------------------------------------------------*/
 static void vWritePot(uint8_t value, uint8_t pot)
 {
    uint8_t  command;
 
-   value = (value << 2) + value;        /* value*5 (value is 0..50, pot gets 0..250) */
    switch ( pot )
    {
       case 0 :
@@ -129,23 +144,27 @@ static void vWritePot(uint8_t value, uint8_t pot)
       default:
          command = COMMAND_P01;
    }
-   mcp42100_select();
    vXmtSPI( command );                  /* give command and */
    vXmtSPI( value );                    /* data */
-   mcp42100_deselect();
 }
 
 /***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Port directions and levels: no H-bridge enabled
+ --------------------------------------------------*/
+void vInitPorts(void)
+{
+   BOARD_CHANNELS( CH_PORTINIT )        /* H-bridges not enabled, pots not selected */
+   DDRB |= SPI_OUTPUTS;                 /* SS must be an output for the SPI master */
+   AUX_DDR |= (1 << LED_PIN) | (1 << MARKER_PIN);
+   LED_OFF();
+   MARKER_OFF();
+}
+
 void vInitBoard(void)
 {
    cli();                               /* no interrupts anymore */
-   /* init ports */
-   DDRD  = 0xFC;  //0b11111100;        /* Set the port to correct configuration (pd2..pd7 output) */
-   PORTD = 0xA8;                       /* None of the H-Bridges enabled */
-   DDRB  = 0x2F;  //0b00101111;        /* Set the port to correct configuration (pb0/1=outp, PB2=CS, PB3=MOSI, PB4=MISO, PB5=CLK */
-   PORTB = 0xFC;  //0b11111100;
-   DDRC  = 0x20;  //0b00100000;         /* PC5 is led */
-   PORTC = 0x20;                        /* PC5 '1' is off */
+   vInitPorts();
    /* init SPI (datadirection is already set) (must be done after port dir initialization) */
    SPCR = 0x50;                        /* Enable SPI function in master mode 0 (fast interface) */
    SPSR = 0x00;                        /* SPI normal mode */
@@ -157,44 +176,55 @@ void vInitBoard(void)
 }
 
 /*--------------------------------------------------
- Set a voltage using the pots as DAC
+ Start the watchdog (0.5s) in interrupt and reset mode
+ --------------------------------------------------*/
+void vInitWatchdog(void)
+{
+   cli();
+   wdt_reset();
+   WDTCSR = _BV(WDCE) | _BV(WDE);       /* timed sequence for changing the mode */
+   WDTCSR = _BV(WDIE) | _BV(WDE) | _BV(WDP2) | _BV(WDP0);
+   sei();
+}
+
+/*--------------------------------------------------
+ Safe output state: no H-bridge enabled, led off
  --------------------------------------------------*/
-void setVoltage(uint8_t channel, uint8_t decivolts)
+void vAllOutputsOff(void)
 {
-   if ( (channel == 0) || (channel == 1) )
+   uint8_t  channel;
+
+   for ( channel = 0; channel < CHANNELCOUNT; channel++ )
    {
-      vWritePot(decivolts, 0);
-   } else
+      clearHBridge( channel );
+   }
+   LED_OFF();
+}
+
+/*--------------------------------------------------
+ Set the voltage of a channel using the pots as DAC; the code is
+ ready (calibrated) from the settings, see vSetVoltages
+ --------------------------------------------------*/
+void setPotCode(uint8_t channel, uint8_t uCode)
+{
+   switch ( channel )
    {
-      vWritePot(decivolts, 1);
+      BOARD_CHANNELS( CH_VOLTAGE )
+      default:
+         break;
    }
 }
 
 /*--------------------------------------------------
 Set H-Bridge function for a channel
  This will enable the channel in either pos or neg side
- channel: 0 for A and 1 B, 2 for C and 3 D
+ channel: 0 for the first channel of the board description
  --------------------------------------------------*/
 void setHBridgePositive(uint8_t channel)
 {
    switch ( channel )
    {
-      case 0 :
-         ResetPD(A_Direction);
-         SetPD(A_Enable);
-         break;
-      case 1 :
-         ResetPB(B_Direction);
-         SetPB(B_Enable);
-         break;
-      case 2 :
-         ResetPD(C_Direction);
-         SetPD(C_Enable);
-         break;
-      case 3 :
-         ResetPD(D_Direction);
-         SetPD(D_Enable);
-         break;
+      BOARD_CHANNELS( CH_POSITIVE )
       default:
          break;
    }
@@ -203,22 +233,7 @@ void setHBridgeNegative(uint8_t channel)
 {
    switch ( channel )
    {
-      case 0 :
-         SetPD(A_Direction);
-         SetPD(A_Enable);
-         break;
-      case 1 :
-         SetPB(B_Direction);
-         SetPB(B_Enable);
-         break;
-      case 2 :
-         SetPD(C_Direction);
-         SetPD(C_Enable);
-         break;
-      case 3 :
-         SetPD(D_Direction);
-         SetPD(D_Enable);
-         break;
+      BOARD_CHANNELS( CH_NEGATIVE )
       default:
          break;
    }
@@ -231,12 +246,84 @@ void clearHBridge(uint8_t channel)
 {
    switch ( channel )
    {
-      case 0 :  ResetPD(A_Enable); break;
-      case 1 :  ResetPB(B_Enable); break;
-      case 2 :  ResetPD(C_Enable); break;
-      case 3 :  ResetPD(D_Enable); break;
+      BOARD_CHANNELS( CH_CLEAR )
       default:  break;
    }
 }
 
+/*--------------------------------------------------
+ Pin change interrupt on/off for a pin of the auxiliary port
+ (interrupts are disabled)
+ --------------------------------------------------*/
+void vBoardPinChangeEnable(uint8_t uPin, bool fOn)
+{
+   if ( fOn )
+   {
+      uPinsLast = AUX_INPUTS;
+      AUX_PCMSK |= (1 << uPin);
+      PCIFR = (1 << AUX_PCIF);          /* no old change */
+      PCICR |= (1 << AUX_PCIE);
+   }
+   else
+   {
+      AUX_PCMSK &= ~(1 << uPin);
+   }
+}
+
+/*--------------------------------------------------
+ Trigger input on (with pull-up) or off (interrupts are disabled)
+ --------------------------------------------------*/
+void vBoardTriggerEnable(bool fOn)
+{
+   AUX_DDR &= ~(1 << TRIGGER_PIN);
+   if ( fOn )
+   {
+      AUX_PORT |= (1 << TRIGGER_PIN);
+   }
+   else
+   {
+      AUX_PORT &= ~(1 << TRIGGER_PIN);
+   }
+   vBoardPinChangeEnable( TRIGGER_PIN, fOn );
+}
+
+/***------------------------ Interrupt functions ------------------------***/
+/*--------------------------------------------------
+ Pin change on the auxiliary port: sync line and trigger input.
+ The sync edge is latched first. The trigger then gives the pulses
+ of the channels it starts right here, with the interrupts enabled
+ again (the serial port and the timers go on) but this pin change
+ interrupt off: an edge meanwhile is handled after the pulses.
+ --------------------------------------------------*/
+ISR(AUX_PCINT_vect)
+{
+   uint8_t  uPins = AUX_INPUTS;
+   uint8_t  uChanged = uPins ^ uPinsLast;
+
+   uPinsLast = uPins;
+   if ( (uChanged & (1 << SYNC_PIN)) != 0 )
+   {
+      vSyncPinChange( (uPins & (1 << SYNC_PIN)) == 0 );
+   }
+   if ( ((uChanged & (1 << TRIGGER_PIN)) != 0) &&
+        fTriggerPinChange( (uPins & (1 << TRIGGER_PIN)) != 0 ) )
+   {
+      PCICR &= ~(1 << AUX_PCIE);
+      sei();
+      vTriggerPulses();
+      cli();
+      PCICR |= (1 << AUX_PCIE);
+   }
+}
+
+/*--------------------------------------------------
+ Watchdog timeout: the loop hangs. Switch all outputs off;
+ the next timeout resets the controller.
+ --------------------------------------------------*/
+ISR(WDT_vect)
+{
+   vAllOutputsOff();
+   uHangCount += 1;
+}
+
 /* EOF */
@@ -18,18 +18,174 @@
 #define BOARD_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <avr/wdt.h>
 
-#define LED_PIN         5               /* pin SCL on ArduinoUNO */
-#define LED_ON()        PORTC &= ~(1 << LED_PIN)
-#define LED_OFF()       PORTC |= (1 << LED_PIN)
+/*--------------------------------------------------
+ Board description
+ Per channel the port of its H-bridge with the enable and direction
+ bit, and the potentiometer (MCP42xxx) for its voltage: the port and
+ bit of the chip select and the wiper (0 or 1):
+   CH( port, enable, direction, select port, select bit, wiper )
+ The H-bridge and pot drivers, the port setup and CHANNELCOUNT are
+ generated from it (board.c). The ports must be bit addressable (A..G
+ on the ATmega2560): the trigger interrupt gives pulses, and its
+ single bit instructions do not disturb the main loop on the same
+ port.
+ The auxiliary port has the led, the marker and RTS output and the
+ sync and trigger input (with its pin change interrupt group).
+ --------------------------------------------------*/
+#if defined(__AVR_ATmega2560__)
+
+/* Arduino Mega 2560: 12 channels on port A, C, D (PD0..PD3; UART1 and
+   TWI are not used) and F (A2..A5), one MCP42xxx per two channels
+   selected by PG0..PG2, PE4, PE5 and PG5. Only pins on the headers:
+   PD4..PD6, PG3 and PG4 are not connected on the Mega */
+#define BOARD_CHANNELS(CH) \
+    CH( A, 0, 1, G, 0, 0 ) \
+    CH( A, 2, 3, G, 0, 1 ) \
+    CH( A, 4, 5, G, 1, 0 ) \
+    CH( A, 6, 7, G, 1, 1 ) \
+    CH( C, 0, 1, G, 2, 0 ) \
+    CH( C, 2, 3, G, 2, 1 ) \
+    CH( C, 4, 5, E, 4, 0 ) \
+    CH( C, 6, 7, E, 4, 1 ) \
+    CH( D, 0, 1, E, 5, 0 ) \
+    CH( D, 2, 3, E, 5, 1 ) \
+    CH( F, 2, 3, G, 5, 0 ) \
+    CH( F, 4, 5, G, 5, 1 )
+#define CHANNEL_TEXT       "<1..12>"    /* for the help of the commands */
+#define CHANNELMASK_TEXT   "<0..4095>"
+
+#define SPI_OUTPUTS        ((1 << 0) | (1 << 1) | (1 << 2))   /* PB0 SS, PB1 SCK, PB2 MOSI */
+
+#define AUX_PORT           PORTB        /* pins D10..D13 */
+#define AUX_DDR            DDRB
+#define AUX_INPUTS         PINB
+#define AUX_PCMSK          PCMSK0
+#define AUX_PCIE           PCIE0
+#define AUX_PCIF           PCIF0
+#define AUX_PCINT_vect     PCINT0_vect
+
+#define LED_PIN            7            /* led L (D13), PB7 */
+#define LED_ON()           AUX_PORT |= (1 << LED_PIN)
+#define LED_OFF()          AUX_PORT &= ~(1 << LED_PIN)
+#define SYNC_PIN           4            /* pin D10 (PB4), PCINT4 */
+#define TRIGGER_PIN        5            /* pin D11 (PB5), PCINT5 */
+#define MARKER_PIN         6            /* pin D12 (PB6) */
+#define RTS_PIN            6            /* shared with the marker output */
+
+#else
+
+/* ArduinoUNO: 4 channels (A..D), one MCP42100 selected by PB2; channel
+   A and B share wiper 0, C and D wiper 1 */
+#define BOARD_CHANNELS(CH) \
+    CH( D, 2, 3, B, 2, 0 )              /* A */ \
+    CH( B, 1, 0, B, 2, 0 )              /* B */ \
+    CH( D, 6, 7, B, 2, 1 )              /* C */ \
+    CH( D, 4, 5, B, 2, 1 )              /* D */
+#define CHANNEL_TEXT       "<1..4>"     /* for the help of the commands */
+#define CHANNELMASK_TEXT   "<0..15>"
+
+#define SPI_OUTPUTS        ((1 << 2) | (1 << 3) | (1 << 5))   /* PB2 SS, PB3 MOSI, PB5 SCK */
+
+#define AUX_PORT           PORTC        /* pins A0..A5 */
+#define AUX_DDR            DDRC
+#define AUX_INPUTS         PINC
+#define AUX_PCMSK          PCMSK1
+#define AUX_PCIE           PCIE1
+#define AUX_PCIF           PCIF1
+#define AUX_PCINT_vect     PCINT1_vect
 
+#define LED_PIN            5            /* pin SCL on ArduinoUNO */
+#define LED_ON()           AUX_PORT &= ~(1 << LED_PIN)
+#define LED_OFF()          AUX_PORT |= (1 << LED_PIN)
+#define SYNC_PIN           2            /* pin A2 (PC2) on ArduinoUNO, PCINT10 */
+#define TRIGGER_PIN        3            /* pin A3 (PC3) on ArduinoUNO, PCINT11 */
+#define MARKER_PIN         4            /* pin A4 (PC4) on ArduinoUNO */
+#define RTS_PIN            4            /* pin A4 (PC4) on ArduinoUNO */
+
+#endif
+
+#define BOARD_COUNT(...)   + 1
+#define CHANNELCOUNT       (0 BOARD_CHANNELS( BOARD_COUNT ))
+
+#if CHANNELCOUNT > 16
+#error "At most 16 channels (channel masks are 16 bit)"
+#endif
+
+/*--------------------------------------------------
+ Optional RTS-style flow control output ('0' = ready to receive)
+ --------------------------------------------------*/
+#define RTS_ENABLE      0               /* 1: drive RTS_PIN from the receive buffer level */
+#define RTS_READY()     AUX_PORT &= ~(1 << RTS_PIN)
+#define RTS_STOP()      AUX_PORT |= (1 << RTS_PIN)
+
+/*--------------------------------------------------
+ Sync line between boards: open drain with pull-up, active low
+ --------------------------------------------------*/
+#define SYNC_IS_LOW()   ((AUX_INPUTS & (1 << SYNC_PIN)) == 0)
+
+/*--------------------------------------------------
+ Trigger/marker output for cameras and recorders, active high
+ --------------------------------------------------*/
+#define MARKER_ON()     AUX_PORT |= (1 << MARKER_PIN)
+#define MARKER_OFF()    AUX_PORT &= ~(1 << MARKER_PIN)
+#define MARKER_TOGGLE() AUX_INPUTS = (1 << MARKER_PIN)
+
+#if RTS_ENABLE && (RTS_PIN == MARKER_PIN)
+#error "RTS and the marker output use the same pin"
+#endif
+
+/*--------------------------------------------------
+ Output monitor: sense inputs for the output voltage and current
+ (shunt amplifier), with the values at ADC full scale
+ --------------------------------------------------*/
+#ifndef MONITOR_VOLTAGE_INPUT
+#define MONITOR_VOLTAGE_INPUT  6        /* pin A6, ADC6 (Nano, SMD Uno); not A0, A1 of AQ */
+#define MONITOR_CURRENT_INPUT  7        /* pin A7, ADC7 */
+#endif
+#define MONITOR_MV_FULLSCALE   5000     /* mV at 1024 (no divider) */
+#define MONITOR_UA_FULLSCALE   50000    /* uA at 1024 (10 ohm shunt, gain 10) */
+
+/*--------------------------------------------------
+ Pin change interrupt for a pin of the auxiliary port (sync, trigger)
+ --------------------------------------------------*/
+extern void vBoardPinChangeEnable(uint8_t uPin, bool fOn);
+extern void vBoardTriggerEnable(bool fOn);
 
 extern void vInitBoard(void);           /* Initialize all board items */
+extern void vInitPorts(void);           /* port settings only, all outputs off */
+
+/*--------------------------------------------------
+ Watchdog supervision
+ The watchdog first gives an interrupt (all outputs off), the next
+ timeout resets the controller. It must be kicked from every loop.
+ The hardware clears WDIE with the interrupt, so the kick sets it
+ again (WDIE needs no timed sequence).
+ --------------------------------------------------*/
+#define WATCHDOG_KICK() do { wdt_reset(); WDTCSR |= _BV(WDIE); } while (0)
+
+extern void vInitWatchdog(void);        /* start watchdog, interrupt + reset mode */
+extern void vResetCauseInit(void);      /* count the reset (from main, after vInitBoard) */
+extern void vAllOutputsOff(void);       /* all H-bridges disabled, led off */
+
+/*--------------------------------------------------
+ Reset cause (kept over resets, in stimulator.c)
+ --------------------------------------------------*/
+extern uint8_t  mcusr_mirror;           /* MCUSR at the last reset */
+extern uint16_t uResetCount;            /* resets since power on */
+extern uint16_t uWatchdogCount;         /* watchdog resets since power on */
+extern volatile uint16_t uHangCount;    /* hangs caught by the watchdog interrupt */
+extern uint8_t  uBootRequest;           /* BOOT_REQUEST_MAGIC: reset by command */
+
+#define BOOT_REQUEST_MAGIC    0xB0
+#define RESET_BOOTCOMMAND     0x80      /* in mcusr_mirror: reset by BO command */
 
 /*--------------------------------------------------
  The controls for the pulses
  --------------------------------------------------*/
-extern void setVoltage(uint8_t channel, uint8_t decivolts);
+extern void setPotCode(uint8_t channel, uint8_t uCode);
 extern void setHBridgePositive(uint8_t channel);
 extern void setHBridgeNegative(uint8_t channel);
 extern void clearHBridge(uint8_t channel);
@@ -0,0 +1,226 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements the serial input of a board in a daisy chain
+
+   Contains:
+      Every board passes its input on to the next board, except the
+      lines '@<address> <command>' for itself; a broadcast (address 0)
+      goes to the next boards and is done as well. Lines are collected
+      and forwarded in one piece, so the output of this board never gets
+      into the middle of them. A line longer than MAXFORWARDLENGTH is too
+      long for a command: it is streamed, only the characters already
+      received are passed on in each loop pass (the pulses go on), and
+      the own output is held until the line ends.
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "serial.h"
+#include "chain.h"
+
+/***------------------------- Defines -----------------------------------***/
+
+#define CR     0x0D
+#define LF     0x0A
+#define XON    0x11                     /* flow control of the previous board */
+#define XOFF   0x13
+
+#define LINE_COLLECT       0            /* line being collected */
+#define LINE_STREAM        1            /* too long, rest forwarded as it comes */
+
+/***----------------------- Local Types ---------------------------------***/
+
+/***------------------------- Local Data --------------------------------***/
+
+static uint8_t uChainAddress;                            /* address of this board */
+static char    acForward[MAXFORWARDLENGTH];              /* received line; streaming: held output */
+static uint8_t uForwardLength;
+static uint8_t uForwardState;                            /* LINE_COLLECT or LINE_STREAM */
+
+/***------------------------ Local functions ----------------------------***/
+
+/*--------------------------------------------------
+ Separator between the address and the command
+ --------------------------------------------------*/
+static bool fIsSeparator( char cInput )
+{
+   return ( (cInput == ' ') || (cInput == ',') || (cInput == ':') || (cInput == '\t') );
+}
+
+/*--------------------------------------------------
+ Pass the received line to the next board
+ --------------------------------------------------*/
+static void vForwardLine( void )
+{
+   (void) fSerialWaitFree( uForwardLength + 2 );   /* the whole line, in one piece */
+   (void) uSerialPutRaw( (uint8_t *) acForward, uForwardLength );
+   (void) uSerialPutRaw( (const uint8_t *) "\r\n", 2 );
+}
+
+/*--------------------------------------------------
+ Start streaming a line too long to collect: the part collected so
+ far goes out, and acForward holds the own output from now on
+ --------------------------------------------------*/
+static void vStreamStart( uint8_t iCharacter )
+{
+   (void) fSerialWaitFree( uForwardLength + 1 );
+   (void) uSerialPutRaw( (uint8_t *) acForward, uForwardLength );
+   (void) uSerialPutRaw( &iCharacter, 1 );
+   uForwardLength = 0;
+   uForwardState = LINE_STREAM;
+   vSerialHoldOutput( (uint8_t *) acForward, sizeof(acForward) );
+}
+
+/*--------------------------------------------------
+ Pass on the characters of a streamed line that are received and
+ fit in the transmit buffer; the rest stays in the receiver for the
+ next pass. At the end of the line the held output follows it
+ --------------------------------------------------*/
+static void vForwardRest( void )
+{
+   uint8_t    iCharacter;
+
+   while ( (uSerialGetFree() >= 2) && (uSerialGetChar( &iCharacter ) == RESULT_SUCCESS) )
+   {
+      if ( (iCharacter == CR) || (iCharacter == LF) )
+      {
+         (void) uSerialPutRaw( (const uint8_t *) "\r\n", 2 );
+         uForwardState = LINE_COLLECT;
+         vSerialHoldOutput( 0, 0 );
+         return;
+      }
+      if ( (iCharacter != XON) && (iCharacter != XOFF) )
+      {
+         (void) uSerialPutRaw( &iCharacter, 1 );
+      }
+   }
+}
+
+/*--------------------------------------------------
+ A line '@<address> <command>' for this board (or for all, address
+ 0) is copied into pcCommand; all other lines, also the output of
+ previous boards, are forwarded
+ --------------------------------------------------*/
+static bool fLineForBoard( char *pcCommand, uint8_t uSize )
+{
+   uint16_t   uAddress = 0;
+   uint8_t    uDigits = 0;
+   char       *pcPoint = &acForward[1];
+   uint8_t    i;
+
+   acForward[ uForwardLength ] = '\0';
+   while ( (*pcPoint >= '0') && (*pcPoint <= '9') )
+   {
+      if ( uAddress <= UINT8_MAX )
+      {
+         uAddress = (uint16_t) ((uAddress * 10) + (uint8_t) (*pcPoint - '0'));
+      }
+      uDigits++;
+      pcPoint++;
+   }
+   if ( (acForward[0] != '@') || (uDigits == 0) ||
+        ((uAddress != 0) && (uAddress != uChainAddress)) )
+   {
+      vForwardLine();
+      return false;
+   }
+   if ( uAddress == 0 )
+   {
+      vForwardLine();                   /* broadcast: the next boards first */
+   }
+   while ( fIsSeparator( *pcPoint ) )
+   {
+      pcPoint++;
+   }
+   for ( i = 0; (*pcPoint != '\0') && (i < (uSize - 1)); i++, pcPoint++ )
+   {
+      pcCommand[i] = (char) toupper( *pcPoint );
+   }
+   pcCommand[i] = '\0';
+   return true;
+}
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Address of this board; a line in progress is dropped
+ --------------------------------------------------*/
+void vChainInit( uint8_t uAddress )
+{
+   uChainAddress = uAddress;
+   uForwardLength = 0;
+   if ( uForwardState == LINE_STREAM )
+   {
+      uForwardState = LINE_COLLECT;
+      vSerialHoldOutput( 0, 0 );
+   }
+}
+
+/*--------------------------------------------------
+ Check the serial input: no echo and no line editing. Returns true
+ when a command for this board is in pcCommand
+ --------------------------------------------------*/
+bool fChainInput( char *pcCommand, uint8_t uSize )
+{
+   uint8_t    iCharacter;
+
+   if ( uForwardState == LINE_STREAM )
+   {
+      vForwardRest();
+      if ( uForwardState == LINE_STREAM )
+      {
+         return false;
+      }
+   }
+   while ( uSerialGetChar( &iCharacter ) == RESULT_SUCCESS )
+   {
+      switch ( iCharacter )
+      {
+         case XON :
+         case XOFF :
+            break;                      /* not part of the data */
+
+         case CR :
+         case LF :
+            if ( uForwardLength > 0 )
+            {
+               if ( fLineForBoard( pcCommand, uSize ) )
+               {
+                  uForwardLength = 0;
+                  return true;
+               }
+            }
+            uForwardLength = 0;
+            break;
+
+         default:
+            if ( uForwardLength >= (MAXFORWARDLENGTH - 1) )
+            {
+               vStreamStart( iCharacter );   /* too long for a command */
+               vForwardRest();
+               if ( uForwardState == LINE_STREAM )
+               {
+                  return false;
+               }
+            }
+            else
+            {
+               acForward[ uForwardLength ] = (char) iCharacter;
+               uForwardLength++;
+            }
+            break;
+      }
+   }
+   return false;
+}
+
+/* EOF */
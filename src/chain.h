@@ -0,0 +1,41 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements the serial input of a board in a daisy chain
+
+   Contains:
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+#ifndef CHAIN_H_
+#define CHAIN_H_
+
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+
+/***------------------------- Defines ------------------------------------***/
+
+#define MAXFORWARDLENGTH   96           /* longer lines are streamed, not collected */
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Address of this board (1..); a line in progress is dropped and
+ held output is released
+ --------------------------------------------------*/
+extern void vChainInit( uint8_t uAddress );
+
+/*--------------------------------------------------
+ Handle the characters received so far, without waiting for more.
+ Returns true when a command for this board is in pcCommand
+ (upper case, at most uSize - 1 characters)
+ --------------------------------------------------*/
+extern bool fChainInput( char *pcCommand, uint8_t uSize );
+
+#endif /* CHAIN_H_ */
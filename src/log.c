@@ -72,13 +72,7 @@ static unsigned char cHex( unsigned char cRef )  /* use code */
 *****************************************************************************/
 void NA_WriteBuffer( unsigned char *pbOut, const unsigned char size )
 {
-    unsigned char   uSentCount;
-
-    for ( uSentCount = 0; uSentCount < size; uSentCount++ )
-    {
-
-      vSerialPutChar( pbOut[ uSentCount ] );                        /* send 1 character */
-    }
+    (void) uSerialPutBuffer( pbOut, size );  /* send all characters at once */
     return;
 }
 
@@ -184,6 +178,24 @@ void vLogInfo( const prog_char *szHeader )
     NA_WriteBuffer( acTotalString, iTotalLen );
 }
 
+/*----------------------------------------------------------------------
+    vLogText
+
+      For long service messages (help): the whole string from flash,
+      no length limit, with a line end
+----------------------------------------------------------------------*/
+void vLogText( const prog_char *szText )
+{
+    char    c;
+
+    while ( (c = (char) pgm_read_byte( szText++ )) != '\0' )
+    {
+        vSerialPutChar( (uint8_t) c );
+    }
+    vSerialPutChar( '\r' );
+    vSerialPutChar( '\n' );
+}
+
 /*----------------------------------------------------------------------
     vLogString
 
@@ -205,33 +217,165 @@ void vLogString( const prog_char *szHeader )
 }
 
 /*--------------------------------------------------
-Prints an uint8 variable in base 10.
+ Powers of ten for the division-free conversions
+ (each digit is found by repeated subtraction)
  --------------------------------------------------*/
-void print_uint16_base10(uint16_t n)
+static const uint16_t auPow10_16[4] PROGMEM = { 10000, 1000, 100, 10 };
+static const uint32_t auPow10_32[9] PROGMEM =
 {
-   uint8_t digits[5];                   /* uint16 has maximal 5 digits */
-   uint8_t cnt, zeroflag;
+   1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL,
+   10000UL, 1000UL, 100UL, 10UL
+};
 
-   for ( cnt = 0; cnt < 5; cnt++ )
+/*--------------------------------------------------
+ Print a uint16 in base 10 without divisions.
+ Leading zeros within uWidth positions are replaced by cPad,
+ leading zeros outside uWidth are suppressed. A width over the
+ 5 digits is filled up with cPad in front.
+ --------------------------------------------------*/
+void print_uint16_pad(uint16_t n, uint8_t uWidth, char cPad)
+{
+   uint8_t  cnt;
+   uint8_t  digit;
+   uint8_t  zeroflag = 0;
+   uint16_t uPower;
+
+   while ( uWidth > 5 )                 /* uint16 has maximal 5 digits */
+   {
+      vSerialPutChar( (uint8_t) cPad );
+      uWidth--;
+   }
+   for ( cnt = 0; cnt < 4; cnt++ )
+   {
+      uPower = pgm_read_word( &auPow10_16[cnt] );
+      digit = '0';
+      while ( n >= uPower )             /* at most 9 subtractions per digit */
+      {
+         n -= uPower;
+         digit++;
+      }
+      if ( digit != '0' )
+      {
+         zeroflag = 1;                  /* all after non-zero digit must be shown */
+      }
+      if ( zeroflag != 0 )
+      {
+         vSerialPutChar( digit );
+      }
+      else if ( (5 - cnt) <= uWidth )
+      {
+         vSerialPutChar( (uint8_t) cPad );
+      }
+   }
+   vSerialPutChar( (uint8_t) ('0' + n) ); /* last digit is always shown */
+}
+
+/*--------------------------------------------------
+ Print a uint32 in base 10 without divisions
+ --------------------------------------------------*/
+void print_uint32_pad(uint32_t n, uint8_t uWidth, char cPad)
+{
+   uint8_t  cnt;
+   uint8_t  digit;
+   uint8_t  zeroflag = 0;
+   uint32_t ulPower;
+
+   if ( n <= UINT16_MAX )               /* the short version is much cheaper */
+   {
+      print_uint16_pad( (uint16_t) n, uWidth, cPad );
+      return;
+   }
+   while ( uWidth > 10 )                /* uint32 has maximal 10 digits */
    {
-      digits[cnt] = n % 10;
-      n /= 10;
+      vSerialPutChar( (uint8_t) cPad );
+      uWidth--;
    }
-   zeroflag = 0;
-   cnt = 5;
-   while ( cnt > 0 )
+   for ( cnt = 0; cnt < 9; cnt++ )
    {
-      cnt -=  1;
-      if ( (digits[cnt] != 0) || (cnt == 0) )
+      ulPower = pgm_read_dword( &auPow10_32[cnt] );
+      digit = '0';
+      while ( n >= ulPower )
       {
-         zeroflag = 1;                  /* last digit must be shown; all after non-zero digit must be shown */
+         n -= ulPower;
+         digit++;
+      }
+      if ( digit != '0' )
+      {
+         zeroflag = 1;
       }
       if ( zeroflag != 0 )
       {
-         /* Show the digit(s) in the correct sequence */
-         vSerialPutChar( ('0' + digits[cnt]) );
+         vSerialPutChar( digit );
+      }
+      else if ( (10 - cnt) <= uWidth )
+      {
+         vSerialPutChar( (uint8_t) cPad );
       }
    }
+   vSerialPutChar( (uint8_t) ('0' + (uint8_t) n) );
+}
+
+/*--------------------------------------------------
+Prints an uint16 variable in base 10.
+ --------------------------------------------------*/
+void print_uint16_base10(uint16_t n)
+{
+   print_uint16_pad( n, 0, '0' );
+}
+
+/*--------------------------------------------------
+Prints an uint32 variable in base 10.
+ --------------------------------------------------*/
+void print_uint32_base10(uint32_t n)
+{
+   print_uint32_pad( n, 0, '0' );
+}
+
+/*--------------------------------------------------
+Prints an int16 variable in base 10 (with '-' sign)
+ --------------------------------------------------*/
+void print_int16_base10(int16_t n)
+{
+   if ( n < 0 )
+   {
+      vSerialPutChar( '-' );
+      print_uint16_pad( (uint16_t) (-(int32_t) n), 0, '0' );
+   }
+   else
+   {
+      print_uint16_pad( (uint16_t) n, 0, '0' );
+   }
+}
+
+/*--------------------------------------------------
+Prints an int32 variable in base 10 (with '-' sign)
+ --------------------------------------------------*/
+void print_int32_base10(int32_t n)
+{
+   if ( n < 0 )
+   {
+      vSerialPutChar( '-' );
+      print_uint32_pad( (uint32_t) 0 - (uint32_t) n, 0, '0' );
+   }
+   else
+   {
+      print_uint32_pad( (uint32_t) n, 0, '0' );
+   }
+}
+
+/*--------------------------------------------------
+Prints a byte/word in hexadecimal (always 2/4 characters)
+ --------------------------------------------------*/
+void print_uint8_hex(uint8_t n)
+{
+   vSerialPutChar( cHex( n >> 4 ) );
+   vSerialPutChar( cHex( n & 0x0F ) );
+}
+
+void print_uint16_hex(uint16_t n)
+{
+   print_uint8_hex( (uint8_t) (n >> 8) );
+   print_uint8_hex( (uint8_t) n );
 }
 
 /*--------------------------------------------------
@@ -43,15 +43,33 @@ extern void vSetHex1( unsigned char uHex, unsigned char *acString );
 extern void vDebugHex( const char *szHeader, unsigned char *acData, unsigned int iLen );
 
 /*----------------------------------------------------------------------
-      For service messages: send first string
+      For service messages: send first string (vLogText: all of a
+      long one, f.i. the help)
 ----------------------------------------------------------------------*/
 extern void vLogInfo( const char *szHeader );
 extern void vLogString( const char *szHeader );
+extern void vLogText( const char *szText );
 
 /*--------------------------------------------------
-Prints an uint8 variable in base 10.
+Prints an uint16 variable in base 10.
  --------------------------------------------------*/
 extern void print_uint16_base10(uint16_t n);
+extern void print_uint32_base10(uint32_t n);
+extern void print_int16_base10(int16_t n);
+extern void print_int32_base10(int32_t n);
+
+/*--------------------------------------------------
+ Prints in base 10, right aligned in uWidth positions (any width);
+ the leading positions are filled with cPad (' ' or '0')
+ --------------------------------------------------*/
+extern void print_uint16_pad(uint16_t n, uint8_t uWidth, char cPad);
+extern void print_uint32_pad(uint32_t n, uint8_t uWidth, char cPad);
+
+/*--------------------------------------------------
+ Prints in hexadecimal (2 or 4 characters)
+ --------------------------------------------------*/
+extern void print_uint8_hex(uint8_t n);
+extern void print_uint16_hex(uint16_t n);
 
 /*--------------------------------------------------
 vSendCR
@@ -0,0 +1,287 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements the monitoring of the output of every pulse
+
+   Contains:
+      In the middle of the positive and of the negative phase the output
+      voltage and current are converted (adc.c; the sense circuit is on
+      the supply side of the H bridge, so both phases read positive).
+      After the pulse the measurements give a running estimate (average
+      over about 4 phases) of voltage, current and load per channel; a
+      pulse is bad when one of its phases is. A load is open when the current is below
+      the open limit, and short when the load is below the short limit;
+      this must hold for MONITOR_CONFIRM pulses in a row before it is
+      reported with 'OPEN n' or 'SHORT n' (and 'LOAD OK n' when it is
+      good again).
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _lint
+ #ifdef ____ATTR_PURE__
+   #undef __ATTR_PURE__
+ #endif
+ #ifdef __attribute__
+   #undef __attribute__
+ #endif
+ #define __ATTR_PURE__
+ #define __attribute__(var)
+#endif
+#include <avr/pgmspace.h>
+#include "board.h"
+#include "log.h"
+#include "waveform.h"
+#include "adc.h"
+#include "monitor.h"
+
+/***------------------------- Defines -----------------------------------***/
+
+#define MONITOR_CONFIRM    3            /* pulses in a row for a new load state */
+#define MONITOR_SHIFT      2            /* running average over 2^2 phases */
+#define OPEN_DEFAULT       50           /* uA */
+#define SHORT_DEFAULT      100          /* ohm */
+
+/***----------------------- Local Types ---------------------------------***/
+
+/***------------------------- Local Data --------------------------------***/
+
+static uint8_t    uMode;                        /* MONITOR_OFF .. MONITOR_STOP */
+static uint16_t   uOpenLimit = OPEN_DEFAULT;    /* uA */
+static uint16_t   uShortLimit = SHORT_DEFAULT;  /* ohm */
+static uint16_t   uSkipped;                     /* pulses without a measurement */
+
+static int32_t    lVoltage[CHANNELCOUNT];       /* running average (mV << MONITOR_SHIFT) */
+static int32_t    lCurrent[CHANNELCOUNT];       /* running average (uA << MONITOR_SHIFT) */
+static uint8_t    uLoadState[CHANNELCOUNT];     /* LOAD_UNKNOWN .. LOAD_SHORT */
+static uint8_t    uNewState[CHANNELCOUNT];      /* state of the last pulses */
+static uint8_t    uNewCount[CHANNELCOUNT];      /* pulses in a row with uNewState */
+static uint16_t   uPhaseVoltage[2];             /* ADC values of the phases of this pulse */
+static uint16_t   uPhaseCurrent[2];
+static uint8_t    uPhaseSampled;                /* bit per phase with a measurement */
+static uint8_t    uPhaseStarted;                /* phase of the last conversion */
+
+/***------------------------ Local functions ----------------------------***/
+/*--------------------------------------------------
+ State of the load of one pulse (division free)
+ --------------------------------------------------*/
+static uint8_t uClassify( uint16_t uMv, uint16_t uUa )
+{
+   if ( uUa < uOpenLimit )
+   {
+      return LOAD_OPEN;
+   }
+   if ( ((uint32_t) uMv * 1000) < ((uint32_t) uShortLimit * uUa) )
+   {
+      return LOAD_SHORT;
+   }
+   return LOAD_OK;
+}
+
+/*--------------------------------------------------
+ Keep the measurement of the last started phase, when it is done
+ --------------------------------------------------*/
+static void vPhaseCollect( void )
+{
+   if ( fAdcMonitorTake( &uPhaseVoltage[uPhaseStarted], &uPhaseCurrent[uPhaseStarted] ) )
+   {
+      uPhaseSampled |= (1 << uPhaseStarted);
+   }
+}
+
+/*--------------------------------------------------
+ Report a new state of the load
+ --------------------------------------------------*/
+static void vReportLoad( uint8_t channel, uint8_t uState )
+{
+   switch ( uState )
+   {
+      case LOAD_OPEN :
+         vLogString( PSTR( "OPEN" ));
+         break;
+      case LOAD_SHORT :
+         vLogString( PSTR( "SHORT" ));
+         break;
+      default:
+         vLogString( PSTR( "LOAD OK" ));
+         break;
+   }
+   print_uint16_base10( channel + 1 );
+   vSendCR();
+}
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Mode and limits
+ --------------------------------------------------*/
+void vMonitorSetup( uint8_t uNewMode, uint16_t uOpenUa, uint16_t uShortOhm )
+{
+   uint8_t  i;
+
+   uMode = uNewMode;
+   uOpenLimit = uOpenUa;
+   uShortLimit = uShortOhm;
+   uSkipped = 0;
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      vMonitorReset( i );
+   }
+}
+
+void vMonitorGetSetup( uint8_t *puMode, uint16_t *puOpenUa, uint16_t *puShortOhm )
+{
+   *puMode = uMode;
+   *puOpenUa = uOpenLimit;
+   *puShortOhm = uShortLimit;
+}
+
+uint8_t uMonitorMode( void )
+{
+   return uMode;
+}
+
+/*--------------------------------------------------
+ In the middle of a phase (0 positive, 1 negative) of a pulse: start
+ the conversions. The measurement of the positive phase is kept first
+ --------------------------------------------------*/
+void vMonitorPhase( uint8_t uPhase )
+{
+   vPhaseCollect();
+   if ( uPhase == 0 )
+   {
+      uPhaseSampled = 0;                /* nothing left of an earlier pulse */
+   }
+   if ( fAdcMonitorStart() )
+   {
+      uPhaseStarted = uPhase;
+   }
+}
+
+/*--------------------------------------------------
+ After a pulse: update the estimate and the state of the load.
+ A phase with 0 V says nothing about the load
+ --------------------------------------------------*/
+bool fMonitorPulse( uint8_t channel )
+{
+   uint16_t uMv, uUa;
+   uint8_t  uSampled;
+   uint8_t  uPhase;
+   uint8_t  uPhaseState;
+   uint8_t  uState = LOAD_UNKNOWN;
+   bool     fStart = (uLoadState[channel] == LOAD_UNKNOWN);
+
+   if ( uMode == MONITOR_OFF )
+   {
+      return false;
+   }
+   vPhaseCollect();
+   uSampled = uPhaseSampled;
+   uPhaseSampled = 0;
+   if ( uSampled == 0 )
+   {
+      uSkipped += (uSkipped != UINT16_MAX);
+      return false;
+   }
+   for ( uPhase = 0; uPhase < 2; uPhase++ )
+   {
+      if ( (uSampled & (1 << uPhase)) == 0 )
+      {
+         continue;
+      }
+      uMv = (uint16_t) (((uint32_t) uPhaseVoltage[uPhase] * MONITOR_MV_FULLSCALE) >> 10);
+      uUa = (uint16_t) (((uint32_t) uPhaseCurrent[uPhase] * MONITOR_UA_FULLSCALE) >> 10);
+      if ( fStart )
+      {
+         lVoltage[channel] = (int32_t) uMv << MONITOR_SHIFT;
+         lCurrent[channel] = (int32_t) uUa << MONITOR_SHIFT;
+         fStart = false;
+      }
+      else
+      {
+         lVoltage[channel] += (int32_t) uMv - (lVoltage[channel] >> MONITOR_SHIFT);
+         lCurrent[channel] += (int32_t) uUa - (lCurrent[channel] >> MONITOR_SHIFT);
+      }
+      if ( sSetChannel[channel].uVoltages[uPhase] == 0 )
+      {
+         continue;
+      }
+      uPhaseState = uClassify( uMv, uUa );
+      if ( (uState == LOAD_UNKNOWN) || (uPhaseState != LOAD_OK) )
+      {
+         uState = uPhaseState;          /* the bad phase counts */
+      }
+   }
+   if ( uState == LOAD_UNKNOWN )
+   {
+      return false;
+   }
+
+   if ( uState != uNewState[channel] )
+   {
+      uNewState[channel] = uState;
+      uNewCount[channel] = 0;
+   }
+   if ( uNewCount[channel] < MONITOR_CONFIRM )
+   {
+      uNewCount[channel]++;
+   }
+   if ( uLoadState[channel] == LOAD_UNKNOWN )
+   {
+      uLoadState[channel] = LOAD_OK;    /* estimate started */
+   }
+   if ( (uNewCount[channel] == MONITOR_CONFIRM) && (uLoadState[channel] != uState) )
+   {
+      uLoadState[channel] = uState;
+      vReportLoad( channel, uState );
+      return ( (uState != LOAD_OK) && (uMode == MONITOR_STOP) );
+   }
+   return false;
+}
+
+/*--------------------------------------------------
+ The estimate of a channel
+ --------------------------------------------------*/
+uint8_t uMonitorGet( uint8_t channel, uint16_t *puVoltage, uint16_t *puCurrent, uint16_t *puLoad )
+{
+   uint32_t ulLoad;
+
+   *puVoltage = (uint16_t) (lVoltage[channel] >> MONITOR_SHIFT);
+   *puCurrent = (uint16_t) (lCurrent[channel] >> MONITOR_SHIFT);
+   *puLoad = UINT16_MAX;
+   if ( *puCurrent != 0 )
+   {
+      ulLoad = ((uint32_t) *puVoltage * 1000) / *puCurrent;
+      if ( ulLoad < UINT16_MAX )
+      {
+         *puLoad = (uint16_t) ulLoad;
+      }
+   }
+   return uLoadState[channel];
+}
+
+uint16_t uMonitorSkipped( void )
+{
+   return uSkipped;
+}
+
+/*--------------------------------------------------
+ Forget the estimate of a channel
+ --------------------------------------------------*/
+void vMonitorReset( uint8_t channel )
+{
+   lVoltage[channel] = 0;
+   lCurrent[channel] = 0;
+   uLoadState[channel] = LOAD_UNKNOWN;
+   uNewState[channel] = LOAD_UNKNOWN;
+   uNewCount[channel] = 0;
+}
+
+/* EOF */
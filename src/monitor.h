@@ -0,0 +1,67 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements the monitoring of the output of every pulse
+
+   Contains:
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+#ifndef MONITOR_H_
+#define MONITOR_H_
+
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+
+/***------------------------- Defines ------------------------------------***/
+
+#define MONITOR_OFF        0
+#define MONITOR_REPORT     1            /* report a bad load */
+#define MONITOR_STOP       2            /* report and stop the channel */
+
+/* State of the load of a channel */
+#define LOAD_UNKNOWN       0
+#define LOAD_OK            1
+#define LOAD_OPEN          2
+#define LOAD_SHORT         3
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Mode and limits: open below uOpenUa (uA), short below uShortOhm
+ --------------------------------------------------*/
+extern void vMonitorSetup( uint8_t uMode, uint16_t uOpenUa, uint16_t uShortOhm );
+extern void vMonitorGetSetup( uint8_t *puMode, uint16_t *puOpenUa, uint16_t *puShortOhm );
+extern uint8_t uMonitorMode( void );
+
+/*--------------------------------------------------
+ In the middle of phase uPhase (0 positive, 1 negative) of a pulse:
+ start the conversions of the sense inputs
+ --------------------------------------------------*/
+extern void vMonitorPhase( uint8_t uPhase );
+
+/*--------------------------------------------------
+ After a pulse of the channel: take the measurements of the pulse and
+ update the estimate. Returns true when the channel must stop
+ --------------------------------------------------*/
+extern bool fMonitorPulse( uint8_t channel );
+
+/*--------------------------------------------------
+ Estimate of a channel: voltage (mV), current (uA), load (ohm,
+ UINT16_MAX: open), state; and the pulses without a measurement
+ --------------------------------------------------*/
+extern uint8_t uMonitorGet( uint8_t channel, uint16_t *puVoltage, uint16_t *puCurrent, uint16_t *puLoad );
+extern uint16_t uMonitorSkipped( void );
+
+/*--------------------------------------------------
+ Forget the estimate of a channel (new run)
+ --------------------------------------------------*/
+extern void vMonitorReset( uint8_t channel );
+
+#endif /* MONITOR_H_ */
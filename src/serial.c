@@ -19,285 +19,612 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include "board.h"
 #include "serial.h"
+#include "timer.h"
 
 /***------------------------- Defines -----------------------------------***/
 
-/* The serial buffer takes xx bytes + 2 pointers */
-#define SERIAL_RXBUFFERSIZE      96     /* receive buffer size (keep below 256)*/
-#define SERIAL_TXBUFFERSIZE      128    /* transmit buffer size (keep below 256)*/
+/* The serial buffers take xx bytes + 2 indices each.
+   The sizes must be a power of 2 (2..128); they can be given on the command line */
+#ifndef SERIAL_RXBUFFERSIZE
+#define SERIAL_RXBUFFERSIZE      128    /* receive buffer size */
+#endif
+#ifndef SERIAL_TXBUFFERSIZE
+#define SERIAL_TXBUFFERSIZE      128    /* transmit buffer size */
+#endif
+
+#if ((SERIAL_RXBUFFERSIZE & (SERIAL_RXBUFFERSIZE - 1)) != 0) || (SERIAL_RXBUFFERSIZE > 128)
+#error "SERIAL_RXBUFFERSIZE must be a power of 2, maximal 128"
+#endif
+#if ((SERIAL_TXBUFFERSIZE & (SERIAL_TXBUFFERSIZE - 1)) != 0) || (SERIAL_TXBUFFERSIZE > 128)
+#error "SERIAL_TXBUFFERSIZE must be a power of 2, maximal 128"
+#endif
+
+#define RXMASK                   (SERIAL_RXBUFFERSIZE - 1)
+#define TXMASK                   (SERIAL_TXBUFFERSIZE - 1)
+
+/* Receive flow control: XOFF at 3/4 filling, XON when back at 1/4 */
+#define SERIAL_XOFF_LEVEL        (SERIAL_RXBUFFERSIZE - (SERIAL_RXBUFFERSIZE / 4))
+#define SERIAL_XON_LEVEL         (SERIAL_RXBUFFERSIZE / 4)
+#define XON                      0x11
+#define XOFF                     0x13
 
 #if defined(__AVR_ATmega8__)
 #define  AT8    1
 #define MAIN_CLK                 8000000      /* System runs at 8 MHz */
+#define SERIAL_DEFAULTBAUD       19200
 #else
 #define  AT8    0
 #define MAIN_CLK                 16000000      /* System runs at 16 MHz */
+#define SERIAL_DEFAULTBAUD       38400
+#endif
+
+#define SERIAL_BAUD_MAXERROR     25     /* maximal baudrate error (0.1% units); 115200 is 2.1% */
+
+/* UART registers and bits for the controller types */
+#if AT8
+#define UART_CTRLA               UCSRA
+#define UART_CTRLB               UCSRB
+#define UART_DATA                UDR
+#define UART_BAUDH               UBRRH
+#define UART_BAUDL               UBRRL
+#define UART_U2X                 U2X
+#define UART_TXC                 TXC
+#define UART_UDRIE               UDRIE
+#define UART_RX_vect             USART_RXC_vect
+#define UART_UDRE_vect           USART_UDRE_vect
+#else
+#define UART_CTRLA               UCSR0A
+#define UART_CTRLB               UCSR0B
+#define UART_DATA                UDR0
+#define UART_BAUDH               UBRR0H
+#define UART_BAUDL               UBRR0L
+#define UART_U2X                 U2X0
+#define UART_TXC                 TXC0
+#define UART_UDRIE               UDRIE0
+#if defined(USART0_RX_vect)             /* ATmega2560: USART0 */
+#define UART_RX_vect             USART0_RX_vect
+#define UART_UDRE_vect           USART0_UDRE_vect
+#else
+#define UART_RX_vect             USART_RX_vect
+#define UART_UDRE_vect           USART_UDRE_vect
+#endif
 #endif
 
 /***----------------------- Local Types ---------------------------------***/
 
 /***------------------------- Local Data --------------------------------***/
-/* The data is given as flat types; structures give overhead in the generated code */
-static uint8_t    acRxBuffer[ SERIAL_RXBUFFERSIZE ];
-static uint8_t    iRxInPtr;
-static uint8_t    iRxOutPtr;
+/* The data is given as flat types; structures give overhead in the generated code.
+   Single producer / single consumer: the 'in' index is only written by the producer,
+   the 'out' index only by the consumer. The indices run free and are masked on use,
+   so (in - out) is the fill level and no interrupt locking is needed. */
+static uint8_t             acRxBuffer[ SERIAL_RXBUFFERSIZE ];
+static volatile uint8_t    iRxInPtr;
+static volatile uint8_t    iRxOutPtr;
 
-static uint8_t    acTxBuffer[ SERIAL_TXBUFFERSIZE ];
-static uint8_t    iTxInPtr;
-static uint8_t    iTxOutPtr;
+static uint8_t             acTxBuffer[ SERIAL_TXBUFFERSIZE ];
+static volatile uint8_t    iTxInPtr;
+static volatile uint8_t    iTxOutPtr;
 
-static uint16_t   const uBaudDetails[7] PROGMEM =
-{
-   (((MAIN_CLK / 2400) / 8) - 1),
-   (((MAIN_CLK / 4800) / 8) - 1),
-   (((MAIN_CLK / 9600) / 8) - 1),
-   (((MAIN_CLK / 19200) / 8) - 1),
-   (((MAIN_CLK / 38400) / 8) - 1),
-   (((MAIN_CLK / 57600) / 8) - 1),
-   (((MAIN_CLK / 115200L) / 8) - 1)
-};
+static uint32_t   ulCurrentBaud;        /* active baudrate */
+
+static uint8_t             uFlowControl;   /* XON/XOFF enabled */
+static volatile uint8_t    uRxStopped;     /* XOFF is sent */
+static volatile uint8_t    uTxControl;     /* XON/XOFF to send before the buffer, 0: none */
+
+static const char          *pcLinePrefix;  /* put before every output line, 0: none */
+static uint8_t             fLineStart;     /* next character starts a line */
+
+static uint8_t             *pHoldBuffer;   /* own output held here, 0: not held */
+static uint8_t             uHoldSize;
+static uint8_t             uHoldLength;
 
 /***------------------------ Global Data --------------------------------***/
 
 uint8_t uRxOverflow;
 uint8_t uTxOverflow;
+uint8_t uRxStopCount;
 
 /***------------------------ Local functions ----------------------------***/
 
+/*--------------------------------------------------
+ Start the transmitter interrupt (once for a complete batch)
+ --------------------------------------------------*/
+static inline void vStartTransmit( void )
+{
+   UART_CTRLB |= _BV(UART_UDRIE);       /* the interrupt itself only clears this bit */
+}
+
+/*--------------------------------------------------
+ Count up to the maximum
+ --------------------------------------------------*/
+static inline void vCountSaturated( uint8_t *puCounter )
+{
+   if ( *puCounter != UINT8_MAX )
+   {
+      *puCounter += 1;
+   }
+}
+
+/*--------------------------------------------------
+ After reading: release the sender when the buffer is emptied enough
+ --------------------------------------------------*/
+static void vCheckResume( void )
+{
+   if ( (uRxStopped != 0) &&
+        ((uint8_t) (iRxInPtr - iRxOutPtr) <= SERIAL_XON_LEVEL) )
+   {
+      cli();
+      uRxStopped = 0;
+      if ( uFlowControl != 0 )
+      {
+         uTxControl = XON;
+      }
+      sei();
+#if RTS_ENABLE
+      RTS_READY();
+#endif
+      vStartTransmit();
+   }
+}
+
 /***------------------------ Global functions ---------------------------***/
-#if AT8
+/*--------------------------------------------------
+ Calculate the baudrate register and double speed (U2X) setting
+ The setting with the smallest error is chosen (normal speed on equal error)
+ Returns the error in 0.1% units, or SERIAL_BAUD_INVALID
+ --------------------------------------------------*/
+int16_t iSerialCalcBaud( uint32_t ulBaud, uint16_t *puUbrr, uint8_t *puDouble )
+{
+   uint8_t  uDouble;
+   uint8_t  uDivider;
+   uint32_t ulUbrr;
+   uint32_t ulActual;
+   int32_t  lError;
+   int16_t  iBest = SERIAL_BAUD_INVALID;
+
+   if ( (ulBaud == 0) || (ulBaud > (MAIN_CLK / 8)) )
+   {
+      return SERIAL_BAUD_INVALID;
+   }
+   for ( uDouble = 0; uDouble < 2; uDouble++ )
+   {
+      uDivider = (uDouble != 0) ? 8 : 16;
+      ulUbrr = (MAIN_CLK + ((ulBaud * uDivider) / 2)) / (ulBaud * uDivider);  /* rounded */
+      if ( (ulUbrr == 0) || (ulUbrr > 4096) )
+      {
+         continue;                      /* not possible in this mode */
+      }
+      ulActual = MAIN_CLK / (uDivider * ulUbrr);
+      lError = (((int32_t) ulActual - (int32_t) ulBaud) * 1000) / (int32_t) ulBaud;
+      if ( lError < 0 )
+      {
+         lError = -lError;
+      }
+      if ( (lError <= SERIAL_BAUD_MAXERROR) &&
+           ((iBest == SERIAL_BAUD_INVALID) || (lError < (iBest < 0 ? -iBest : iBest))) )
+      {
+         iBest = (int16_t) ((ulActual < ulBaud) ? -lError : lError);
+         *puUbrr = (uint16_t) (ulUbrr - 1);
+         *puDouble = uDouble;
+      }
+   }
+   return iBest;
+}
+
 /*--------------------------------------------------
 Baudrate setting
+ The transmit buffer is sent out completely before the change
  --------------------------------------------------*/
-void vSetBaud( uint8_t uBaudrate )
+uint8_t uSetBaud( uint32_t ulBaudrate )
 {
-   uint16_t uBaudReg;
+   uint16_t uBaudReg = 0;
+   uint8_t  uDouble = 0;
 
-   uBaudReg = pgm_read_word( &uBaudDetails[ uBaudrate - 1 ] );
-   UBRRH = ( (uBaudReg) >> 8) & 0x0f;
-   UBRRL =   (uBaudReg)       & 0xff;
+   if ( iSerialCalcBaud( ulBaudrate, &uBaudReg, &uDouble ) == SERIAL_BAUD_INVALID )
+   {
+      return RESULT_ERROR;
+   }
+   vSerialFlush();
+   UART_CTRLA = (uDouble != 0) ? _BV(UART_U2X) : 0;
+   UART_BAUDH = ( (uBaudReg) >> 8) & 0x0f;
+   UART_BAUDL =   (uBaudReg)       & 0xff;
+   ulCurrentBaud = ulBaudrate;
+   return RESULT_SUCCESS;
 }
-#else
+
 /*--------------------------------------------------
-Baudrate setting
+ Deliver the active baudrate
  --------------------------------------------------*/
-void vSetBaud( uint8_t uBaudrate )
+uint32_t ulGetBaud( void )
 {
-   uint16_t uBaudReg;
+   return ulCurrentBaud;
+}
 
-   uBaudReg = pgm_read_word( &uBaudDetails[ uBaudrate - 1 ] );
-   UBRR0H = ( (uBaudReg) >> 8) & 0x0f;
-   UBRR0L =   (uBaudReg)       & 0xff;
+/*--------------------------------------------------
+ Wait until all characters are sent (incl. the last stopbit), or
+ nothing was sent for SERIAL_STALL_MS
+ --------------------------------------------------*/
+void vSerialFlush( void )
+{
+   uint16_t uStart;
+   uint16_t uNow;
+   uint8_t  uOut = iTxOutPtr;
+
+   if ( ulCurrentBaud == 0 )
+   {
+      return;                           /* not initialized yet */
+   }
+   vGetSystemTimer( &uStart );
+   while ( (iTxInPtr != iTxOutPtr) || (uTxControl != 0) || bit_is_clear( UART_CTRLA, UART_TXC ) )
+   {
+      vGetSystemTimer( &uNow );
+      if ( iTxOutPtr != uOut )
+      {
+         uOut = iTxOutPtr;              /* still sending: can take seconds at low baudrates */
+         uStart = uNow;
+         WATCHDOG_KICK();
+      }
+      else if ( (uint16_t) (uNow - uStart) >= SERIAL_STALL_MS )
+      {
+         return;                        /* stalled */
+      }
+   }
 }
-#endif
 
 /*--------------------------------------------------
  Initialize UART
  --------------------------------------------------*/
-#if AT8
 void vSerialInit( void )
 {
-   UCSRA = 2;
+   UART_CTRLA = 0;
+#if AT8
    UCSRB = _BV(RXEN) | _BV(RXCIE) | _BV(TXEN);
    UCSRC = _BV(URSEL) | _BV(UCSZ0) | _BV(UCSZ1);
+#else
+   UCSR0B = _BV(RXEN0) | _BV(RXCIE0) | _BV(TXEN0);
+   UCSR0C = _BV(UCSZ00) | _BV(UCSZ01);
+#endif
 
    iRxInPtr = 0;                        /* purge all buffers */
    iRxOutPtr = 0;
    iTxInPtr = 0;
    iTxOutPtr = 0;
-   vSetBaud( 3 );          /* set a default baudrate (overwritten by the user) */
+   ulCurrentBaud = 0;
+   (void) uSetBaud( SERIAL_DEFAULTBAUD );  /* set a default baudrate (overwritten by the user) */
    uTxOverflow = 0;
    uRxOverflow = 0;
+   uRxStopCount = 0;
+   uRxStopped = 0;
+   uTxControl = 0;
+   uFlowControl = 1;
+#if RTS_ENABLE
+   AUX_DDR |= (1 << RTS_PIN);
+   RTS_READY();
+#endif
 }
-#else
-void vSerialInit( void )
+
+/*--------------------------------------------------
+ Switch XON/XOFF flow control on (1) or off (0)
+ --------------------------------------------------*/
+void vSerialSetFlowControl( uint8_t uOn )
 {
-	UCSR0A = 2;
-	UCSR0B = _BV(RXEN0) | _BV(RXCIE0) | _BV(TXEN0);
-	UCSR0C = _BV(UCSZ00) | _BV(UCSZ01);
-
-	iRxInPtr = 0;                        /* purge all buffers */
-	iRxOutPtr = 0;
-	iTxInPtr = 0;
-	iTxOutPtr = 0;
-   vSetBaud( 4 );          /* set a default baudrate (overwritten by the user) */
-	uTxOverflow = 0;
-	uRxOverflow = 0;
+   uFlowControl = uOn;
+   if ( (uOn == 0) && (uRxStopped != 0) )
+   {
+      uTxControl = XON;                 /* do not leave the host waiting */
+      vStartTransmit();
+   }
 }
-#endif
+
+uint8_t uSerialGetFlowControl( void )
+{
+   return uFlowControl;
+}
+
 /*--------------------------------------------------
- Get characters non-blocking from the receiver
+ Read and reset the overflow counters
  --------------------------------------------------*/
-uint8_t uSerialGetChar( uint8_t *uRcv )
+void vSerialGetCounters( uint8_t *puRxOverflow, uint8_t *puTxOverflow, uint8_t *puRxStops )
 {
-    if ( iRxInPtr != iRxOutPtr )  /* check if something in buffer */
-    {
-        *uRcv = acRxBuffer[ iRxOutPtr ];
-        iRxOutPtr += 1;
-        if ( iRxOutPtr == SERIAL_RXBUFFERSIZE )
-        {
-            iRxOutPtr = 0;
-        }
-        return RESULT_SUCCESS;                 /* report success */
-    }
-    return RESULT_ERROR;
+   cli();
+   *puRxOverflow = uRxOverflow;
+   *puTxOverflow = uTxOverflow;
+   *puRxStops = uRxStopCount;
+   uRxOverflow = 0;
+   uTxOverflow = 0;
+   uRxStopCount = 0;
+   sei();
 }
 
 /*--------------------------------------------------
- Check size of open locations in transmit buffer
+ Get characters non-blocking from the receiver
  --------------------------------------------------*/
-uint8_t uSerialGetFree( void )
+uint8_t uSerialGetChar( uint8_t *uRcv )
 {
-   if ( iTxInPtr >= iTxOutPtr )
+   uint8_t  uOut = iRxOutPtr;
+
+   if ( iRxInPtr != uOut )              /* check if something in buffer */
    {
-      return (SERIAL_TXBUFFERSIZE - (iTxInPtr - iTxOutPtr));
+      *uRcv = acRxBuffer[ uOut & RXMASK ];
+      iRxOutPtr = uOut + 1;
+      vCheckResume();
+      return RESULT_SUCCESS;            /* report success */
    }
-   return (iTxOutPtr - iTxInPtr);
+   return RESULT_ERROR;
 }
 
-
-/* Put a character to transmit */
-#if AT8
 /*--------------------------------------------------
-Put a character to transmit; if no room: silently ignore
+ Get up to uMax characters from the receiver; returns the count
  --------------------------------------------------*/
-void vSerialPutChar(uint8_t uTx)
+uint8_t uSerialGetBuffer( uint8_t *pBuffer, uint8_t uMax )
 {
-   uint8_t     uNextPtr;
+   uint8_t  uOut = iRxOutPtr;
+   uint8_t  uCount = iRxInPtr - uOut;
+   uint8_t  i;
 
-   uNextPtr = iTxInPtr + 1;
-   if ( uNextPtr >= SERIAL_TXBUFFERSIZE )
+   if ( uCount > uMax )
    {
-      uNextPtr = 0;
+      uCount = uMax;
    }
-   if ( iTxOutPtr != uNextPtr )         /*  check there is room  */
+   for ( i = 0; i < uCount; i++ )
    {
-      acTxBuffer[ iTxInPtr ] = uTx;
-      /* Now the next items must be without an tx-out interrupt */
-      cli();
-      iTxInPtr = uNextPtr;
-      UCSRB = _BV(RXEN)|_BV(RXCIE)|_BV(TXEN)|_BV(UDRIE); /* interrupt was off: set it on */
-      sei();
+      pBuffer[i] = acRxBuffer[ (uint8_t) (uOut + i) & RXMASK ];
    }
-   else
+   iRxOutPtr = uOut + uCount;           /* release all at once */
+   vCheckResume();
+   return uCount;
+}
+
+/*--------------------------------------------------
+ Count of characters waiting in the receiver
+ --------------------------------------------------*/
+uint8_t uSerialRxCount( void )
+{
+   return (uint8_t) (iRxInPtr - iRxOutPtr);
+}
+
+/*--------------------------------------------------
+ Check size of open locations in transmit buffer
+ --------------------------------------------------*/
+uint8_t uSerialGetFree( void )
+{
+   return (uint8_t) (SERIAL_TXBUFFERSIZE - (uint8_t) (iTxInPtr - iTxOutPtr));
+}
+
+/*--------------------------------------------------
+ Wait for room in the transmit buffer, kicking the watchdog only on
+ progress
+ --------------------------------------------------*/
+bool fSerialWaitFree( uint8_t uBytes )
+{
+   uint16_t uStart;
+   uint16_t uNow;
+   uint8_t  uOut = iTxOutPtr;
+
+   vGetSystemTimer( &uStart );
+   while ( uSerialGetFree() < uBytes )
    {
-      uTxOverflow += 1;                 /* overflow situation */
+      vGetSystemTimer( &uNow );
+      if ( iTxOutPtr != uOut )
+      {
+         uOut = iTxOutPtr;
+         uStart = uNow;
+         WATCHDOG_KICK();
+      }
+      else if ( (uint16_t) (uNow - uStart) >= SERIAL_STALL_MS )
+      {
+         return false;                  /* stalled: the output is dropped (counted) */
+      }
    }
+   return true;
 }
 
 /*--------------------------------------------------
- Receiving interrupt
+Put a character to transmit; if no room: silently ignore
  --------------------------------------------------*/
-ISR(USART_RXC_vect)
+static void vPutByte( uint8_t uTx )
 {
-   uint8_t uNextPtr;
+   uint8_t  uIn = iTxInPtr;
 
-   uNextPtr = iRxInPtr + 1;
-   if ( uNextPtr >= SERIAL_RXBUFFERSIZE )
+   if ( (uint8_t) (uIn - iTxOutPtr) < SERIAL_TXBUFFERSIZE )  /* check there is room */
    {
-      uNextPtr = 0;
+      acTxBuffer[ uIn & TXMASK ] = uTx;
+      iTxInPtr = uIn + 1;
+      vStartTransmit();
    }
-   if ( iRxOutPtr != uNextPtr )         /*  check there is room  */
+   else
    {
-      acRxBuffer[ iRxInPtr ] = UDR;
-      iRxInPtr = uNextPtr;
+      vCountSaturated( &uTxOverflow );  /* overflow situation */
    }
-   else
+}
+
+/*--------------------------------------------------
+ Own output: to the hold buffer while held, else to transmit
+ --------------------------------------------------*/
+static void vPutOwnByte( uint8_t uTx )
+{
+   if ( pHoldBuffer != 0 )
    {
-      uRxOverflow += 1;
+      if ( uHoldLength < uHoldSize )
+      {
+         pHoldBuffer[ uHoldLength++ ] = uTx;
+      }
+      else
+      {
+         vCountSaturated( &uTxOverflow );
+      }
+      return;
    }
+   vPutByte( uTx );
 }
 
 /*--------------------------------------------------
- Transmitting interrupt
+ Put a byte to transmit, with the line prefix at the start of a line
  --------------------------------------------------*/
-ISR( USART_UDRE_vect )
+void vSerialPutChar( uint8_t uTx )
 {
-   if ( iTxInPtr != iTxOutPtr )  /* check if something in buffer */
+   const char  *pcPrefix;
+
+   if ( pcLinePrefix != 0 )
    {
-      UDR = acTxBuffer[ iTxOutPtr ];
-      iTxOutPtr += 1;
-      if ( iTxOutPtr >= SERIAL_TXBUFFERSIZE )
+      if ( fLineStart != 0 )
+      {
+         fLineStart = 0;
+         for ( pcPrefix = pcLinePrefix; *pcPrefix != '\0'; pcPrefix++ )
+         {
+            vPutOwnByte( (uint8_t) *pcPrefix );
+         }
+      }
+      if ( uTx == '\n' )
       {
-         iTxOutPtr = 0;
+         fLineStart = 1;
       }
    }
-   if ( iTxOutPtr == iTxInPtr )        /* if nothing in the buffer (anymore) */
+   vPutOwnByte( uTx );
+}
+
+/*--------------------------------------------------
+ Put a buffer to transmit; what does not fit is dropped
+ Returns the count of characters put in the buffer
+ --------------------------------------------------*/
+uint8_t uSerialPutBuffer( const uint8_t *pBuffer, uint8_t uCount )
+{
+   uint8_t  i;
+
+   if ( pcLinePrefix != 0 )             /* lines to mark: per character */
    {
-      UCSRB = _BV(RXEN)|_BV(RXCIE)|_BV(TXEN);  /* switch off the interrupt */
+      for ( i = 0; i < uCount; i++ )
+      {
+         vSerialPutChar( pBuffer[i] );
+      }
+      return uCount;
    }
+   return uSerialPutRaw( pBuffer, uCount );
 }
 
-#else
 /*--------------------------------------------------
-Put a character to transmit; if no room: silently ignore
+ Put a buffer to transmit as is (no line prefix)
  --------------------------------------------------*/
-void vSerialPutChar(uint8_t uTx)
+uint8_t uSerialPutRaw( const uint8_t *pBuffer, uint8_t uCount )
 {
-   uint8_t     uNextPtr;
+   uint8_t  uIn = iTxInPtr;
+   uint8_t  uFree = SERIAL_TXBUFFERSIZE - (uint8_t) (uIn - iTxOutPtr);
+   uint8_t  i;
 
-   uNextPtr = iTxInPtr + 1;
-   if ( uNextPtr >= SERIAL_TXBUFFERSIZE )
+   if ( uCount > uFree )
    {
-      uNextPtr = 0;
+      vCountSaturated( &uTxOverflow );
+      uCount = uFree;
    }
-   if ( iTxOutPtr != uNextPtr )         /*  check there is room  */
+   for ( i = 0; i < uCount; i++ )
    {
-      acTxBuffer[ iTxInPtr ] = uTx;
-      /* Now the next items must be without an tx-out interrupt */
-      cli();
-      iTxInPtr = uNextPtr;
-      UCSR0B = _BV(RXEN0)|_BV(RXCIE0)|_BV(TXEN0)|_BV(UDRIE0); /* interrupt was off: set it on */
-      sei();
+      acTxBuffer[ (uint8_t) (uIn + i) & TXMASK ] = pBuffer[i];
    }
-   else
+   if ( uCount != 0 )
    {
-      uTxOverflow += 1;                 /* overflow situation */
+      iTxInPtr = uIn + uCount;          /* release all at once */
+      vStartTransmit();
    }
+   return uCount;
 }
 
 /*--------------------------------------------------
- Receiving interrupt
+ Hold the own output (vSerialPutChar) in pBuffer, to keep it out of a
+ line that is being forwarded raw; what does not fit is dropped
+ (counted). pBuffer 0 ends holding: the held output is sent
  --------------------------------------------------*/
-ISR(USART_RX_vect)
+void vSerialHoldOutput( uint8_t *pBuffer, uint8_t uSize )
 {
-   uint8_t uNextPtr;
+   uint8_t  *pHeld = pHoldBuffer;
 
-   uNextPtr = iRxInPtr + 1;
-   if ( uNextPtr >= SERIAL_RXBUFFERSIZE )
+   pHoldBuffer = 0;
+   if ( (pHeld != 0) && (uHoldLength != 0) )
    {
-      uNextPtr = 0;
+      (void) fSerialWaitFree( uHoldLength );
+      (void) uSerialPutRaw( pHeld, uHoldLength );
    }
-   if ( iRxOutPtr != uNextPtr )         /*  check there is room  */
+   uHoldLength = 0;
+   uHoldSize = uSize;
+   pHoldBuffer = pBuffer;
+}
+
+/*--------------------------------------------------
+ Prefix for every output line (f.i. the board address), 0: none
+ The string must stay valid
+ --------------------------------------------------*/
+void vSerialSetLinePrefix( const char *pcPrefix )
+{
+   pcLinePrefix = pcPrefix;
+   fLineStart = 1;
+}
+
+/*--------------------------------------------------
+ Receiving interrupt
+ --------------------------------------------------*/
+ISR(UART_RX_vect)
+{
+   uint8_t  uIn = iRxInPtr;
+   uint8_t  uData = UART_DATA;          /* always read: clears the interrupt */
+
+   if ( (uint8_t) (uIn - iRxOutPtr) < SERIAL_RXBUFFERSIZE )  /* check there is room */
    {
-      acRxBuffer[ iRxInPtr ] = UDR0;
-      iRxInPtr = uNextPtr;
+      acRxBuffer[ uIn & RXMASK ] = uData;
+      uIn += 1;
+      iRxInPtr = uIn;
+      if ( (uRxStopped == 0) &&
+           ((uint8_t) (uIn - iRxOutPtr) >= SERIAL_XOFF_LEVEL) )
+      {
+         uRxStopped = 1;                /* ask the sender to pause */
+         vCountSaturated( &uRxStopCount );
+#if RTS_ENABLE
+         RTS_STOP();
+#endif
+         if ( uFlowControl != 0 )
+         {
+            uTxControl = XOFF;
+            vStartTransmit();
+         }
+      }
    }
    else
    {
-      uRxOverflow += 1;
+      vCountSaturated( &uRxOverflow );
    }
 }
 
 /*--------------------------------------------------
  Transmitting interrupt
  --------------------------------------------------*/
-ISR( USART_UDRE_vect )
+ISR( UART_UDRE_vect )
 {
-   if ( iTxInPtr != iTxOutPtr )  /* check if something in buffer */
+   uint8_t  uOut = iTxOutPtr;
+
+   if ( uTxControl != 0 )               /* flow control goes first */
    {
-      UDR0 = acTxBuffer[ iTxOutPtr ];
-      iTxOutPtr += 1;
-      if ( iTxOutPtr >= SERIAL_TXBUFFERSIZE )
+      UART_DATA = uTxControl;
+      uTxControl = 0;
+      if ( iTxInPtr == uOut )
       {
-         iTxOutPtr = 0;
+         UART_CTRLA = (UART_CTRLA & _BV(UART_U2X)) | _BV(UART_TXC);  /* clear 'transmit complete' for vSerialFlush */
       }
    }
-   if ( iTxOutPtr == iTxInPtr )        /* if nothing in the buffer (anymore) */
+   else if ( iTxInPtr != uOut )         /* check if something in buffer */
    {
-      UCSR0B = _BV(RXEN0)|_BV(RXCIE0)|_BV(TXEN0);  /* switch off the interrupt */
+      UART_DATA = acTxBuffer[ uOut & TXMASK ];
+      uOut += 1;
+      iTxOutPtr = uOut;
+      if ( iTxInPtr == uOut )           /* the last one: */
+      {
+         UART_CTRLA = (UART_CTRLA & _BV(UART_U2X)) | _BV(UART_TXC);  /* clear 'transmit complete' for vSerialFlush */
+      }
+   }
+   if ( iTxInPtr == uOut )              /* if nothing in the buffer (anymore) */
+   {
+      UART_CTRLB &= ~_BV(UART_UDRIE);   /* switch off the interrupt */
    }
 }
-#endif
+
 /* EOF */
@@ -14,6 +14,7 @@
 ------------------------------------------------------------------------------
 */
 #include <stdint.h>
+#include <stdbool.h>
 
 #ifndef SERIAL_H_
 #define SERIAL_H_
@@ -24,20 +25,84 @@
 
 extern uint8_t uRxOverflow;
 extern uint8_t uTxOverflow;
+extern uint8_t uRxStopCount;              /* times the sender was stopped */
 
 void vSerialInit( void );                 /* Initialize UART and Flush FIFOs */
 void vSerialPutChar( uint8_t );           /* Put a byte into UART Tx FIFO */
 uint8_t uSerialGetChar( uint8_t *uRcv );  /* Get char from UART Rx FIFO but non blocking */
 
+/*--------------------------------------------------
+ Bulk transfers; both return the count of bytes actually transferred
+ --------------------------------------------------*/
+uint8_t uSerialPutBuffer( const uint8_t *pBuffer, uint8_t uCount );
+uint8_t uSerialGetBuffer( uint8_t *pBuffer, uint8_t uMax );
+
+/*--------------------------------------------------
+ Put a buffer without the line prefix (forwarding lines as is)
+ --------------------------------------------------*/
+uint8_t uSerialPutRaw( const uint8_t *pBuffer, uint8_t uCount );
+
+/*--------------------------------------------------
+ Hold the own output (vSerialPutChar) in a buffer of uSize bytes,
+ f.i. while a line is forwarded raw; 0 sends the held output
+ --------------------------------------------------*/
+extern void vSerialHoldOutput( uint8_t *pBuffer, uint8_t uSize );
+
+/*--------------------------------------------------
+ Prefix for every output line (f.i. the board address), 0: none
+ --------------------------------------------------*/
+extern void vSerialSetLinePrefix( const char *pcPrefix );
+
+/*--------------------------------------------------
+ Count of received bytes waiting
+ --------------------------------------------------*/
+uint8_t uSerialRxCount( void );
+
+#define SERIAL_BAUD_INVALID                   (0x7FFF)
+
 /*--------------------------------------------------
  Change baudrate setting; deliver baudrate in normal value (f.i. 9600, 19200, 38400)
+ Returns RESULT_ERROR if the baudrate can not be made within 2.5%
  --------------------------------------------------*/
-extern void vSetBaud( uint8_t uBaudrate );
+extern uint8_t uSetBaud( uint32_t ulBaudrate );
+extern uint32_t ulGetBaud( void );
+
+/*--------------------------------------------------
+ Calculate baudrate register and U2X for a baudrate;
+ returns the error in 0.1% units or SERIAL_BAUD_INVALID
+ --------------------------------------------------*/
+extern int16_t iSerialCalcBaud( uint32_t ulBaud, uint16_t *puUbrr, uint8_t *puDouble );
+
+/*--------------------------------------------------
+ XON/XOFF flow control on the receiver (on by default)
+ --------------------------------------------------*/
+extern void vSerialSetFlowControl( uint8_t uOn );
+extern uint8_t uSerialGetFlowControl( void );
+
+/*--------------------------------------------------
+ Read and reset the overflow and flow-stop counters
+ --------------------------------------------------*/
+extern void vSerialGetCounters( uint8_t *puRxOverflow, uint8_t *puTxOverflow, uint8_t *puRxStops );
+
+/*--------------------------------------------------
+ Wait until the transmitter is completely empty
+ --------------------------------------------------*/
+extern void vSerialFlush( void );
 
 /*--------------------------------------------------
  Check size of open locations in transmit buffer
  --------------------------------------------------*/
 extern uint8_t uSerialGetFree( void );
 
+/*--------------------------------------------------
+ Wait for uBytes free in the transmit buffer. The watchdog is kicked
+ only while characters go out; when nothing is sent for
+ SERIAL_STALL_MS (the transmitter stalled) it gives up and returns
+ false
+ --------------------------------------------------*/
+#define SERIAL_STALL_MS    100          /* 3 characters at 300 baud */
+
+extern bool fSerialWaitFree( uint8_t uBytes );
+
 #endif /* UART_H_ */
 
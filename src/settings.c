@@ -0,0 +1,410 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements storage of the settings in EEPROM preset slots
+
+   Contains:
+      Each slot has a version and size header, a name, the settings of all
+      channels and a CRC over all of it. A slot is only loaded when all match.
+      Writing is done in the background by the EEPROM ready interrupt from a
+      snapshot of the settings, so the pulse generation keeps running.
+      The checkpoint of the statistics and the voltage calibration use
+      the same snapshot buffer.
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+#ifdef _lint
+ #ifdef ____ATTR_PURE__
+   #undef __ATTR_PURE__
+ #endif
+ #ifdef __attribute__
+   #undef __attribute__
+ #endif
+ #define __ATTR_PURE__
+ #define __attribute__(var)
+#endif
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "waveform.h"
+#include "settings.h"
+
+/***------------------------- Defines -----------------------------------***/
+
+#define CRC_START          0xFFFF
+
+/***----------------------- Local Types ---------------------------------***/
+typedef struct sPresetHeader_t
+{
+   uint8_t  uVersion;                   /* SETTINGS_VERSION */
+   uint16_t uSize;                      /* SETTING_SIZE */
+   char     acName[PRESETNAMELENGTH];
+} sPresetHeader_t;
+
+typedef struct sPreset_t
+{
+   sPresetHeader_t sHeader;
+   sSetting_t      asChannel[CHANNELCOUNT];
+   uint16_t        uCrc;                /* CRC16 over header and settings */
+} sPreset_t;
+
+typedef struct sStatsCheckpoint_t
+{
+   uint8_t         uVersion;            /* STATS_VERSION */
+   uint16_t        uSequence;           /* counts up per checkpoint; the newest slot is loaded */
+   sChannelStats_t asChannel[CHANNELCOUNT];
+   uint16_t        uCrc;                /* CRC16 over version and statistics */
+} sStatsCheckpoint_t;
+
+#define STATS_SIZE         (sizeof(sChannelStats_t) * CHANNELCOUNT)
+
+typedef struct sCalibrationBlock_t
+{
+   uint8_t         uVersion;            /* CALIBRATION_VERSION */
+   sCalibration_t  asChannel[CHANNELCOUNT];
+   uint16_t        uCrc;                /* CRC16 over version and calibration */
+} sCalibrationBlock_t;
+
+#define CALIBRATION_SIZE   (sizeof(sCalibration_t) * CHANNELCOUNT)
+
+/***------------------------- Local Data --------------------------------***/
+
+static sPreset_t EEMEM asPresets[PRESETCOUNT];
+static uint8_t   EEMEM uEeAddress;                /* board address in a chain */
+static sStatsCheckpoint_t EEMEM asEeStats[STATS_SLOTS];
+static sCalibrationBlock_t EEMEM sEeCalibration;
+
+static union
+{
+   sPreset_t            sPreset;
+   sStatsCheckpoint_t   sStats;
+   sCalibrationBlock_t  sCalibration;
+} uWriteBuffer;                                   /* snapshot being written */
+static uint16_t         uWriteSize;
+static uint8_t          *pWriteDest;              /* eeprom destination */
+static volatile uint16_t uWriteIndex;             /* next byte to write */
+static volatile uint8_t uWriteState;              /* WRITE_IDLE or WRITE_BUSY */
+static uint8_t          uStatsSlot = STATS_SLOTS - 1;  /* slot of the last checkpoint */
+static uint16_t         uStatsSequence;
+
+#define WRITE_IDLE         0
+#define WRITE_BUSY         1
+
+/***------------------------ Local functions ----------------------------***/
+/*--------------------------------------------------
+ CRC over a block in SRAM
+ --------------------------------------------------*/
+static uint16_t uCrcBlock( uint16_t uCrc, const uint8_t *pData, uint16_t uSize )
+{
+   while ( uSize > 0 )
+   {
+      uCrc = _crc16_update( uCrc, *pData++ );
+      uSize--;
+   }
+   return uCrc;
+}
+
+/*--------------------------------------------------
+ Validate a slot in EEPROM (reads only)
+ --------------------------------------------------*/
+static bool fSlotValid( uint8_t uSlot )
+{
+   const uint8_t  *pEe = (const uint8_t *) &asPresets[uSlot];
+   uint16_t       uCrc = CRC_START;
+   uint16_t       uCount;
+   sPresetHeader_t sHeader;
+
+   eeprom_read_block( &sHeader, pEe, sizeof(sHeader) );
+   if ( (sHeader.uVersion != SETTINGS_VERSION) || (sHeader.uSize != SETTING_SIZE) )
+   {
+      return false;
+   }
+   for ( uCount = 0; uCount < (sizeof(sPresetHeader_t) + SETTING_SIZE); uCount++ )
+   {
+      uCrc = _crc16_update( uCrc, eeprom_read_byte( pEe++ ) );
+   }
+   return ( uCrc == eeprom_read_word( &asPresets[uSlot].uCrc ) );
+}
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Fill all channel settings with safe defaults (all channels off)
+ --------------------------------------------------*/
+void vSettingsDefaults( void )
+{
+   uint8_t  i;
+
+   memset( sSetChannel, 0, SETTING_SIZE );
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      sSetChannel[i].uVoltages[0] = 10;       /* 1.0V (codes: vPotCodesUpdate) */
+      sSetChannel[i].uVoltages[1] = 10;
+      sSetChannel[i].uTimes[1] = 10;          /* 1ms biphasic pulse */
+      sSetChannel[i].uTimes[3] = 10;
+      sSetChannel[i].uTimes[4] = 1000;        /* 1 Hz */
+   }
+}
+
+/*--------------------------------------------------
+ Load the settings from a slot
+ --------------------------------------------------*/
+bool fSettingsLoad( uint8_t uSlot )
+{
+   if ( (uSlot >= PRESETCOUNT) || fSettingsBusy() || ! fSlotValid( uSlot ) )
+   {
+      return false;
+   }
+   eeprom_read_block( sSetChannel, asPresets[uSlot].asChannel, SETTING_SIZE );
+   return true;
+}
+
+/*--------------------------------------------------
+ Store the settings in a slot with a name (NULL: keep the name)
+ The settings are copied and written in the background
+ --------------------------------------------------*/
+bool fSettingsSave( uint8_t uSlot, const char *szName )
+{
+   uint8_t         i;
+
+   if ( (uSlot >= PRESETCOUNT) || (uWriteState == WRITE_BUSY) )
+   {
+      return false;
+   }
+   if ( szName == NULL )
+   {
+      if ( ! fSettingsInfo( uSlot, uWriteBuffer.sPreset.sHeader.acName ) )
+      {
+         memset( uWriteBuffer.sPreset.sHeader.acName, ' ', PRESETNAMELENGTH );
+      }
+   }
+   else
+   {
+      for ( i = 0; i < PRESETNAMELENGTH; i++ )  /* copy, fill up with spaces */
+      {
+         uWriteBuffer.sPreset.sHeader.acName[i] = (*szName != '\0') ? *szName++ : ' ';
+      }
+   }
+   uWriteBuffer.sPreset.sHeader.uVersion = SETTINGS_VERSION;
+   uWriteBuffer.sPreset.sHeader.uSize = SETTING_SIZE;
+   memcpy( uWriteBuffer.sPreset.asChannel, sSetChannel, SETTING_SIZE );
+   uWriteBuffer.sPreset.uCrc = uCrcBlock( CRC_START, (const uint8_t *) &uWriteBuffer.sPreset,
+                                  sizeof(sPresetHeader_t) + SETTING_SIZE );
+
+   pWriteDest = (uint8_t *) &asPresets[uSlot];
+   uWriteSize = sizeof(sPreset_t);
+   uWriteIndex = 0;
+   uWriteState = WRITE_BUSY;
+   EECR |= _BV(EERIE);                  /* the interrupt does the rest */
+   return true;
+}
+
+/*--------------------------------------------------
+ Check for a background write
+ --------------------------------------------------*/
+bool fSettingsBusy( void )
+{
+   return ( uWriteState == WRITE_BUSY );
+}
+
+/*--------------------------------------------------
+ Check a slot and copy its name
+ --------------------------------------------------*/
+bool fSettingsInfo( uint8_t uSlot, char *acName )
+{
+   if ( (uSlot >= PRESETCOUNT) || fSettingsBusy() || ! fSlotValid( uSlot ) )
+   {
+      return false;
+   }
+   eeprom_read_block( acName, asPresets[uSlot].sHeader.acName, PRESETNAMELENGTH );
+   return true;
+}
+
+/*--------------------------------------------------
+ Board address (erased EEPROM reads as 'standalone')
+ --------------------------------------------------*/
+uint8_t uSettingsAddress( void )
+{
+   uint8_t  uAddress;
+
+   if ( fSettingsBusy() )
+   {
+      return 0;
+   }
+   uAddress = eeprom_read_byte( &uEeAddress );
+   return ( uAddress > ADDRESS_MAX ) ? 0 : uAddress;
+}
+
+bool fSettingsSetAddress( uint8_t uAddress )
+{
+   if ( (uAddress > ADDRESS_MAX) || fSettingsBusy() )
+   {
+      return false;
+   }
+   eeprom_update_byte( &uEeAddress, uAddress );
+   return true;
+}
+
+/*--------------------------------------------------
+ Validate a statistics slot in EEPROM (reads only)
+ --------------------------------------------------*/
+static bool fStatsSlotValid( uint8_t uSlot )
+{
+   const uint8_t  *pEe = (const uint8_t *) &asEeStats[uSlot];
+   uint16_t       uCrc = CRC_START;
+   uint16_t       uCount;
+
+   if ( eeprom_read_byte( &asEeStats[uSlot].uVersion ) != STATS_VERSION )
+   {
+      return false;
+   }
+   for ( uCount = 0; uCount < (offsetof(sStatsCheckpoint_t, uCrc)); uCount++ )
+   {
+      uCrc = _crc16_update( uCrc, eeprom_read_byte( pEe++ ) );
+   }
+   return ( uCrc == eeprom_read_word( &asEeStats[uSlot].uCrc ) );
+}
+
+/*--------------------------------------------------
+ Checkpoint of the statistics, written like a preset; every
+ checkpoint goes to the next slot, so a cell is written once per
+ STATS_SLOTS checkpoints
+ --------------------------------------------------*/
+bool fSettingsSaveStats( const sChannelStats_t *psStats )
+{
+   if ( uWriteState == WRITE_BUSY )
+   {
+      return false;
+   }
+   uStatsSlot = (uStatsSlot + 1) % STATS_SLOTS;
+   uStatsSequence++;
+   uWriteBuffer.sStats.uVersion = STATS_VERSION;
+   uWriteBuffer.sStats.uSequence = uStatsSequence;
+   memcpy( uWriteBuffer.sStats.asChannel, psStats, STATS_SIZE );
+   uWriteBuffer.sStats.uCrc = uCrcBlock( CRC_START, (const uint8_t *) &uWriteBuffer.sStats,
+                                         offsetof(sStatsCheckpoint_t, uCrc) );
+
+   pWriteDest = (uint8_t *) &asEeStats[uStatsSlot];
+   uWriteSize = sizeof(sStatsCheckpoint_t);
+   uWriteIndex = 0;
+   uWriteState = WRITE_BUSY;
+   EECR |= _BV(EERIE);
+   return true;
+}
+
+bool fSettingsLoadStats( sChannelStats_t *psStats )
+{
+   uint8_t  uSlot;
+   uint16_t uSequence;
+   bool     fFound = false;
+
+   if ( fSettingsBusy() )
+   {
+      return false;
+   }
+   for ( uSlot = 0; uSlot < STATS_SLOTS; uSlot++ )
+   {
+      if ( ! fStatsSlotValid( uSlot ) )
+      {
+         continue;
+      }
+      uSequence = eeprom_read_word( &asEeStats[uSlot].uSequence );
+      if ( ! fFound || ((int16_t) (uSequence - uStatsSequence) > 0) )  /* newer, over the wrap */
+      {
+         uStatsSlot = uSlot;
+         uStatsSequence = uSequence;
+         fFound = true;
+      }
+   }
+   if ( fFound )
+   {
+      eeprom_read_block( psStats, asEeStats[uStatsSlot].asChannel, STATS_SIZE );
+   }
+   return fFound;
+}
+
+/*--------------------------------------------------
+ Voltage calibration, written like a preset
+ --------------------------------------------------*/
+bool fSettingsSaveCalibration( const sCalibration_t *psCalibration )
+{
+   if ( uWriteState == WRITE_BUSY )
+   {
+      return false;
+   }
+   uWriteBuffer.sCalibration.uVersion = CALIBRATION_VERSION;
+   memcpy( uWriteBuffer.sCalibration.asChannel, psCalibration, CALIBRATION_SIZE );
+   uWriteBuffer.sCalibration.uCrc = uCrcBlock( CRC_START, (const uint8_t *) &uWriteBuffer.sCalibration,
+                                               offsetof(sCalibrationBlock_t, uCrc) );
+
+   pWriteDest = (uint8_t *) &sEeCalibration;
+   uWriteSize = sizeof(sCalibrationBlock_t);
+   uWriteIndex = 0;
+   uWriteState = WRITE_BUSY;
+   EECR |= _BV(EERIE);
+   return true;
+}
+
+bool fSettingsLoadCalibration( sCalibration_t *psCalibration )
+{
+   const uint8_t  *pEe = (const uint8_t *) &sEeCalibration;
+   uint16_t       uCrc = CRC_START;
+   uint16_t       uCount;
+
+   if ( fSettingsBusy() || (eeprom_read_byte( &sEeCalibration.uVersion ) != CALIBRATION_VERSION) )
+   {
+      return false;
+   }
+   for ( uCount = 0; uCount < (offsetof(sCalibrationBlock_t, uCrc)); uCount++ )
+   {
+      uCrc = _crc16_update( uCrc, eeprom_read_byte( pEe++ ) );
+   }
+   if ( uCrc != eeprom_read_word( &sEeCalibration.uCrc ) )
+   {
+      return false;
+   }
+   eeprom_read_block( psCalibration, sEeCalibration.asChannel, CALIBRATION_SIZE );
+   return true;
+}
+
+/***------------------------ Interrupt functions ------------------------***/
+/*--------------------------------------------------
+ EEPROM ready: write the next changed byte of the snapshot
+ Unchanged bytes are skipped (like eeprom_update_block)
+ --------------------------------------------------*/
+ISR(EE_READY_vect)
+{
+   const uint8_t  *pData = (const uint8_t *) &uWriteBuffer;
+   uint16_t       uIndex = uWriteIndex;
+
+   while ( uIndex < uWriteSize )
+   {
+      EEAR = (uint16_t) (pWriteDest + uIndex);
+      EECR |= _BV(EERE);                /* read the current value */
+      if ( EEDR != pData[uIndex] )
+      {
+         EEDR = pData[uIndex];
+         EECR |= _BV(EEMPE);            /* these two within 4 cycles */
+         EECR |= _BV(EEPE);
+         uWriteIndex = uIndex + 1;
+         return;                        /* next interrupt when this byte is done */
+      }
+      uIndex++;
+   }
+   EECR &= ~_BV(EERIE);                 /* all done */
+   uWriteIndex = uIndex;
+   uWriteState = WRITE_IDLE;
+}
+
+/* EOF */
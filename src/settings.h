@@ -0,0 +1,87 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements storage of the settings in EEPROM preset slots
+
+   Contains:
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+#ifndef SETTINGS_H_
+#define SETTINGS_H_
+
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+#include "waveform.h"
+
+/***------------------------- Defines ------------------------------------***/
+
+#define PRESETCOUNT        6            /* slots; slot 0 is loaded at power up */
+#define PRESETNAMELENGTH   8            /* characters in a preset name */
+#define SETTINGS_VERSION   2            /* change when sSetting_t changes */
+#define ADDRESS_MAX        63           /* board addresses 1..63, 0 is standalone */
+#define STATS_VERSION      2            /* change when sChannelStats_t changes */
+#define STATS_SLOTS        3            /* checkpoints rotate over the slots (EEPROM wear) */
+#define CALIBRATION_VERSION 1           /* change when sCalibration_t changes */
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Fill all channel settings with safe defaults (all channels off)
+ --------------------------------------------------*/
+extern void vSettingsDefaults( void );
+
+/*--------------------------------------------------
+ Load the settings from a slot; the slot is validated (version, size, CRC)
+ Returns false (and leaves the settings untouched) if not valid
+ --------------------------------------------------*/
+extern bool fSettingsLoad( uint8_t uSlot );
+
+/*--------------------------------------------------
+ Store the settings in a slot with a name (NULL: keep the name)
+ The write is done in the background (about 3.4ms per changed byte)
+ Returns false if a write is still busy
+ --------------------------------------------------*/
+extern bool fSettingsSave( uint8_t uSlot, const char *szName );
+
+/*--------------------------------------------------
+ Background write status; while busy the slots can not be read
+ --------------------------------------------------*/
+extern bool fSettingsBusy( void );
+
+/*--------------------------------------------------
+ Check a slot; copies the name (PRESETNAMELENGTH, not terminated)
+ Returns false if the slot is not valid
+ --------------------------------------------------*/
+extern bool fSettingsInfo( uint8_t uSlot, char *acName );
+
+/*--------------------------------------------------
+ Board address for a daisy chain (0: standalone), kept in EEPROM
+ Setting returns false if out of range or a write is busy
+ --------------------------------------------------*/
+extern uint8_t uSettingsAddress( void );
+extern bool fSettingsSetAddress( uint8_t uAddress );
+
+/*--------------------------------------------------
+ Checkpoint of the runtime statistics of all channels; saving is
+ done in the background (false if a write is busy) in the next of
+ the STATS_SLOTS slots, loading takes the newest valid slot and
+ returns false (and leaves the statistics untouched) if there is none
+ --------------------------------------------------*/
+extern bool fSettingsSaveStats( const sChannelStats_t *psStats );
+extern bool fSettingsLoadStats( sChannelStats_t *psStats );
+
+/*--------------------------------------------------
+ Voltage calibration of all channels; kept apart from the presets
+ (it belongs to the board). Saved and loaded like the statistics
+ --------------------------------------------------*/
+extern bool fSettingsSaveCalibration( const sCalibration_t *psCalibration );
+extern bool fSettingsLoadCalibration( sCalibration_t *psCalibration );
+
+#endif /* SETTINGS_H_ */
@@ -22,6 +22,7 @@
 #include "terminal.h"                 /* The command terminal */
 #include "waveform.h"                 /* The pulse generation */
 #include "timer.h"
+#include "adc.h"                      /* The analog acquisition */
 
 /***------------------------- Defines ------------------------------------***/
 
@@ -38,8 +39,16 @@
  /*--------------------------------------------------
  Watchdog pre-main disable funtion
   --------------------------------------------------*/
-uint8_t mcusr_mirror __attribute__ ((section (".noinit")));
+#define NOINIT_MAGIC    0x5AA5          /* the .noinit data is valid */
 
+uint8_t  mcusr_mirror __attribute__ ((section (".noinit")));
+uint16_t uResetCount __attribute__ ((section (".noinit")));
+uint16_t uWatchdogCount __attribute__ ((section (".noinit")));
+volatile uint16_t uHangCount __attribute__ ((section (".noinit")));
+uint8_t  uBootRequest __attribute__ ((section (".noinit")));
+static uint16_t uNoinitMagic __attribute__ ((section (".noinit")));
+
+/* Naked: only simple register access here, no calls and no arithmetic */
 void get_mcusr(void) __attribute__((naked)) __attribute__((section(".init3")));
 void get_mcusr(void)
 {
@@ -48,22 +57,70 @@ void get_mcusr(void)
    wdt_disable();
 }
 
+/*--------------------------------------------------
+ Count the reset in the .noinit counters (kept over resets)
+ --------------------------------------------------*/
+void vResetCauseInit(void)
+{
+   if ( ((mcusr_mirror & _BV(PORF)) != 0) || (uNoinitMagic != NOINIT_MAGIC) )
+   {
+      uNoinitMagic = NOINIT_MAGIC;      /* power on: start counting */
+      uResetCount = 0;
+      uWatchdogCount = 0;
+      uHangCount = 0;
+      uBootRequest = 0;
+   }
+   else
+   {
+      uResetCount += 1;
+      if ( (mcusr_mirror & _BV(WDRF)) != 0 )
+      {
+         if ( uBootRequest == BOOT_REQUEST_MAGIC )
+         {
+            mcusr_mirror |= RESET_BOOTCOMMAND;  /* requested, not a failure */
+         }
+         else
+         {
+            uWatchdogCount += 1;
+         }
+      }
+      uBootRequest = 0;
+   }
+}
+
 
 /*--------------------------------------------------
 The cooperative RoundRobin
  --------------------------------------------------*/
 int main(void)
 {
-   vInitBoard();                        /* for getting correct internal clock */
-   vInitTimer();
+   uint16_t    uDue;                    /* ms until the next waveform event */
+
+   vInitBoard();                        /* outputs off first; correct internal clock */
+   vResetCauseInit();
+   vInitWatchdog();
+   vInitTimer();                        /* time origin for auto-started channels */
    vSerialInit();
-   vTerminalInit();
-   vInitWaveform();
+   vTerminalAddressInit();              /* chain address: prefix for all output */
+   vInitWaveform();                     /* validate settings and arm channels first */
+   vTerminalInit();                     /* banner is sent while pulsing */
 
    for (;;)                             /* The cooperative RoundRobin loop */
    {
+      WATCHDOG_KICK();
       vDoTerminal();                    /* terminal functions */
       vDoWaveform();                    /* waveform generation */
+      vDoAdc();                         /* acquisition blocks */
+      cli();                            /* no interrupt between the check and sleeping */
+      uDue = uWaveformNextDue();
+      if ( fTerminalIdle() && (uDue != 0) )
+      {
+         vTimerSleep( uDue );           /* until the next interrupt; enables interrupts */
+      }
+      else
+      {
+         sei();
+      }
    }
    return 0;
 }
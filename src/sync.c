@@ -0,0 +1,268 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements a synchronized start of several boards
+
+   Contains:
+      All boards share one sync line (open drain, pull-up). The master pulls
+      it low for 100us; on the falling edge every board (the master at the
+      moment it drives the line) starts a new ms at that moment and latches
+      that ms as common time origin. Armed channels start from this origin.
+      The phase correction of the local ms grid is kept and reported; it
+      is not the skew between the boards (that is not measured).
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _lint
+ #ifdef ____ATTR_PURE__
+   #undef __ATTR_PURE__
+ #endif
+ #ifdef __attribute__
+   #undef __attribute__
+ #endif
+ #define __ATTR_PURE__
+ #define __attribute__(var)
+#endif
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "board.h"
+#include "timer.h"
+#include "sync.h"
+
+/***------------------------- Defines -----------------------------------***/
+
+#define ACK_DELAY          50           /* timer1 counts (200us) from the own edge to the acknowledge */
+#define ACK_WIDTH          10           /* timer1 counts (40us) of the acknowledge pulse */
+#define ACK_GUARD_MS       2            /* ms after an edge in which the acknowledges are no edge */
+
+#define ACK_NONE           0            /* no sync edge to acknowledge */
+#define ACK_WAIT           1            /* slave: acknowledge at the end of the sync pulse; master: wait for it */
+#define ACK_DONE           2
+
+/***----------------------- Local Types ---------------------------------***/
+
+/***------------------------- Local Data --------------------------------***/
+
+static uint8_t             uSyncMode;        /* SYNC_OFF, SYNC_MASTER or SYNC_SLAVE */
+static volatile uint8_t    fSyncLatched;     /* origin latched, not yet used */
+static volatile uint16_t   uSyncOrigin;      /* ms of the last sync edge */
+static volatile int16_t    iSyncCorrection;  /* time grid correction (4us) */
+static volatile uint16_t   uSyncCount;       /* sync edges seen */
+static uint16_t            uSyncStamp;       /* timer1 count of the last sync edge */
+static uint8_t             uAckState;        /* ACK_NONE .. ACK_DONE */
+static bool                fAckLow;          /* master: start of the acknowledge seen */
+static uint16_t            uAckFirst;        /* master: timer1 count at its start */
+static volatile bool       fSkewValid;       /* master: acknowledge complete */
+static volatile uint16_t   uSkewFirst;       /* master: acknowledge start and end, */
+static volatile uint16_t   uSkewLast;        /*   relative to the own edge (4us) */
+
+/***------------------------ Local functions ----------------------------***/
+/*--------------------------------------------------
+ Latch the origin at a sync edge (interrupts are disabled)
+ --------------------------------------------------*/
+static void vLatchOrigin( void )
+{
+   uSyncStamp = TCNT1;
+   iSyncCorrection = iTimerSyncAlign();
+   uSyncOrigin = uSystemTimerCounter;
+   fSyncLatched = 1;
+   uSyncCount += (uSyncCount != UINT16_MAX);
+}
+
+/*--------------------------------------------------
+ Slave: pull the line low for ACK_WIDTH, ACK_DELAY after the own
+ edge, so the master sees the skew of the slaves: the line goes low
+ at the first one and high again at the last one. Waits in the pin
+ change interrupt of the end of the sync pulse (about 100us, plus
+ the width); no acknowledge when that comes too late
+ --------------------------------------------------*/
+static void vSendAck( void )
+{
+   uint16_t    uAt = uSyncStamp + ACK_DELAY;
+
+   if ( (uint16_t) (uAt - TCNT1) > ACK_DELAY )
+   {
+      return;                           /* past the moment */
+   }
+   while ( (int16_t) (TCNT1 - uAt) < 0 )
+   {
+   }
+   AUX_PORT &= ~(1 << SYNC_PIN);        /* from pull-up to driving low */
+   AUX_DDR |= (1 << SYNC_PIN);
+   uAt += ACK_WIDTH;
+   while ( (int16_t) (TCNT1 - uAt) < 0 )
+   {
+   }
+   AUX_DDR &= ~(1 << SYNC_PIN);         /* release: pull-up again */
+   AUX_PORT |= (1 << SYNC_PIN);
+}
+
+/*--------------------------------------------------
+ Master: the acknowledge of the slaves, both edges
+ --------------------------------------------------*/
+static void vTakeAck( bool fLow )
+{
+   uint16_t    uNow = TCNT1;
+
+   if ( fLow && ! fAckLow )
+   {
+      fAckLow = true;
+      uAckFirst = uNow;
+   }
+   else if ( ! fLow && fAckLow )        /* not the end of the own pulse */
+   {
+      uSkewFirst = uAckFirst - uSyncStamp - ACK_DELAY;
+      uSkewLast = uNow - uSyncStamp - (ACK_DELAY + ACK_WIDTH);
+      fSkewValid = true;
+      uAckState = ACK_DONE;
+   }
+}
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Sync off, master or slave
+ The line is released (input with pull-up) except for off
+ --------------------------------------------------*/
+void vSyncSetMode( uint8_t uMode )
+{
+   cli();
+   uSyncMode = uMode;
+   fSyncLatched = 0;
+   uAckState = ACK_NONE;
+   fSkewValid = false;
+   AUX_DDR &= ~(1 << SYNC_PIN);
+   vBoardPinChangeEnable( SYNC_PIN, false );
+   if ( uMode == SYNC_OFF )
+   {
+      AUX_PORT &= ~(1 << SYNC_PIN);     /* high impedance */
+   }
+   else
+   {
+      AUX_PORT |= (1 << SYNC_PIN);      /* pull-up */
+   }
+   if ( uMode != SYNC_OFF )
+   {
+      vBoardPinChangeEnable( SYNC_PIN, true );  /* the master for the acknowledge */
+   }
+   sei();
+}
+
+uint8_t uSyncGetMode( void )
+{
+   return uSyncMode;
+}
+
+/*--------------------------------------------------
+ Master: pull the sync line low for 100us; the own origin is
+ latched at the same moment the slaves see the edge. Then wait
+ (in the interrupt) for the acknowledge of the slaves
+ --------------------------------------------------*/
+void vSyncPulse( void )
+{
+   cli();
+   AUX_PORT &= ~(1 << SYNC_PIN);        /* from pull-up to driving low */
+   AUX_DDR |= (1 << SYNC_PIN);
+   vLatchOrigin();
+   fSkewValid = false;
+   uAckState = ACK_NONE;
+   sei();
+   delay_100us( 1 );
+   cli();
+   AUX_DDR &= ~(1 << SYNC_PIN);         /* release: pull-up again */
+   AUX_PORT |= (1 << SYNC_PIN);
+   fAckLow = false;
+   uAckState = ACK_WAIT;
+   sei();
+}
+
+/*--------------------------------------------------
+ Take the latched origin (once per sync edge)
+ --------------------------------------------------*/
+bool fSyncTakeOrigin( uint16_t *puOrigin, int16_t *piCorrectionUs )
+{
+   bool  fLatched = false;
+
+   cli();
+   if ( fSyncLatched != 0 )
+   {
+      fSyncLatched = 0;
+      *puOrigin = uSyncOrigin;
+      *piCorrectionUs = iSyncCorrection * 4;
+      fLatched = true;
+   }
+   sei();
+   return fLatched;
+}
+
+/*--------------------------------------------------
+ Sync pin changed (pin change interrupt): a falling edge is the
+ sync pulse for a slave, the next change the end of it (then the
+ acknowledge). The master takes the acknowledge
+ --------------------------------------------------*/
+void vSyncPinChange( bool fLow )
+{
+   uint16_t    uNow;
+   bool        fRecent;               /* the acknowledges of the last edge */
+
+   if ( uSyncMode == SYNC_MASTER )
+   {
+      if ( uAckState == ACK_WAIT )
+      {
+         vTakeAck( fLow );
+      }
+      return;
+   }
+   if ( uSyncMode != SYNC_SLAVE )
+   {
+      return;
+   }
+   vGetSystemTimer( &uNow );
+   fRecent = ( (uAckState != ACK_NONE) && ((uint16_t) (uNow - uSyncOrigin) < ACK_GUARD_MS) );
+   if ( fRecent && (uAckState == ACK_WAIT) )
+   {
+      vSendAck();
+      uAckState = ACK_DONE;
+   }
+   else if ( fLow && ! fRecent )
+   {
+      vLatchOrigin();
+      uAckState = ACK_WAIT;
+   }
+}
+
+/*--------------------------------------------------
+ Statistics: edges seen and the last correction in us
+ --------------------------------------------------*/
+void vSyncGetStats( uint16_t *puCount, int16_t *piCorrectionUs )
+{
+   cli();
+   *puCount = uSyncCount;
+   *piCorrectionUs = iSyncCorrection * 4;
+   sei();
+}
+
+/*--------------------------------------------------
+ Master: skew of the slaves at the last sync pulse (us)
+ --------------------------------------------------*/
+bool fSyncGetSkew( int16_t *piFirstUs, int16_t *piLastUs )
+{
+   bool  fValid;
+
+   cli();
+   fValid = fSkewValid;
+   *piFirstUs = (int16_t) uSkewFirst * 4;
+   *piLastUs = (int16_t) uSkewLast * 4;
+   sei();
+   return fValid;
+}
+
+/* EOF */
@@ -0,0 +1,64 @@
+/*----------------------------------------------------------------------------
+
+ Copyright 2023, GHJ Morsink
+
+
+   Purpose:
+      Implements a synchronized start of several boards
+
+   Contains:
+
+   Module:
+      Stimulator
+
+------------------------------------------------------------------------------
+*/
+#ifndef SYNC_H_
+#define SYNC_H_
+
+/***------------------------- Includes ----------------------------------***/
+#include <stdint.h>
+#include <stdbool.h>
+
+/***------------------------- Defines ------------------------------------***/
+
+#define SYNC_OFF           0
+#define SYNC_MASTER        1            /* gives the sync pulse at 'RU' */
+#define SYNC_SLAVE         2            /* starts armed channels at the sync pulse */
+
+/***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Mode of this board (off after power up)
+ --------------------------------------------------*/
+extern void vSyncSetMode( uint8_t uMode );
+extern uint8_t uSyncGetMode( void );
+
+/*--------------------------------------------------
+ Master: give the sync pulse (and latch the own origin)
+ --------------------------------------------------*/
+extern void vSyncPulse( void );
+
+/*--------------------------------------------------
+ Take the origin (ms) of the last sync edge and the correction of
+ the time grid in us; false if there was no new edge
+ --------------------------------------------------*/
+extern bool fSyncTakeOrigin( uint16_t *puOrigin, int16_t *piCorrectionUs );
+
+/*--------------------------------------------------
+ From the pin change interrupt (interrupts disabled)
+ --------------------------------------------------*/
+extern void vSyncPinChange( bool fLow );
+
+/*--------------------------------------------------
+ Number of sync edges and the last correction (us)
+ --------------------------------------------------*/
+extern void vSyncGetStats( uint16_t *puCount, int16_t *piCorrectionUs );
+
+/*--------------------------------------------------
+ Master: skew of the slaves at the last sync pulse (us), from the
+ own edge to the first and the last slave edge (their acknowledge);
+ false when no acknowledge was seen
+ --------------------------------------------------*/
+extern bool fSyncGetSkew( int16_t *piFirstUs, int16_t *piLastUs );
+
+#endif /* SYNC_H_ */
@@ -27,7 +27,6 @@
  #define __attribute__(var)
 #endif
 #include <avr/pgmspace.h>
-#include <avr/eeprom.h>
 #include <avr/wdt.h>
 
 #include <string.h>
@@ -40,7 +39,13 @@
 #include "log.h"
 #include "serial.h"
 #include "waveform.h"                   /* for accesss to the settings */
+#include "settings.h"
+#include "timer.h"
 #include "terminal.h"
+#include "sync.h"
+#include "adc.h"
+#include "monitor.h"
+#include "chain.h"
 
 
 
@@ -48,11 +53,29 @@
 
 #define MAXINPUTLENGTH     64           /* maximal command is 64 characters */
 #define MAXSENDLENGTH      80           /* maximal sending length for strings; before waits needed */
-#define MAX_INT_DIGITS     5            /* maximal digits in a uint16 */
+#define ARGS_MAX           (1 + TIMECOUNT)  /* most arguments: ST, channel and times */
+#define ARGS_COUNT         0x0F         /* command table: arguments needed, */
+#define ARGS_TEXT          0x40         /*   a text may follow the last one, */
+#define ARGS_OPTIONAL      0x80         /*   or none at all (show only) */
+
+#define ARG_OK             0            /* results of the argument parser */
+#define ARG_MISSING        1
+#define ARG_RANGE          2
+#define ARG_SYNTAX         3
+#define ARG_TOOMANY        4
+#define BAUD_CONFIRMTIME   5000         /* ms to confirm a new baudrate */
+
+#define HISTORYCOUNT       4            /* number of previous command lines kept */
 
 #define BS     0x08
 #define BELL   0x07
 #define CR     0x0D
+#define LF     0x0A
+#define ESC    0x1B
+#define DEL    0x7F
+#define CTRL_N 0x0E                     /* next line in history */
+#define CTRL_P 0x10                     /* previous line in history */
+#define CTRL_R 0x12                     /* repeat last command */
 
 /***------------------------- Types -------------------------------------***/
 
@@ -61,6 +84,21 @@
 /***------------------------- Local Data --------------------------------***/
 
 static char    acUserInput[MAXINPUTLENGTH];              /* Console input buffer */
+static uint8_t uInputLength;                             /* characters in acUserInput */
+static uint8_t uEscState;                                /* position in an ESC [ x sequence */
+
+static char    acHistory[HISTORYCOUNT][MAXINPUTLENGTH];  /* ring of previous commands */
+static uint8_t uHistoryHead;                             /* next slot to write */
+static uint8_t uHistoryCount;                            /* valid lines in the ring */
+static uint8_t uHistoryRecall;                           /* lines back while browsing (0: not) */
+
+static uint8_t uBoardAddress;                            /* address in a chain, 0: standalone */
+static uint8_t fHostMode;                                /* program as user: no echo */
+static bool    fEepromWriting;                           /* report when the write is done */
+static char    acLinePrefix[5];                          /* "#<address> " before all output */
+
+static uint32_t ulPreviousBaud;                          /* fallback baudrate, 0: none pending */
+static uint16_t uBaudChangeTime;                         /* time of the baudrate change */
 
 /***------------------------ Global Data --------------------------------***/
 /*--------------------------------------------------
@@ -69,104 +107,211 @@ static char    acUserInput[MAXINPUTLENGTH];              /* Console input buffer
 
 /***------------------------- Types -------------------------------------***/
 
-typedef void (USER_COMMAND)( char *argv );
+typedef struct
+{
+   uint8_t    uCount;                   /* arguments given */
+   uint32_t   aulValue[ARGS_MAX];       /* each within its range; a negative one as int32_t */
+   char       *pcText;                  /* ARGS_TEXT: the text after the last comma, else NULL */
+} sArgs_t;
+
+typedef struct
+{
+   int32_t    lMin;                     /* a negative minimum allows a '-' */
+   int32_t    lMax;
+} sArgRange_t;
+
+typedef void (USER_COMMAND)( const sArgs_t *psArgs );
 
 /*--------------------------Prototypes for table---------------------------*/
 
-static void  f_he( char *argv );
-static void  f_ve( char *argv );
-static void  f_ru( char *argv );
-static void  f_of( char *argv );
-static void  f_ss( char *argv );
-static void  f_sv( char *argv );
-static void  f_st( char *argv );
-static void  f_sd( char *argv );
-static void  f_sc( char *argv );
-static void  f_wr( char *argv );
-static void  f_bo( char *argv );
+static void  f_he( const sArgs_t *psArgs );
+static void  f_ve( const sArgs_t *psArgs );
+static void  f_ru( const sArgs_t *psArgs );
+static void  f_of( const sArgs_t *psArgs );
+static void  f_ss( const sArgs_t *psArgs );
+static void  f_sv( const sArgs_t *psArgs );
+static void  f_ca( const sArgs_t *psArgs );
+static void  f_st( const sArgs_t *psArgs );
+static void  f_sd( const sArgs_t *psArgs );
+static void  f_sc( const sArgs_t *psArgs );
+static void  f_wr( const sArgs_t *psArgs );
+static void  f_bo( const sArgs_t *psArgs );
+static void  f_br( const sArgs_t *psArgs );
+static void  f_ov( const sArgs_t *psArgs );
+static void  f_fc( const sArgs_t *psArgs );
+static void  f_ps( const sArgs_t *psArgs );
+static void  f_pl( const sArgs_t *psArgs );
+static void  f_pi( const sArgs_t *psArgs );
+static void  f_rc( const sArgs_t *psArgs );
+static void  f_cb( const sArgs_t *psArgs );
+static void  f_cl( const sArgs_t *psArgs );
+static void  f_sl( const sArgs_t *psArgs );
+static void  f_ad( const sArgs_t *psArgs );
+static void  f_sy( const sArgs_t *psArgs );
+static void  f_tg( const sArgs_t *psArgs );
+static void  f_to( const sArgs_t *psArgs );
+static void  f_aq( const sArgs_t *psArgs );
+static void  f_mo( const sArgs_t *psArgs );
+static void  f_cs( const sArgs_t *psArgs );
+static void  f_ck( const sArgs_t *psArgs );
+static void  f_dl( const sArgs_t *psArgs );
+static void  f_hm( const sArgs_t *psArgs );
+
+static void  vSetAddress( uint8_t uAddress );
+
+/*--------------------------------------------------
+ The command table: two command characters, function, the arguments
+ needed (with ARGS_OPTIONAL and ARGS_TEXT), the range of every argument
+ and the help text. The help is given in this sequence. The table is
+ expanded at compile time into flash-resident help strings, argument
+ ranges, the command list and a hash index.
+ --------------------------------------------------*/
+#define ARG(min, max)      { (min), (max) },
+#define ARG_CHANNEL        ARG( 1, CHANNELCOUNT )
+#define ARG_BOOL           ARG( 0, 1 )
+#define ARG_BYTE           ARG( 0, 255 )
+#define ARG_WORD           ARG( 0, 65535 )
+#define NOARGS
+
+#define COMMAND_TABLE(CMD) \
+    CMD( 'H', 'E', f_he, 0, NOARGS, "HE  HElp" ) \
+    CMD( 'V', 'E', f_ve, 0, NOARGS, "VE  Show VErsion" ) \
+    CMD( 'R', 'U', f_ru, 0, ARG_CHANNEL, "RU  " CHANNEL_TEXT " RUn Start pulses" ) \
+    CMD( 'O', 'F', f_of, 0, ARG_CHANNEL, "OF  Set all outputs OFf (or " CHANNEL_TEXT ")" ) \
+    CMD( 'C', 'B', f_cb, 0, ARG_CHANNEL, "CB  [" CHANNEL_TEXT "] show Charge Balance (or reset a channel)" ) \
+    CMD( 'C', 'L', f_cl, ARGS_OPTIONAL | 2, ARG( 0, 100 ) ARG( 0, 999999999UL ), \
+         "CL  [<0..100>,<0..999999999>] show/set Charge Limits" ) \
+    CMD( 'C', 'S', f_cs, 0, ARG_CHANNEL, "CS  [" CHANNEL_TEXT "] show Channel Statistics (or reset a channel)" ) \
+    CMD( 'C', 'K', f_ck, 0, ARG_BYTE, "CK  [<0,5..255>] ChecKpoint statistics to EEPROM (or every n minutes)" ) \
+    CMD( 'D', 'L', f_dl, ARGS_OPTIONAL | 3, ARG_CHANNEL ARG_BYTE ARG_BOOL, \
+         "DL  [" CHANNEL_TEXT ",<0..255>,<0..1>] show/set DeadLine: channel, tolerance (ms), alarm" ) \
+    CMD( 'B', 'O', f_bo, 0, NOARGS, "BO  BOot/reset (firmware update)" ) \
+    CMD( 'R', 'C', f_rc, 0, NOARGS, "RC  show Reset Cause and reset counters" ) \
+    CMD( 'T', 'G', f_tg, ARGS_OPTIONAL | 3, ARG( 0, TRIGGER_FALLING ) ARG( 0, (1UL << CHANNELCOUNT) - 1 ) ARG_BYTE, \
+         "TG  [<0..2>," CHANNELMASK_TEXT ",<0..255>] show/set TriGger: edge, channels, debounce" ) \
+    CMD( 'T', 'O', f_to, ARGS_OPTIONAL | 3, ARG_CHANNEL ARG( 0, MARKER_BURST ) ARG_WORD, \
+         "TO  [" CHANNEL_TEXT ",<0..3>,<0..65535>] show/set Trigger Output: channel, mode, width" ) \
+    CMD( 'A', 'Q', f_aq, 0, ARG( 0, ADC_RATEMAX ) ARG( 1, ADC_INPUTS ), \
+         "AQ  [<0..5000>,<1..3>] show/set AcQuisition: rate (/s, 0 off), inputs" ) \
+    CMD( 'M', 'O', f_mo, 0, ARG( 0, MONITOR_STOP ) ARG_WORD ARG_WORD, \
+         "MO  [<0..2>,<0..65535>,<0..65535>] show/set output MOnitor: mode, open (uA), short (ohm)" ) \
+    CMD( 'S', 'Y', f_sy, 0, ARG( 0, SYNC_SLAVE ), "SY  [<0..2>] show/set SYnc mode: 0 off, 1 master, 2 slave" ) \
+    CMD( 'A', 'D', f_ad, 0, ARG( 0, ADDRESS_MAX ), "AD  [<0..63>] show/set board ADdress in a chain (0: standalone)" ) \
+    CMD( 'S', 'L', f_sl, 0, ARG_BOOL, "SL  [<0..1>] show (and reset) idle SLeep statistics, set on/off" ) \
+    CMD( 'H', 'M', f_hm, 0, ARG_BOOL, "HM  [<0..1>] show/set Host Mode: no echo, prompt line, no XON/XOFF" ) \
+    CMD( 'B', 'R', f_br, 0, ARG( 300, 2000000UL ), "BR  [<300..2000000>] show/set BaudRate (confirm in 5s)" ) \
+    CMD( 'F', 'C', f_fc, 0, ARG_BOOL, "FC  [<0..1>] show/set XON/XOFF Flow Control" ) \
+    CMD( 'O', 'V', f_ov, 0, NOARGS, "OV  show and reset serial OVerflow counters" ) \
+    CMD( 'S', 'S', f_ss, 0, NOARGS, "SS  Show Settings" ) \
+    CMD( 'S', 'V', f_sv, 3, ARG_CHANNEL ARG( 0, 50 ) ARG( 0, 50 ), \
+         "SV  " CHANNEL_TEXT ",<0..50>,<0..50> Set Voltage; pos. and neg. pulse" ) \
+    CMD( 'C', 'A', f_ca, ARGS_OPTIONAL | 3, ARG_CHANNEL ARG( CAL_GAIN_MIN, CAL_GAIN_MAX ) \
+         ARG( -CAL_OFFSET_MAX, CAL_OFFSET_MAX ), \
+         "CA  [" CHANNEL_TEXT ",<500..2000>,<-50..50>] show/set CAlibration: gain (1/1000), offset (pot steps)" ) \
+    CMD( 'S', 'T', f_st, 6, ARG_CHANNEL ARG_WORD ARG_WORD ARG_WORD ARG_WORD ARG_WORD, \
+         "ST  " CHANNEL_TEXT ",<0..65535>,..,<0..65535> Set Timing; 5 timing parms" ) \
+    CMD( 'S', 'D', f_sd, 4, ARG_CHANNEL ARG_WORD ARG_WORD ARG( 0, 10 ), \
+         "SD  " CHANNEL_TEXT ",<0..65535>,<0..65535>,<0..10> Set Delta timing" ) \
+    CMD( 'S', 'C', f_sc, 2, ARG_CHANNEL ARG_WORD, "SC  " CHANNEL_TEXT ",<0..65535> Set repeat count" ) \
+    CMD( 'W', 'R', f_wr, 0, NOARGS, "WR  Write/store all settings (for power up)" ) \
+    CMD( 'P', 'S', f_ps, ARGS_TEXT | 1, ARG( 0, PRESETCOUNT - 1 ), "PS  <0..5>[,<name>] Preset Save (0 is power up)" ) \
+    CMD( 'P', 'L', f_pl, 1, ARG( 0, PRESETCOUNT - 1 ), "PL  <0..5> Preset Load" ) \
+    CMD( 'P', 'I', f_pi, 0, NOARGS, "PI  Preset Info; list all slots" )
+
+/*--------------------------------------------------
+ Perfect hash on the two command characters. The multiplier is chosen
+ such that all commands get their own slot; a new command which collides
+ gives a 'duplicate case value' error in vCommandHashCheck below. Then
+ choose another multiplier (or a larger table), not another name.
+ --------------------------------------------------*/
+#define CMD_HASHSIZE       128          /* power of 2 */
+#define CMD_HASHMUL        52u
+#define CMD_HASH(c1, c2)   ((uint8_t) ((((uint8_t) (c1)) * CMD_HASHMUL + ((uint8_t) (c2))) & (CMD_HASHSIZE - 1)))
 
 /***----------------------- Local Types ---------------------------------***/
-static const struct sAccess
-{
-    USER_COMMAND    *pFunctionPointer;
-    char            *szHelpText;
-} asAccessArr[] = {
-    { f_he,     "HE  HElp" },
-    { f_ve,     "VE  Show VErsion" },
-    { f_ru,     "RU  <1..4> RUn Start pulses" },
-    { f_of,     "OF  Set all outputs OFf (or <1..4>)" },
-    { f_bo,     "BO  BOot/reset (firmware update)" },
-    { f_ss,     "SS  Show Settings" },
-    { f_sv,     "SV  <1..4>,<0..50>,<0..50> Set Voltage; pos. and neg. pulse" },
-    { f_st,     "ST  <1..4>,<0..65535>,..,<0..65535> Set Timing; 5 timing parms" },
-    { f_sd,     "SD  <1..4>,<0..65535>,<0..65535>,<0..255> Set Delta timing" },
-    { f_sc,     "SC  <1..4>,<0..65535> Set repeat count" },
-    { f_wr,     "WR  Write/store all settings" }
+struct sAccess
+{
+    USER_COMMAND       *pFunctionPointer;
+    const char         *szHelpText;
+    const sArgRange_t  *psArgRange;
+    uint8_t            uArgsNeeded;     /* with ARGS_OPTIONAL and ARGS_TEXT */
+    uint8_t            uArgsMax;
 };
 
-#define  iAccArrSize (sizeof(asAccessArr) / sizeof(struct sAccess))
+#define CMD_HELPTEXT(c1, c2, func, need, args, help)  static const char szHelp_##func[] PROGMEM = help;
+COMMAND_TABLE( CMD_HELPTEXT )
+
+/* The last range only keeps the array of a command without arguments valid */
+#define CMD_ARGRANGE(c1, c2, func, need, args, help) \
+    static const sArgRange_t asArgs_##func[] PROGMEM = { args ARG( 0, 0 ) }; \
+    typedef char acArgCheck_##func[ (CMD_ARGCOUNT(func) <= ARGS_MAX) ? 1 : -1 ];
+#define CMD_ARGCOUNT(func)  ((uint8_t) ((sizeof(asArgs_##func) / sizeof(sArgRange_t)) - 1))
+COMMAND_TABLE( CMD_ARGRANGE )
+
+#define CMD_ENUM(c1, c2, func, need, args, help)      CMDIDX_##func,
+enum eCommandIndex { COMMAND_TABLE( CMD_ENUM ) iAccArrSize };
+
+#define CMD_ACCESS(c1, c2, func, need, args, help) \
+    { func, szHelp_##func, asArgs_##func, (need), CMD_ARGCOUNT(func) },
+static const struct sAccess asAccessArr[iAccArrSize] PROGMEM = {
+    COMMAND_TABLE( CMD_ACCESS )
+};
+
+#define CMD_SLOT(c1, c2, func, need, args, help)      [CMD_HASH(c1, c2)] = CMDIDX_##func + 1,
+static const uint8_t auCommandSlot[CMD_HASHSIZE] PROGMEM = {   /* 0 is empty, else index + 1 */
+    COMMAND_TABLE( CMD_SLOT )
+};
+
+/* Never called: two commands in one slot are two equal case labels */
+#define CMD_CASE(c1, c2, func, need, args, help)      case CMD_HASH(c1, c2) :
+static inline void vCommandHashCheck( uint8_t uHash )
+{
+    switch ( uHash )
+    {
+        COMMAND_TABLE( CMD_CASE )
+        default:
+            break;
+    }
+}
 
 
 /***------------------------ Local functions ----------------------------***/
 /*--------------------------------------------------
- Extracts an integer floating pointvalue from a string
+ Read a decimal number and move the pointer past its digits.
+ Returns ARG_OK, ARG_MISSING (no digit) or ARG_RANGE (over 32 bits)
  --------------------------------------------------*/
-uint8_t read_uint(char *line, uint8_t *char_counter, uint16_t *variable_ptr)
+static uint8_t uReadNumber( char **ppcText, uint32_t *pulValue )
 {
-    char       *ptr = line + *char_counter;
+    char       *pcText = *ppcText;
+    uint32_t   ulValue = 0;
+    uint8_t    uResult = ARG_MISSING;
     uint8_t    c;
-    uint16_t   intval = 0;
-    uint8_t    ndigit = 0;
 
-    while(1)
+    while ( (c = (uint8_t) (*pcText - '0')) <= 9 )
     {
-         /* Grab first character and increment pointer. No spaces assumed in line. */
-        c = (uint8_t) *ptr++;
-        c -= '0';
-        if (c <= 9)
+        if ( (ulValue > (UINT32_MAX / 10)) ||
+             ((ulValue == (UINT32_MAX / 10)) && (c > (UINT32_MAX % 10))) )
         {
-            ndigit++;
-            if (ndigit <= MAX_INT_DIGITS)
-            {
-                intval = (((intval << 2) + intval) << 1) + c; /* intval*10 + c */
-            } // else  Drop overflow digits
-        } else {
-            break;
+            uResult = ARG_RANGE;        /* the digits are skipped */
+        }
+        else if ( uResult != ARG_RANGE )
+        {
+            ulValue = (((ulValue << 2) + ulValue) << 1) + c; /* ulValue*10 + c */
+            uResult = ARG_OK;
         }
+        pcText++;
     }
-
-    // Return if no digits have been read.
-    if (!ndigit) { return(false); };
-
-    // prepare output.
-    *variable_ptr = intval;
-    *char_counter = (ptr - line) - 1; // Set char_counter to next statement
-    return(true);
+    *ppcText = pcText;
+    *pulValue = ulValue;
+    return uResult;
 }
 
 /*--------------------------------------------------
-Wait for room in serial output buffer
+Wait for room in serial output buffer (not for a stalled link)
  --------------------------------------------------*/
 static void waitPrint(void)
 {
-   while ( uSerialGetFree() < MAXSENDLENGTH )
-   {
-      ;
-   }
-}
-
-/*--------------------------------------------------
-Write string
- --------------------------------------------------*/
-static void vWriteString( char * const szString, unsigned char uLength )
-{
-   register unsigned char   uSentCount;
-
-   waitPrint();                         /* wait for room to print */
-   for ( uSentCount = 0; uSentCount < uLength; uSentCount++ )
-   {
-      vSerialPutChar( (unsigned char) szString[ uSentCount ] );  /* send 1 character */
-   }
+   (void) fSerialWaitFree( MAXSENDLENGTH );
 }
 
 /*--------------------------------------------------
@@ -175,30 +320,54 @@ vShowPrompt
  --------------------------------------------------*/
 static void vShowPrompt( void )
 {
-    uint8_t i;
-
     vLogString( PSTR( "TERM>" ));   /* show prompt */
-    for ( i = 0; i < MAXINPUTLENGTH; i++ )
+    if ( (uBoardAddress != 0) || (fHostMode != 0) )
     {
-       acUserInput[i] = '\0';      /* clear the inputline */
+       vSendCR();                   /* chain, host: the prompt line ends the response */
     }
+    uInputLength = 0;               /* clear the inputline */
+    acUserInput[0] = '\0';
+    uHistoryRecall = 0;
 }
 
 /*--------------------------------------------------
-Parameter error
+Parameter error, of argument uIndex (1 is the first)
  --------------------------------------------------*/
-static void vShowParmError( uint8_t type )
+static void vShowParmError( uint8_t uError, uint8_t uIndex )
 {
-   if ( type == 0 )
-   {
-      vLogString( PSTR( "Parameter out of bounds" ) );
-   } else
+   vLogString( PSTR( "Parameter" ));
+   print_uint16_base10( uIndex );
+   vSerialPutChar( ' ' );
+   switch ( uError )
    {
-      vLogString( PSTR( "Parameter missing" ) );
+      case ARG_MISSING :
+         vLogString( PSTR( "missing" ) );
+         break;
+      case ARG_SYNTAX :
+         vLogString( PSTR( "syntax" ) );
+         break;
+      case ARG_TOOMANY :
+         vLogString( PSTR( "not expected" ) );
+         break;
+      default :
+         vLogString( PSTR( "out of bounds" ) );
+         break;
    }
    vLogInfo( PSTR( "error" ) );
 }
 
+/*--------------------------------------------------
+ Skip spaces and tabs
+ --------------------------------------------------*/
+static char *pcSkipBlanks( char *pcText )
+{
+   while ( (*pcText == ' ') || (*pcText == '\t') )
+   {
+      pcText++;
+   }
+   return pcText;
+}
+
 /*--------------------------------------------------
 isspace
     simple check on space-characters
@@ -222,18 +391,19 @@ static bool fIsSpace( char cInput )
 Commands
   Help
  --------------------------------------------------*/
-static void f_he( char *argv )
+static void f_he( const sArgs_t *psArgs )
 {
-   uint8_t iCount;
+   uint8_t     iCount;
+   const char  *pszHelp;
 
-   (void) argv;
+   (void) psArgs;
    vLogInfo( PSTR("HELP: First two characters are the command; implemented:") );
    vSendCR();
    for ( iCount = 0; iCount < iAccArrSize; iCount++ )
-   {                                   /* write all strings */
-       vWriteString( asAccessArr[ iCount ].szHelpText,
-                     (uint8_t) strlen( asAccessArr[ iCount ].szHelpText ) );
-       vSendCR();
+   {                                   /* write all strings, in full */
+       pszHelp = (const char *) pgm_read_word( &asAccessArr[ iCount ].szHelpText );
+       (void) fSerialWaitFree( (uint8_t) (strlen_P( pszHelp ) + sizeof(acLinePrefix) + 2) );
+       vLogText( pszHelp );
    }
 }
 
@@ -241,9 +411,9 @@ static void f_he( char *argv )
 Commands
   Show version
  --------------------------------------------------*/
-static void f_ve( char *argv )
+static void f_ve( const sArgs_t *psArgs )
 {
-   (void) argv;
+   (void) psArgs;
    vLogInfo( PSTR( "Stimulator Version 2.00.00" ));
 }
 
@@ -251,10 +421,12 @@ static void f_ve( char *argv )
 Commands
   Boot
  --------------------------------------------------*/
-static void f_bo( char *argv )
+static void f_bo( const sArgs_t *psArgs )
 {
-   (void) argv;
+   (void) psArgs;
    vLogInfo( PSTR("Reboot") );
+   vAllOutputsOff();
+   uBootRequest = BOOT_REQUEST_MAGIC;   /* reported by RC */
    wdt_enable(WDTO_60MS);
    for(;;)
    {
@@ -262,345 +434,1118 @@ static void f_bo( char *argv )
    }
 }
 
+/*--------------------------------------------------
+ Show a baudrate with its error (in 0.1%)
+ --------------------------------------------------*/
+static void vShowBaud( uint32_t ulBaud, int16_t iError )
+{
+   vLogString( PSTR( "Baudrate" ));
+   print_uint32_base10( ulBaud );
+   vLogString( PSTR( ", error" ));
+   if ( iError < 0 )
+   {
+      vSerialPutChar( '-' );
+      iError = -iError;
+   }
+   print_uint16_base10( (uint16_t) iError / 10 );
+   vSerialPutChar( '.' );
+   print_uint16_base10( (uint16_t) iError % 10 );
+   vSerialPutChar( '%' );
+   vSendCR();
+}
+
 /*--------------------------------------------------
 Commands
-  run
+  Baudrate: show or change
+  After a change the host must send a line within BAUD_CONFIRMTIME,
+  otherwise the previous baudrate is restored
  --------------------------------------------------*/
-static void f_ru( char *argv )
+static void f_br( const sArgs_t *psArgs )
 {
-   uint16_t   iChannel;
-   uint8_t    uPoint;             /* pointer into the argument string */
-   uint8_t    iRc;
+   uint32_t   ulBaud;
+   uint16_t   uUbrr;
+   uint8_t    uDouble;
+   int16_t    iError;
 
-   uPoint = 0;
-   iRc = read_uint( argv, &uPoint, &iChannel ); /* get channel to work on */
-   if (! iRc)
+   if ( psArgs->uCount == 0 )
    {
-      for(uPoint = 0; uPoint < CHANNELCOUNT; uPoint++)
-      {
-         sSetChannel[uPoint].uStartFlag = 1;    /* start all */
-      }
+      ulBaud = ulGetBaud();
+      vShowBaud( ulBaud, iSerialCalcBaud( ulBaud, &uUbrr, &uDouble ) );
+      return;
    }
-   else if ( (iChannel == 0) || (iChannel > CHANNELCOUNT) )
+   ulBaud = psArgs->aulValue[0];
+   iError = iSerialCalcBaud( ulBaud, &uUbrr, &uDouble );
+   if ( iError == SERIAL_BAUD_INVALID )
    {
-      vShowParmError(0);
+      vShowParmError( ARG_RANGE, 1 );
+      return;
    }
-   else
+   vShowBaud( ulBaud, iError );
+   vLogInfo( PSTR( "Confirm with <enter> on the new baudrate" ));
+   if ( ulPreviousBaud == 0 )
    {
-      sSetChannel[iChannel - 1].uStartFlag = 1;    /* start specific */
+      ulPreviousBaud = ulGetBaud();     /* keep the last confirmed one */
    }
+   (void) uSetBaud( ulBaud );           /* sends out all text first */
+   vGetSystemTimer( &uBaudChangeTime );
 }
 
 /*--------------------------------------------------
-Commands
-  Off, Stop all or specific
+ Check the confirmation of a baudrate change
+ A received line confirms, a timeout restores the previous baudrate
  --------------------------------------------------*/
-static void f_of( char *argv )
+static void vCheckBaudConfirm( bool fLineReceived )
 {
-   uint16_t   iChannel;
-   uint8_t    uPoint;             /* pointer into the argument string */
-   uint8_t    iRc;
+   uint16_t uNow;
 
-   uPoint = 0;
-   iRc = read_uint( argv, &uPoint, &iChannel ); /* get channel to work on */
-   if (! iRc)
+   if ( ulPreviousBaud == 0 )
    {
-      vLogInfo( PSTR( "Off" ));
-      for(uPoint = 0; uPoint < CHANNELCOUNT; uPoint++)
-      {
-         sSetChannel[uPoint].uStartFlag = 0;    /* stop all */
-      }
+      return;                           /* nothing pending */
    }
-   else if ( (iChannel == 0) || (iChannel > CHANNELCOUNT) )
+   if ( fLineReceived )
    {
-      vShowParmError(0);
+      ulPreviousBaud = 0;
+      vLogInfo( PSTR( "Baudrate confirmed" ));
+      return;
    }
-   else
+   vGetSystemTimer( &uNow );
+   if ( (uint16_t) (uNow - uBaudChangeTime) >= BAUD_CONFIRMTIME )
+   {
+      (void) uSetBaud( ulPreviousBaud );
+      ulPreviousBaud = 0;
+      vSendCR();
+      vLogInfo( PSTR( "Baudrate not confirmed; restored" ));
+      vShowPrompt();
+   }
+}
+
+/*--------------------------------------------------
+ The binary acquisition blocks need host mode without XON/XOFF
+ (a block byte 0x11/0x13 is no flow control): the acquisition
+ stops when one of them is switched back
+ --------------------------------------------------*/
+static void vAcquisitionStop( void )
+{
+   uint16_t   uRate;
+   uint8_t    uMask;
+
+   vAdcGetSetup( &uRate, &uMask );
+   if ( uRate != 0 )
    {
-      sSetChannel[iChannel - 1].uStartFlag = 0;    /* stop specific */
+      vAdcStart( 0, 0 );
+      vLogInfo( PSTR( "Acquisition stopped" ));
    }
 }
 
 /*--------------------------------------------------
 Commands
-  Show settings
+  Flow control on/off
  --------------------------------------------------*/
-static void f_ss( char *argv )
+static void f_fc( const sArgs_t *psArgs )
 {
-   uint8_t  i, j;
+   if ( psArgs->uCount != 0 )
+   {
+      if ( psArgs->aulValue[0] != 0 )
+      {
+         vAcquisitionStop();
+      }
+      vSerialSetFlowControl( (uint8_t) psArgs->aulValue[0] );
+   }
+   vLogString( PSTR( "Flow control XON/XOFF:" ));
+   print_uint16_base10( uSerialGetFlowControl() );
+   vSendCR();
+}
 
-   (void) argv;
-   vLogInfo( PSTR( "Settings:" ));
-   for ( i = 0; i < CHANNELCOUNT; i++)
+/*--------------------------------------------------
+Commands
+  Host mode for a program: no echo and no pulse characters, every
+  response ends with the prompt line. XON/XOFF is switched off (the
+  acquisition blocks are binary); the program limits what it sends
+ --------------------------------------------------*/
+static void f_hm( const sArgs_t *psArgs )
+{
+   if ( psArgs->uCount != 0 )
    {
-      vSendCR();
-      waitPrint();                         /* wait for room to print */
-      vLogString( PSTR( "Settings channel:      " ));
-      print_uint16_base10(i+1);
-      vSendCR();
-      waitPrint();                         /* wait for room to print */
-      vLogString( PSTR( "Voltage V1, V2:        " ));
-      print_uint16_base10(sSetChannel[i].uVoltages[0]);
-      SendCommaSpace();
-      print_uint16_base10(sSetChannel[i].uVoltages[1]);
-      vSendCR();
-      waitPrint();                         /* wait for room to print */
-      vLogString( PSTR( "Timings T0,T1,T2,T3,T4:" ));
-      for ( j = 0; j < 5; j++)
+      fHostMode = (uint8_t) psArgs->aulValue[0];
+      if ( fHostMode == 0 )
       {
-         print_uint16_base10(sSetChannel[i].uTimes[j]);
-         if ( j < 4 )
-         {
-            SendCommaSpace();
-         }
+         vAcquisitionStop();
       }
-      vSendCR();
-      waitPrint();                         /* wait for room to print */
-      vLogString( PSTR( "Delta DT, DP, DM:      " ) );
-      for ( j = 0; j < 3; j++)
+      if ( uBoardAddress == 0 )         /* a chain has no flow control */
       {
-         print_uint16_base10(sSetChannel[i].uDelta[j]);
-         if ( j < 2 )
-         {
-            SendCommaSpace();
-         }
+         vSerialSetFlowControl( (fHostMode != 0) ? 0 : 1 );
       }
-      vSendCR();
-      waitPrint();                         /* wait for room to print */
-      vLogString( PSTR( "Pulse Counts RPT:      " ));
-      print_uint16_base10(sSetChannel[i].pulseCount);
-      vSendCR();
    }
+   vLogString( PSTR( "Host mode:" ));
+   print_uint16_base10( fHostMode );
+   vSendCR();
 }
 
 /*--------------------------------------------------
 Commands
-  Set voltages
+  Overflow counters (counted until 255)
  --------------------------------------------------*/
-static void f_sv( char *argv )
+static void f_ov( const sArgs_t *psArgs )
 {
-   uint16_t   iChannel;
-   uint16_t   uVolts[2];
-   uint8_t    uPoint;                                 /* pointer into the argument string */
-   uint8_t    iRc;
+   uint8_t  uRx, uTx, uStops;
+
+   (void) psArgs;
+   vSerialGetCounters( &uRx, &uTx, &uStops );
+   vLogString( PSTR( "Overflow RX, TX, RX stops:" ));
+   print_uint16_base10( uRx );
+   SendCommaSpace();
+   print_uint16_base10( uTx );
+   SendCommaSpace();
+   print_uint16_base10( uStops );
+   vSendCR();
+}
 
-   uPoint = 0;
-   iRc = read_uint( argv, &uPoint, &iChannel );       /* get channel to work on */
-   if (! iRc)
-   {
-      vShowParmError(1);
-      return;
-   }
-   if ( (iChannel == 0) || (iChannel > CHANNELCOUNT) )
+/*--------------------------------------------------
+Commands
+  Reset cause
+ --------------------------------------------------*/
+static void f_rc( const sArgs_t *psArgs )
+{
+   (void) psArgs;
+   vLogString( PSTR( "Reset cause:" ));
+   if ( (mcusr_mirror & _BV(PORF)) != 0 )
    {
-      vShowParmError(0);
-      return;
+      vLogString( PSTR( "POWERON" ));
    }
-   uPoint++;
-   iRc = read_uint( argv, &uPoint, &uVolts[0] );      /* get V1 */
-   if ( iRc )
+   if ( (mcusr_mirror & _BV(EXTRF)) != 0 )
    {
-      uPoint++;
-      iRc = read_uint( argv, &uPoint, &uVolts[1] );   /* get V2 */
+      vLogString( PSTR( "EXTERNAL" ));
    }
-   if (! iRc)
+   if ( (mcusr_mirror & _BV(BORF)) != 0 )
    {
-      vShowParmError(1);
-      return;
+      vLogString( PSTR( "BROWNOUT" ));
    }
-   if ( (uVolts[0] > 50) || (uVolts[1] > 50) )
+   if ( (mcusr_mirror & _BV(WDRF)) != 0 )
    {
-      vShowParmError(0);
-      return;
+      if ( (mcusr_mirror & RESET_BOOTCOMMAND) != 0 )
+      {
+         vLogString( PSTR( "BOOTCOMMAND" ));
+      }
+      else
+      {
+         vLogString( PSTR( "WATCHDOG" ));
+      }
    }
-   /* Set the resulting parameters */
-   iChannel -= 1;
-   sSetChannel[iChannel].uVoltages[0] = (uint8_t) uVolts[0];
-   sSetChannel[iChannel].uVoltages[1] = (uint8_t) uVolts[1];
+   vSendCR();
+   vLogString( PSTR( "Resets, watchdog, hangs since power on:" ));
+   print_uint16_base10( uResetCount );
+   SendCommaSpace();
+   print_uint16_base10( uWatchdogCount );
+   SendCommaSpace();
+   print_uint16_base10( uHangCount );
+   vSendCR();
 }
 
 /*--------------------------------------------------
 Commands
-  Set times
+  Idle sleep on/off and statistics
  --------------------------------------------------*/
-static void f_st( char *argv )
+static void f_sl( const sArgs_t *psArgs )
 {
+   uint16_t   uCount;
+   uint16_t   uLatency;
+   uint8_t    uIdle;
 
-   uint16_t   iChannel;
-   uint16_t   uTempTimes[TIMECOUNT];
-   uint8_t    uPoint;                           /* pointer into the argument string */
-   uint8_t    iRc;
-   uint8_t    i;
+   if ( psArgs->uCount != 0 )
+   {
+      vTimerSleepEnable( (uint8_t) psArgs->aulValue[0] );
+   }
+   vTimerSleepStats( &uCount, &uIdle, &uLatency );
+   vLogString( PSTR( "Sleep on, sleeps, idle %, max. wake latency (us):" ));
+   print_uint16_base10( fTimerSleepEnabled() );
+   SendCommaSpace();
+   print_uint16_base10( uCount );
+   SendCommaSpace();
+   print_uint16_base10( uIdle );
+   SendCommaSpace();
+   print_uint16_base10( uLatency );
+   vSendCR();
+}
+
+/*--------------------------------------------------
+ Start a channel, unless its pulses are out of the charge limits
+ --------------------------------------------------*/
+static void vStartChannel( uint8_t uChannel )
+{
+   uint8_t  uEdge, uDebounce;
+   uint16_t uMask;
 
-   uPoint = 0;
-   iRc = read_uint( argv, &uPoint, &iChannel ); /* get channel to work on */
-   if (! iRc)
+   if ( ! fChargeAllowed( uChannel ) )
    {
-      vShowParmError(1);
+      vLogString( PSTR( "Refused, charge limits:" ));
+      print_uint16_base10( uChannel + 1 );
+      vSendCR();
       return;
    }
-   if ( (iChannel == 0) || (iChannel > CHANNELCOUNT) )
+   vMonitorReset( uChannel );
+   vTriggerGetSetup( &uEdge, &uMask, &uDebounce );
+   if ( (uEdge != TRIGGER_OFF) && ((uMask & (1u << uChannel)) != 0) )
    {
-      vShowParmError(0);
-      return;
+      sSetChannel[uChannel].uStartFlag = START_TRIGGER;  /* start at the trigger */
    }
-   uPoint++;
-   for ( i = 0; i < TIMECOUNT; i++ )
+   else if ( uSyncGetMode() == SYNC_OFF )
    {
-      iRc = read_uint( argv, &uPoint, &uTempTimes[i] ); /* get Tx */
-      if (! iRc)
-      {
-         vShowParmError(1);
-         return;
-      }
-      uPoint++;
+      sSetChannel[uChannel].uStartFlag = START_STARTING;
    }
-   /* Set the resulting parameters */
-   iChannel -= 1;
-   for ( i = 0; i < TIMECOUNT; i++ )
+   else
    {
-      sSetChannel[iChannel].uTimes[i] = uTempTimes[i];
+      sSetChannel[uChannel].uStartFlag = START_ARMED;  /* start at the sync pulse */
    }
 }
 
 /*--------------------------------------------------
 Commands
-  Set delta
+  Trigger input: edge (0 off, 1 rising, 2 falling), channel mask
+  (1 = channel 1, .., 15 = all) and debounce time in ms
  --------------------------------------------------*/
-static void f_sd( char *argv )
+static void f_tg( const sArgs_t *psArgs )
 {
-   uint16_t   iChannel;
-   uint16_t   uTempDelta[3];
-   uint8_t    uPoint;             /* pointer into the argument string */
-   uint8_t    iRc;
+   uint8_t    uEdge, uDebounce;
+   uint16_t   uMask;
+   uint16_t   uCount;
+   uint32_t   aulLatency[CHANNELCOUNT];
    uint8_t    i;
 
-   uPoint = 0;
-   iRc = read_uint( argv, &uPoint, &iChannel ); /* get channel to work on */
-   if (! iRc)
-   {
-      vShowParmError(1);
-      return;
-   }
-   if ( (iChannel == 0) || (iChannel > CHANNELCOUNT) )
+   if ( psArgs->uCount != 0 )
    {
-      vShowParmError(0);
-      return;
+      vTriggerSetup( (uint8_t) psArgs->aulValue[0], (uint16_t) psArgs->aulValue[1], (uint8_t) psArgs->aulValue[2] );
    }
-   uPoint++;
-   for ( i = 0; i < 3; i++ )
+   vTriggerGetSetup( &uEdge, &uMask, &uDebounce );
+   vTriggerGetStats( &uCount, aulLatency );
+   vLogString( PSTR( "Trigger edge, channels, debounce:" ));
+   print_uint16_base10( uEdge );
+   SendCommaSpace();
+   print_uint16_base10( uMask );
+   SendCommaSpace();
+   print_uint16_base10( uDebounce );
+   vSendCR();
+   vLogString( PSTR( "Triggers:" ));
+   print_uint16_base10( uCount );
+   vSendCR();
+   vLogInfo( PSTR( "Max. latency interrupt to pulse edge per channel (us)" ));
+   for ( i = 0; i < CHANNELCOUNT; i++ )
    {
-      iRc = read_uint( argv, &uPoint, &uTempDelta[i] ); /* get DT DP DM */
-      if (! iRc)
+      if ( (uMask & (1u << i)) == 0 )
       {
-         vShowParmError(1);
-         return;
+         continue;
       }
-      uPoint++;
-   }
-   if ( uTempDelta[2] > 10 )
-   {
-      vShowParmError(0);
-      return;
-   }
-   /* Set the resulting parameters */
-   iChannel -= 1;
-   for ( i = 0; i < 3; i++ )
-   {
-      sSetChannel[iChannel].uDelta[i] = uTempDelta[i];
+      waitPrint();                         /* wait for room to print */
+      print_uint16_base10( i + 1 );
+      vLogString( PSTR( ":" ));
+      print_uint32_base10( aulLatency[i] );
+      vSendCR();
    }
 }
 
 /*--------------------------------------------------
 Commands
-  Set count
+  Trigger (marker) output per channel: mode and width (100us)
  --------------------------------------------------*/
-static void f_sc( char *argv )
+static void f_to( const sArgs_t *psArgs )
 {
-   uint16_t   iChannel;
-   uint16_t   uTempCount;
-   uint8_t    uPoint;             /* pointer into the argument string */
-   uint8_t    iRc;
+   uint8_t    uMode;
+   uint16_t   uWidth;
+   uint8_t    i;
 
-   uPoint = 0;
-   iRc = read_uint( argv, &uPoint, &iChannel ); /* get channel to work on */
-   if (! iRc)
-   {
-      vShowParmError(1);
-      return;
-   }
-   if ( (iChannel == 0) || (iChannel > CHANNELCOUNT) )
+   if ( psArgs->uCount != 0 )
    {
-      vShowParmError(0);
-      return;
+      vMarkerSetup( (uint8_t) (psArgs->aulValue[0] - 1), (uint8_t) psArgs->aulValue[1], (uint16_t) psArgs->aulValue[2] );
    }
-   uPoint++;
-   iRc = read_uint( argv, &uPoint, &uTempCount ); /* get RPT */
-   if (! iRc)
+   vLogInfo( PSTR( "Trigger output channel: mode, width (0.1 ms)" ));
+   for ( i = 0; i < CHANNELCOUNT; i++ )
    {
-      vShowParmError(1);
-      return;
+      waitPrint();                         /* wait for room to print */
+      vMarkerGetSetup( i, &uMode, &uWidth );
+      print_uint16_base10( i + 1 );
+      vLogString( PSTR( ":" ));
+      print_uint16_base10( uMode );
+      SendCommaSpace();
+      print_uint16_base10( uWidth );
+      vSendCR();
    }
-   /* Set the resulting parameters */
-   sSetChannel[iChannel - 1].pulseCount = uTempCount;
 }
 
 /*--------------------------------------------------
 Commands
-  Store to eeprom
+  Acquisition of the analog inputs: conversions/s (0 is off) and the
+  inputs (bit mask). Binary blocks are not possible in a chain
  --------------------------------------------------*/
-static void f_wr( char *argv )
+static void f_aq( const sArgs_t *psArgs )
 {
-   uint8_t  size;
-   uint8_t  *ptr = &sSetChannel[0].uStartFlag;      /* beginning of settings
-                                          */
-   (void) argv;
-   vLogInfo( PSTR( "Writing to eeprom" ));
-   for ( size = 0; size < SETTING_SIZE; size++ )
+   uint16_t   uRate;
+   uint16_t   uBlocks;
+   uint16_t   uLost;
+   uint8_t    uMask;
+
+   if ( psArgs->uCount != 0 )
    {
-      eeprom_update_byte( &NonVolatileSettings[size], *ptr );
-      ptr++;
+      uRate = (uint16_t) psArgs->aulValue[0];
+      uMask = (psArgs->uCount > 1) ? (uint8_t) psArgs->aulValue[1] : ADC_INPUTS;
+      if ( (uRate != 0) && (uRate < ADC_RATEMIN) )
+      {
+         vShowParmError( ARG_RANGE, 1 );
+         return;
+      }
+      if ( (uMask & ~ADC_INPUTS) != 0 )
+      {
+         vShowParmError( ARG_RANGE, 2 );
+         return;
+      }
+      if ( fTerminalChained() && (uRate != 0) )
+      {
+         vLogInfo( PSTR( "Refused in a chain" ));
+         return;
+      }
+      if ( ((fHostMode == 0) || (uSerialGetFlowControl() != 0)) && (uRate != 0) )
+      {
+         vLogInfo( PSTR( "Refused: needs host mode (HM 1) and no XON/XOFF" ));
+         return;
+      }
+      vAdcStart( uRate, uMask );
    }
+   vAdcGetSetup( &uRate, &uMask );
+   vAdcGetStats( &uBlocks, &uLost );
+   vLogString( PSTR( "Acquisition rate, inputs:" ));
+   print_uint16_base10( uRate );
+   SendCommaSpace();
+   print_uint16_base10( uMask );
+   vSendCR();
+   vLogString( PSTR( "Blocks, lost samples:" ));
+   print_uint16_base10( uBlocks );
+   SendCommaSpace();
+   print_uint16_base10( uLost );
+   vSendCR();
 }
 
 /*--------------------------------------------------
-fCompareTwo
-    compare first two characters from two strings
---------------------------------------------------*/
-static bool fCompareTwo( char *szFirst, char *szSecond )
+Commands
+  Output monitor: mode (0 off, 1 report, 2 report and stop), limits
+  of an open (uA) and a short load (ohm); the estimate per channel
+ --------------------------------------------------*/
+static void f_mo( const sArgs_t *psArgs )
 {
-    if ( (szFirst[0] == szSecond[0]) &&
-         (szFirst[1] == szSecond[1]) )
-    {
-        return true;
-    }
-    return false;
+   uint16_t   uValues[3];
+   uint8_t    uMode;
+   uint16_t   uVoltage, uCurrent, uLoad;
+   uint8_t    uState;
+   uint8_t    i;
+
+   if ( psArgs->uCount != 0 )
+   {
+      vMonitorGetSetup( &uMode, &uValues[1], &uValues[2] );
+      for ( i = 1; i < psArgs->uCount; i++ )
+      {
+         uValues[i] = (uint16_t) psArgs->aulValue[i];   /* the others are kept */
+      }
+      vMonitorSetup( (uint8_t) psArgs->aulValue[0], uValues[1], uValues[2] );
+   }
+   vMonitorGetSetup( &uMode, &uValues[1], &uValues[2] );
+   vLogString( PSTR( "Monitor mode, open (uA), short (ohm), skipped:" ));
+   print_uint16_base10( uMode );
+   SendCommaSpace();
+   print_uint16_base10( uValues[1] );
+   SendCommaSpace();
+   print_uint16_base10( uValues[2] );
+   SendCommaSpace();
+   print_uint16_base10( uMonitorSkipped() );
+   vSendCR();
+   vLogInfo( PSTR( "Load channel: mV, uA, ohm, state (0 none, 1 ok, 2 open, 3 short)" ));
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      waitPrint();                         /* wait for room to print */
+      uState = uMonitorGet( i, &uVoltage, &uCurrent, &uLoad );
+      print_uint16_base10( i + 1 );
+      vLogString( PSTR( ":" ));
+      print_uint16_base10( uVoltage );
+      SendCommaSpace();
+      print_uint16_base10( uCurrent );
+      SendCommaSpace();
+      print_uint16_base10( uLoad );
+      SendCommaSpace();
+      print_uint16_base10( uState );
+      vSendCR();
+   }
 }
 
 /*--------------------------------------------------
-vParseCommand
-    check whats in the command buffer and react on it
-    The buffer is filled
+Commands
+  Sync mode and statistics
  --------------------------------------------------*/
-static void vParseCommand( void )
+static void f_sy( const sArgs_t *psArgs )
 {
-   char    *pcCurrent;                 /* current character */
-   char    *pszArgv[2];
-   uint8_t iCount;
+   uint16_t   uCount;
+   int16_t    iCorrection;
+   int16_t    iFirst, iLast;
 
-   pcCurrent = acUserInput;            /* the buffer from the serial line */
-
-   while( (*pcCurrent != '\0') &&  (fIsSpace( *pcCurrent ) == true ) )
+   if ( psArgs->uCount != 0 )
    {
-      pcCurrent++;                    /* remove leading spaces */
+      vSyncSetMode( (uint8_t) psArgs->aulValue[0] );
    }
-   pszArgv[0] = pcCurrent;             /* mnemonic or empty string   */
-
-   while( (*pcCurrent != '\0') &&  (fIsSpace( *pcCurrent ) == false ) )
+   vSyncGetStats( &uCount, &iCorrection );
+   vLogString( PSTR( "Sync mode, pulses, last grid phase correction (us):" ));
+   print_uint16_base10( uSyncGetMode() );
+   SendCommaSpace();
+   print_uint16_base10( uCount );
+   SendCommaSpace();
+   print_int16_base10( iCorrection );
+   vSendCR();
+   if ( uSyncGetMode() == SYNC_MASTER )
    {
-      pcCurrent++;                    /* skip token */
+      vLogString( PSTR( "Skew first, last slave (us):" ));
+      if ( fSyncGetSkew( &iFirst, &iLast ) )
+      {
+         print_int16_base10( iFirst );
+         SendCommaSpace();
+         print_int16_base10( iLast );
+      }
+      else
+      {
+         vLogString( PSTR( "none" ));
+      }
+      vSendCR();
    }
-   if ( *pcCurrent != '\0' )
+}
+
+/*--------------------------------------------------
+Commands
+  Charge balance, per channel: net charge of a pulse, imbalance
+  and the accumulated net charge (0.01 V.ms)
+ --------------------------------------------------*/
+static void f_cb( const sArgs_t *psArgs )
+{
+   uint8_t    i;
+
+   if ( psArgs->uCount != 0 )
+   {
+      vChargeReset( (uint8_t) (psArgs->aulValue[0] - 1) );
+   }
+   vLogInfo( PSTR( "Charge (0.01 V.ms) channel: pulse net, imbalance %, accumulated" ));
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      waitPrint();                         /* wait for room to print */
+      print_uint16_base10( i + 1 );
+      vLogString( PSTR( ":" ));
+      print_int32_base10( lPulseCharge( i ) );
+      SendCommaSpace();
+      print_uint16_base10( uChargeImbalance( i ) );
+      SendCommaSpace();
+      print_int32_base10( lChargeTotal( i ) );
+      vSendCR();
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Charge limits: imbalance of a pulse (%) and accumulated net
+  charge. 0 is 'no check'
+ --------------------------------------------------*/
+static void f_cl( const sArgs_t *psArgs )
+{
+   if ( psArgs->uCount != 0 )
+   {
+      uChargeImbalanceLimit = (uint8_t) psArgs->aulValue[0];
+      ulChargeLimit = psArgs->aulValue[1];
+   }
+   vLogString( PSTR( "Charge limits imbalance %, accumulated:" ));
+   print_uint16_base10( uChargeImbalanceLimit );
+   SendCommaSpace();
+   print_uint32_base10( ulChargeLimit );
+   vSendCR();
+}
+
+/*--------------------------------------------------
+Commands
+  run
+ --------------------------------------------------*/
+static void f_ru( const sArgs_t *psArgs )
+{
+   uint8_t    i;
+
+   if ( psArgs->uCount == 0 )
+   {
+      for ( i = 0; i < CHANNELCOUNT; i++ )
+      {
+         vStartChannel( i );                    /* start all */
+      }
+   }
+   else
+   {
+      vStartChannel( (uint8_t) (psArgs->aulValue[0] - 1) );  /* start specific */
+   }
+   if ( uSyncGetMode() == SYNC_MASTER )
+   {
+      vSyncPulse();                             /* all boards: common origin */
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Off, Stop all or specific
+ --------------------------------------------------*/
+static void f_of( const sArgs_t *psArgs )
+{
+   uint8_t    i;
+
+   if ( psArgs->uCount == 0 )
+   {
+      vLogInfo( PSTR( "Off" ));
+      for ( i = 0; i < CHANNELCOUNT; i++ )
+      {
+         sSetChannel[i].uStartFlag = 0;         /* stop all */
+      }
+   }
+   else
+   {
+      sSetChannel[(uint8_t) (psArgs->aulValue[0] - 1)].uStartFlag = 0;    /* stop specific */
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Show settings
+ --------------------------------------------------*/
+static void f_ss( const sArgs_t *psArgs )
+{
+   uint8_t  i, j;
+
+   (void) psArgs;
+   vLogInfo( PSTR( "Settings:" ));
+   for ( i = 0; i < CHANNELCOUNT; i++)
+   {
+      vSendCR();
+      waitPrint();                         /* wait for room to print */
+      vLogString( PSTR( "Settings channel:      " ));
+      print_uint16_base10(i+1);
+      vSendCR();
+      waitPrint();                         /* wait for room to print */
+      vLogString( PSTR( "Voltage V1, V2:        " ));
+      print_uint16_base10(sSetChannel[i].uVoltages[0]);
+      SendCommaSpace();
+      print_uint16_base10(sSetChannel[i].uVoltages[1]);
+      vSendCR();
+      waitPrint();                         /* wait for room to print */
+      vLogString( PSTR( "Timings T0,T1,T2,T3,T4:" ));
+      for ( j = 0; j < 5; j++)
+      {
+         print_uint16_base10(sSetChannel[i].uTimes[j]);
+         if ( j < 4 )
+         {
+            SendCommaSpace();
+         }
+      }
+      vSendCR();
+      waitPrint();                         /* wait for room to print */
+      vLogString( PSTR( "Delta DT, DP, DM:      " ) );
+      for ( j = 0; j < 3; j++)
+      {
+         print_uint16_base10(sSetChannel[i].uDelta[j]);
+         if ( j < 2 )
+         {
+            SendCommaSpace();
+         }
+      }
+      vSendCR();
+      waitPrint();                         /* wait for room to print */
+      vLogString( PSTR( "Pulse Counts RPT:      " ));
+      print_uint16_base10(sSetChannel[i].pulseCount);
+      vSendCR();
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Set voltages
+ --------------------------------------------------*/
+static void f_sv( const sArgs_t *psArgs )
+{
+   uint8_t    uChannel;
+
+   uChannel = (uint8_t) (psArgs->aulValue[0] - 1);
+   vSetVoltages( uChannel, (uint8_t) psArgs->aulValue[1], (uint8_t) psArgs->aulValue[2] );
+}
+
+/*--------------------------------------------------
+Commands
+  Set times
+ --------------------------------------------------*/
+static void f_st( const sArgs_t *psArgs )
+{
+   uint8_t    uChannel;
+   uint8_t    i;
+
+   uChannel = (uint8_t) (psArgs->aulValue[0] - 1);
+   for ( i = 0; i < TIMECOUNT; i++ )
+   {
+      sSetChannel[uChannel].uTimes[i] = (uint16_t) psArgs->aulValue[i + 1];
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Set delta
+ --------------------------------------------------*/
+static void f_sd( const sArgs_t *psArgs )
+{
+   uint8_t    uChannel;
+   uint8_t    i;
+
+   uChannel = (uint8_t) (psArgs->aulValue[0] - 1);
+   for ( i = 0; i < 3; i++ )
+   {
+      sSetChannel[uChannel].uDelta[i] = (uint16_t) psArgs->aulValue[i + 1];
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Set count
+ --------------------------------------------------*/
+static void f_sc( const sArgs_t *psArgs )
+{
+   sSetChannel[(uint8_t) (psArgs->aulValue[0] - 1)].pulseCount = (uint16_t) psArgs->aulValue[1];
+}
+
+/*--------------------------------------------------
+ EEPROM is still busy writing
+ --------------------------------------------------*/
+static void vShowEepromBusy( void )
+{
+   vLogInfo( PSTR( "EEPROM busy; try again" ));
+}
+
+/*--------------------------------------------------
+Commands
+  Board address in a chain, stored in EEPROM
+ --------------------------------------------------*/
+static void f_ad( const sArgs_t *psArgs )
+{
+   uint8_t    uAddress;
+
+   if ( psArgs->uCount != 0 )
+   {
+      uAddress = (uint8_t) psArgs->aulValue[0];
+      if ( ! fSettingsSetAddress( uAddress ) )
+      {
+         vShowEepromBusy();
+         return;
+      }
+      vSetAddress( uAddress );
+   }
+   vLogString( PSTR( "Board address:" ));
+   print_uint16_base10( uBoardAddress );
+   vSendCR();
+}
+
+/*--------------------------------------------------
+Commands
+  Store to eeprom
+ --------------------------------------------------*/
+static void f_wr( const sArgs_t *psArgs )
+{
+   (void) psArgs;
+   if ( fSettingsSave( 0, NULL ) )
+   {
+      fEepromWriting = true;
+      vLogInfo( PSTR( "Writing to eeprom" ));
+   }
+   else
+   {
+      vShowEepromBusy();
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Preset save, with optional name
+ --------------------------------------------------*/
+static void f_ps( const sArgs_t *psArgs )
+{
+   uint8_t    uSlot;
+   uint8_t    i;
+   bool       fSaved;
+   char       acName[PRESETNAMELENGTH + 1];
+
+   uSlot = (uint8_t) psArgs->aulValue[0];
+   if ( psArgs->pcText == NULL )
+   {
+      fSaved = fSettingsSave( uSlot, NULL );   /* keep the name */
+   }
+   else
+   {
+      for ( i = 0; (i < PRESETNAMELENGTH) && ! fIsSpace( psArgs->pcText[i] ); i++ )
+      {
+         acName[i] = psArgs->pcText[i];
+      }
+      acName[i] = '\0';
+      fSaved = fSettingsSave( uSlot, acName );
+   }
+   if ( fSaved )
+   {
+      fEepromWriting = true;
+      vLogInfo( PSTR( "Writing preset" ));
+   }
+   else
+   {
+      vShowEepromBusy();
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Preset load; the run state of the channels is kept
+ --------------------------------------------------*/
+static void f_pl( const sArgs_t *psArgs )
+{
+   uint8_t    uSlot;
+   uint8_t    i;
+   uint8_t    auFlags[CHANNELCOUNT];
+
+   uSlot = (uint8_t) psArgs->aulValue[0];
+   if ( fSettingsBusy() )
+   {
+      vShowEepromBusy();
+      return;
+   }
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      auFlags[i] = sSetChannel[i].uStartFlag;
+   }
+   if ( ! fSettingsLoad( uSlot ) )
+   {
+      vLogInfo( PSTR( "Preset empty or invalid" ));
+      return;
+   }
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      sSetChannel[i].uStartFlag = auFlags[i];
+   }
+   vPotCodesUpdate();                   /* the calibration may have changed since */
+   vLogInfo( PSTR( "Preset loaded" ));
+}
+
+/*--------------------------------------------------
+Commands
+  Preset info: list all slots
+ --------------------------------------------------*/
+static void f_pi( const sArgs_t *psArgs )
+{
+   uint8_t    uSlot;
+   char       acName[PRESETNAMELENGTH];
+
+   (void) psArgs;
+   if ( fSettingsBusy() )
+   {
+      vShowEepromBusy();
+      return;
+   }
+   for ( uSlot = 0; uSlot < PRESETCOUNT; uSlot++ )
+   {
+      waitPrint();
+      vLogString( PSTR( "Preset" ));
+      print_uint16_base10( uSlot );
+      vSerialPutChar( ':' );
+      vSerialPutChar( ' ' );
+      if ( fSettingsInfo( uSlot, acName ) )
+      {
+         NA_WriteBuffer( (unsigned char *) acName, PRESETNAMELENGTH );
+      }
+      else
+      {
+         vLogString( PSTR( "<empty>" ));
+      }
+      vSendCR();
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Runtime statistics per channel; a channel number resets that channel
+ --------------------------------------------------*/
+static void f_cs( const sArgs_t *psArgs )
+{
+   sChannelStats_t  sStats;
+   uint8_t          i;
+
+   if ( psArgs->uCount != 0 )
+   {
+      vStatsReset( (uint8_t) (psArgs->aulValue[0] - 1) );
+   }
+   vLogInfo( PSTR( "Channel: pulses, runs, on-time (0.1 ms), min. and max. period (us), misses" ));
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      waitPrint();                         /* wait for room to print */
+      vStatsGet( i, &sStats );
+      print_uint16_base10( i + 1 );
+      vLogString( PSTR( ":" ));
+      print_uint32_base10( sStats.ulPulses );
+      SendCommaSpace();
+      print_uint32_base10( sStats.ulRuns );
+      SendCommaSpace();
+      print_uint32_base10( sStats.ulOnTime );
+      SendCommaSpace();
+      print_uint32_base10( sStats.ulPeriodMin );
+      SendCommaSpace();
+      print_uint32_base10( sStats.ulPeriodMax );
+      SendCommaSpace();
+      print_uint32_base10( sStats.ulMisses );
+      vSendCR();
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Deadline check per channel: tolerance (ms) and alarm; shows (and
+  resets) the maximum lateness
+ --------------------------------------------------*/
+static void f_dl( const sArgs_t *psArgs )
+{
+   uint8_t    uTolerance;
+   bool       fAlarm;
+   uint16_t   uLateMax;
+   uint8_t    i;
+
+   if ( psArgs->uCount != 0 )
+   {
+      vDeadlineSetup( (uint8_t) (psArgs->aulValue[0] - 1), (uint8_t) psArgs->aulValue[1], (psArgs->aulValue[2] != 0) );
+   }
+   vLogInfo( PSTR( "Deadline channel: tolerance (ms), alarm, max. late (ms)" ));
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      waitPrint();                         /* wait for room to print */
+      vDeadlineGet( i, &uTolerance, &fAlarm, &uLateMax );
+      print_uint16_base10( i + 1 );
+      vLogString( PSTR( ":" ));
+      print_uint16_base10( uTolerance );
+      SendCommaSpace();
+      print_uint16_base10( fAlarm ? 1 : 0 );
+      SendCommaSpace();
+      print_uint16_base10( uLateMax );
+      vSendCR();
+   }
+}
+
+/*--------------------------------------------------
+Commands
+  Checkpoint of the statistics to EEPROM: now, or set the interval
+  in minutes (0: off)
+ --------------------------------------------------*/
+static void f_ck( const sArgs_t *psArgs )
+{
+   if ( psArgs->uCount != 0 )
+   {
+      if ( (psArgs->aulValue[0] != 0) && (psArgs->aulValue[0] < CHECKPOINT_MINUTES_MIN) )
+      {
+         vShowParmError( ARG_RANGE, 1 );
+         return;
+      }
+      vStatsAutoCheckpoint( (uint8_t) psArgs->aulValue[0] );
+   }
+   else if ( ! fStatsCheckpoint() )
+   {
+      vShowEepromBusy();
+      return;
+   }
+   else
+   {
+      fEepromWriting = true;
+   }
+   vLogString( PSTR( "Checkpoint interval (minutes):" ));
+   print_uint16_base10( uStatsAutoCheckpoint() );
+   vSendCR();
+}
+
+/*--------------------------------------------------
+Commands
+  Voltage calibration per channel: gain (1/1000) and offset (pot
+  steps); stored in EEPROM at once. Shows the pot codes of V1 and V2
+ --------------------------------------------------*/
+static void f_ca( const sArgs_t *psArgs )
+{
+   sCalibration_t  sCalibration;
+   uint8_t         i;
+
+   if ( (psArgs->uCount != 0) &&
+        ! fCalibrationSetup( (uint8_t) (psArgs->aulValue[0] - 1), (uint16_t) psArgs->aulValue[1],
+                             (int8_t) (int32_t) psArgs->aulValue[2] ) )
+   {
+      vShowEepromBusy();
+      return;
+   }
+   if ( psArgs->uCount != 0 )
+   {
+      fEepromWriting = true;
+   }
+   vLogInfo( PSTR( "Calibration channel: gain (1/1000), offset, pot codes V1, V2" ));
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      waitPrint();                         /* wait for room to print */
+      vCalibrationGet( i, &sCalibration );
+      print_uint16_base10( i + 1 );
+      vLogString( PSTR( ":" ));
+      print_uint16_base10( sCalibration.uGain );
+      SendCommaSpace();
+      print_int16_base10( sCalibration.iOffset );
+      SendCommaSpace();
+      print_uint16_base10( sSetChannel[i].uPotCodes[0] );
+      SendCommaSpace();
+      print_uint16_base10( sSetChannel[i].uPotCodes[1] );
+      vSendCR();
+   }
+}
+
+/*--------------------------------------------------
+uFindCommand
+    find the command of the first two characters by its hash
+    returns the index in asAccessArr, or iAccArrSize if not found
+--------------------------------------------------*/
+static uint8_t uFindCommand( const char *szCommand )
+{
+    uint8_t     uSlot;
+    const char  *szHelp;
+
+    uSlot = pgm_read_byte( &auCommandSlot[ CMD_HASH( szCommand[0], szCommand[1] ) ] );
+    if ( uSlot == 0 )
+    {
+        return iAccArrSize;             /* empty slot */
+    }
+    uSlot -= 1;
+    szHelp = (const char *) pgm_read_word( &asAccessArr[ uSlot ].szHelpText );
+    if ( (pgm_read_byte( &szHelp[0] ) == (uint8_t) szCommand[0]) &&
+         (pgm_read_byte( &szHelp[1] ) == (uint8_t) szCommand[1]) )
+    {
+        return uSlot;                   /* the help text starts with the command */
+    }
+    return iAccArrSize;
+}
+
+/*--------------------------------------------------
+uParseArgs
+    read the arguments of command uCommand in one pass: decimal values
+    separated by commas (blanks around them are allowed), each checked
+    against its range in the command table (a '-' is only in range when
+    the minimum is negative). A blank not followed by a
+    comma ends the arguments, the rest of the line is comment.
+    Returns ARG_OK or the error; psArgs->uCount is then the number of
+    arguments read before the wrong one
+ --------------------------------------------------*/
+static uint8_t uParseArgs( char *pcText, uint8_t uCommand, sArgs_t *psArgs )
+{
+   const sArgRange_t *psRange;
+   uint8_t    uNeeded;
+   uint8_t    uMax;
+   uint8_t    uResult;
+   uint32_t   ulValue;
+   int32_t    lValue;
+   bool       fNegative;
+
+   psRange = (const sArgRange_t *) pgm_read_word( &asAccessArr[ uCommand ].psArgRange );
+   uNeeded = pgm_read_byte( &asAccessArr[ uCommand ].uArgsNeeded );
+   uMax = pgm_read_byte( &asAccessArr[ uCommand ].uArgsMax );
+   psArgs->uCount = 0;
+   psArgs->pcText = NULL;
+
+   if ( ((*pcText >= '0') && (*pcText <= '9')) || (*pcText == '-') )   /* else none, or only comment */
+   {
+      for (;;)
+      {
+         if ( psArgs->uCount == uMax )
+         {
+            if ( (uNeeded & ARGS_TEXT) == 0 )
+            {
+               return ARG_TOOMANY;
+            }
+            psArgs->pcText = pcText;
+            return ARG_OK;
+         }
+         fNegative = (*pcText == '-');
+         if ( fNegative )
+         {
+            pcText++;
+         }
+         uResult = uReadNumber( &pcText, &ulValue );
+         if ( (*pcText != ',') && (*pcText != ' ') && (*pcText != '\t') && (*pcText != '\0') )
+         {
+            uResult = ARG_SYNTAX;       /* f.i. '12x' */
+         }
+         else if ( (uResult == ARG_OK) &&
+                   (ulValue > (fNegative ? (uint32_t) INT32_MAX + 1 : (uint32_t) INT32_MAX)) )
+         {
+            uResult = ARG_RANGE;        /* not an int32_t: checked before converting */
+         }
+         else if ( uResult == ARG_OK )
+         {
+            lValue = fNegative ? (int32_t) (0u - ulValue) : (int32_t) ulValue;
+            if ( (lValue < (int32_t) pgm_read_dword( &psRange->lMin )) ||
+                 (lValue > (int32_t) pgm_read_dword( &psRange->lMax )) )
+            {
+               uResult = ARG_RANGE;
+            }
+         }
+         if ( uResult != ARG_OK )
+         {
+            return uResult;
+         }
+         psArgs->aulValue[ psArgs->uCount++ ] = (uint32_t) lValue;
+         psRange++;
+         pcText = pcSkipBlanks( pcText );
+         if ( *pcText != ',' )
+         {
+            break;                      /* end of the line, or comment */
+         }
+         pcText = pcSkipBlanks( pcText + 1 );
+      }
+   }
+   if ( (psArgs->uCount < (uNeeded & ARGS_COUNT)) &&
+        ((psArgs->uCount != 0) || ((uNeeded & ARGS_OPTIONAL) == 0)) )
+   {
+      return ARG_MISSING;
+   }
+   return ARG_OK;
+}
+
+/*--------------------------------------------------
+vParseCommand
+    check whats in the command buffer and react on it
+    The buffer is filled
+ --------------------------------------------------*/
+static void vParseCommand( void )
+{
+   char    *pcCurrent;                 /* current character */
+   char    *pszArgv[2];
+   uint8_t iCount;
+   uint8_t uError;
+   sArgs_t sArgs;
+   USER_COMMAND *pFunction;
+
+   pcCurrent = acUserInput;            /* the buffer from the serial line */
+
+   while( (*pcCurrent != '\0') &&  (fIsSpace( *pcCurrent ) == true ) )
+   {
+      pcCurrent++;                    /* remove leading spaces */
+   }
+   if ( *pcCurrent == '@' )            /* board address (standalone: any) */
+   {
+      do
+      {
+         pcCurrent++;
+      } while ( (*pcCurrent >= '0') && (*pcCurrent <= '9') );
+      while( (*pcCurrent != '\0') &&  (fIsSpace( *pcCurrent ) == true ) )
+      {
+         pcCurrent++;
+      }
+   }
+   pszArgv[0] = pcCurrent;             /* mnemonic or empty string   */
+
+   while( (*pcCurrent != '\0') &&  (fIsSpace( *pcCurrent ) == false ) )
+   {
+      pcCurrent++;                    /* skip token */
+   }
+   if ( *pcCurrent != '\0' )
    {
       *pcCurrent++ = '\0';           /* and terminate with '\0'    */
    }
@@ -610,18 +1555,20 @@ static void vParseCommand( void )
       pcCurrent++;                    /* remove leading spaces */
    }
    pszArgv[1] = pcCurrent;             /* argument(s) or empty string */
-   iCount = 0;
    if ( strlen( pszArgv[0] ) > 1 )     /* minimal 2 characters */
    {
-      while ( ( iCount < iAccArrSize ) &&
-              ( (fCompareTwo( pszArgv[0], asAccessArr[ iCount].szHelpText ) == false ) ) )
-      {
-         iCount++;
-      }
+      iCount = uFindCommand( pszArgv[0] );
       if ( iCount < iAccArrSize )
       {
          /* Known command found == [iCount] */
-         asAccessArr[iCount].pFunctionPointer( pszArgv[1] );  /* execute the request */
+         uError = uParseArgs( pszArgv[1], iCount, &sArgs );
+         if ( uError != ARG_OK )
+         {
+            vShowParmError( uError, sArgs.uCount + 1 );
+            return;
+         }
+         pFunction = (USER_COMMAND *) pgm_read_word( &asAccessArr[ iCount ].pFunctionPointer );
+         pFunction( &sArgs );          /* execute the request */
       }
       else
       {                               /* the command is not in the list */
@@ -631,31 +1578,103 @@ static void vParseCommand( void )
    }
 }
 
+/*--------------------------------------------------
+vSaveHistory
+    keep the entered line in the history ring (not twice the same)
+ --------------------------------------------------*/
+static void vSaveHistory( void )
+{
+   uint8_t  uLast;
+
+   if ( uInputLength == 0 )
+   {
+      return;
+   }
+   uLast = (uHistoryHead + HISTORYCOUNT - 1) % HISTORYCOUNT;
+   if ( (uHistoryCount > 0) && (strcmp( acHistory[uLast], acUserInput ) == 0) )
+   {
+      return;
+   }
+   memcpy( acHistory[uHistoryHead], acUserInput, uInputLength + 1 );
+   uHistoryHead = (uHistoryHead + 1) % HISTORYCOUNT;
+   if ( uHistoryCount < HISTORYCOUNT )
+   {
+      uHistoryCount++;
+   }
+}
+
+/*--------------------------------------------------
+vRecallHistory
+    replace the input line by the line uBack commands ago (0: empty line)
+    and redraw the line on the terminal
+ --------------------------------------------------*/
+static void vRecallHistory( uint8_t uBack )
+{
+   uint8_t  uSlot;
+
+   if ( uBack == 0 )
+   {
+      acUserInput[0] = '\0';
+      uInputLength = 0;
+   }
+   else
+   {
+      uSlot = (uHistoryHead + HISTORYCOUNT - uBack) % HISTORYCOUNT;
+      uInputLength = (uint8_t) strlen( acHistory[uSlot] );
+      memcpy( acUserInput, acHistory[uSlot], uInputLength + 1 );
+   }
+   uHistoryRecall = uBack;
+   vSerialPutChar( CR );                /* redraw: prompt, line and erase the rest */
+   vLogString( PSTR( "TERM>" ));
+   NA_WriteBuffer( (unsigned char *) acUserInput, uInputLength );
+   vSerialPutChar( ESC );
+   vSerialPutChar( '[' );
+   vSerialPutChar( 'K' );
+}
+
 /*----------------------------------------------------------------------
 Check the serial input on incoming data, if full request, return TRUE, else FALSE
+  All received characters are handled at once; the line length is kept
+  so every character costs the same.
 ----------------------------------------------------------------------*/
 static bool iCheckInputData( void )
 {
    uint8_t    iCharacter;
-   bool       iRc = false;                    /* no msg available */
-   uint8_t    iCurrentPos;
 
-   if ( uSerialGetChar( &iCharacter ) == RESULT_SUCCESS )  /* is there a character? */
+   while ( uSerialGetChar( &iCharacter ) == RESULT_SUCCESS )  /* is there a character? */
    {
+      if ( uEscState != 0 )             /* cursor keys: ESC [ A (up) and ESC [ B (down) */
+      {
+         if ( (uEscState == 1) && (iCharacter == '[') )
+         {
+            uEscState = 2;
+            continue;
+         }
+         uEscState = 0;
+         if ( iCharacter == 'A' )
+         {
+            iCharacter = CTRL_P;
+         }
+         else if ( iCharacter == 'B' )
+         {
+            iCharacter = CTRL_N;
+         }
+         else
+         {
+            continue;                   /* other sequences are ignored */
+         }
+      }
       switch ( iCharacter )
       {
          case BS :
-            iCurrentPos = 0;
-            while ( (iCurrentPos < MAXINPUTLENGTH) && (acUserInput[iCurrentPos] != '\0') )
-            {
-               iCurrentPos++;
-            }
-            if ( iCurrentPos > 0 )
+         case DEL :
+            if ( uInputLength > 0 )
             {
-               vSerialPutChar( iCharacter );  /* echo BS */
-               vSerialPutChar( 0x20 );        /* echo space */
-               vSerialPutChar( iCharacter );  /* echo BS */
-               acUserInput[ iCurrentPos - 1 ] = '\0';
+               vSerialPutChar( BS );    /* echo BS */
+               vSerialPutChar( 0x20 );  /* echo space */
+               vSerialPutChar( BS );    /* echo BS */
+               uInputLength--;
+               acUserInput[ uInputLength ] = '\0';
             }
             else
             {
@@ -664,29 +1683,103 @@ static bool iCheckInputData( void )
             break;
 
          case CR :
-            vSendCR();                  /* and ready */
-            iRc = true;
+            if ( fHostMode == 0 )
+            {
+               vSendCR();               /* and ready */
+            }
+            vSaveHistory();
+            return true;
+
+         case LF :                      /* part of CR-LF line ends: ignore */
             break;
 
-         default:
-            iCurrentPos = 0;
-            while ( (iCurrentPos < MAXINPUTLENGTH) && (acUserInput[iCurrentPos] != '\0') )
+         case ESC :
+            uEscState = 1;
+            break;
+
+         case CTRL_P :
+            if ( uHistoryRecall < uHistoryCount )
             {
-               iCurrentPos++;
+               vRecallHistory( uHistoryRecall + 1 );
             }
-            if ( iCurrentPos == MAXINPUTLENGTH )
+            else
+            {
+               vSerialPutChar( BELL );
+            }
+            break;
+
+         case CTRL_N :
+            if ( uHistoryRecall > 0 )
+            {
+               vRecallHistory( uHistoryRecall - 1 );
+            }
+            else
+            {
+               vSerialPutChar( BELL );
+            }
+            break;
+
+         case CTRL_R :
+            if ( uHistoryCount > 0 )
+            {
+               vRecallHistory( 1 );
+               vSendCR();
+               return true;             /* execute last command again */
+            }
+            vSerialPutChar( BELL );
+            break;
+
+         default:
+            if ( uInputLength >= (MAXINPUTLENGTH - 1) )
             {
                vSerialPutChar( BELL );  /* beep */
             }
             else
             {
-               vSerialPutChar( iCharacter );  /* echo it */
-               acUserInput[iCurrentPos] = (char) toupper( iCharacter );
+               if ( fHostMode == 0 )
+               {
+                  vSerialPutChar( iCharacter );  /* echo it */
+               }
+               acUserInput[ uInputLength ] = (char) toupper( iCharacter );
+               uInputLength++;
+               acUserInput[ uInputLength ] = '\0';
             }
             break;
-         }
+      }
    }
-   return iRc;
+   return false;
+}
+
+/*--------------------------------------------------
+vSetAddress
+    standalone (0) or a board in a chain: output lines get the
+    prefix '#<address> ', no echo, no flow control. A running
+    acquisition stops: its blocks can not go through a chain, and
+    standalone the flow control may come back
+ --------------------------------------------------*/
+static void vSetAddress( uint8_t uAddress )
+{
+   uint8_t  i = 0;
+
+   vAcquisitionStop();
+   uBoardAddress = uAddress;
+   vChainInit( uAddress );
+   if ( uAddress == 0 )
+   {
+      vSerialSetLinePrefix( 0 );
+      vSerialSetFlowControl( 1 );
+      return;
+   }
+   acLinePrefix[i++] = '#';
+   if ( uAddress >= 10 )
+   {
+      acLinePrefix[i++] = (char) ('0' + (uAddress / 10));
+   }
+   acLinePrefix[i++] = (char) ('0' + (uAddress % 10));
+   acLinePrefix[i++] = ' ';
+   acLinePrefix[i] = '\0';
+   vSerialSetLinePrefix( acLinePrefix );
+   vSerialSetFlowControl( 0 );          /* XOFF would go to the next board, not the sender */
 }
 
 
@@ -707,12 +1800,68 @@ void vTerminalInit( void )
  --------------------------------------------------*/
 void vDoTerminal( void )
 {
-   if ( iCheckInputData() )            /* read a command-line */
+   bool  fLine;
+
+   if ( fSettingsBusy() )              /* also an automatic checkpoint */
+   {
+      fEepromWriting = true;
+   }
+   else if ( fEepromWriting )          /* background eeprom write finished */
+   {
+      fEepromWriting = false;
+      vLogInfo( PSTR( "EEPROM written" ));
+   }
+   if ( uBoardAddress != 0 )
+   {
+      fLine = fChainInput( acUserInput, sizeof(acUserInput) );  /* a command for this board */
+      if ( fLine )
+      {
+         uInputLength = (uint8_t) strlen( acUserInput );
+      }
+   }
+   else
+   {
+      fLine = iCheckInputData();       /* read a command-line */
+   }
+   vCheckBaudConfirm( fLine );
+   if ( fLine )
    {
       vParseCommand();                /* do the command */
       vShowPrompt();                  /* show prompt */
    }
 }
 
+/*--------------------------------------------------
+ Board address from EEPROM; before any output
+ --------------------------------------------------*/
+void vTerminalAddressInit( void )
+{
+   vSetAddress( uSettingsAddress() );
+}
+
+/*--------------------------------------------------
+ Board is part of a chain (no echo, no pulse characters)
+ --------------------------------------------------*/
+bool fTerminalChained( void )
+{
+   return ( uBoardAddress != 0 );
+}
+
+/*--------------------------------------------------
+ Host mode (set with 'HM')
+ --------------------------------------------------*/
+bool fTerminalHostMode( void )
+{
+   return ( fHostMode != 0 );
+}
+
+/*--------------------------------------------------
+ Nothing received to handle
+ --------------------------------------------------*/
+bool fTerminalIdle( void )
+{
+   return ( uSerialRxCount() == 0 );
+}
+
 
 /* EOF */
@@ -16,6 +16,7 @@
 #define TERMINAL_H_
 
 /***------------------------- Includes ----------------------------------***/
+#include <stdbool.h>
 
 /***------------------------- Defines ------------------------------------***/
 
@@ -34,5 +35,26 @@ extern void vTerminalInit(void);
  --------------------------------------------------*/
 extern void vDoTerminal( void );
 
+/*--------------------------------------------------
+ Board address (daisy chain) from EEPROM; call before any output
+ --------------------------------------------------*/
+extern void vTerminalAddressInit( void );
+
+/*--------------------------------------------------
+ Board is part of a chain (no echo, no pulse characters)
+ --------------------------------------------------*/
+extern bool fTerminalChained( void );
+
+/*--------------------------------------------------
+ Host mode (a program as user): no echo, no pulse characters and
+ the prompt line ends every response
+ --------------------------------------------------*/
+extern bool fTerminalHostMode( void );
+
+/*--------------------------------------------------
+ Nothing received to handle (it may sleep until the next interrupt)
+ --------------------------------------------------*/
+extern bool fTerminalIdle( void );
+
 #endif /* TERMINAL_H_ */
 
@@ -16,8 +16,12 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 
 #include "timer.h"
+#include "board.h"
 
 /***------------------------- Defines ------------------------------------***/
 
@@ -27,7 +31,11 @@
 #define TWO_MS      30
 #define ONE_MS      250          /* with smaller prescaler! (div 64) */
 
-#define T1TIME_100US    25       /* for 16MHz clock */
+#define T2TIME_100US    25       /* for 16MHz clock */
+#define T2_POLL_MAX     1000     /* polls for one 100us step (> 1ms); a stopped timer ends the delay */
+
+#define MAXSLEEP_MS     200      /* tickless: longest time without timer interrupt (< 262ms) */
+#define SHORTAWAKE_MS   200      /* shorter awake times are measured with timer1 counts */
 
 /***------------------------- Types -------------------------------------***/
 
@@ -36,37 +44,284 @@
 /***------------------------- Local Data --------------------------------***/
 
 uint16_t    uSystemTimerCounter;
+static volatile uint16_t uMarkerCount;  /* marker output on for this many 100us */
+
+#if TIMER_TICKLESS
+static uint16_t    uLastMsCount;        /* timer1 count at the last whole ms */
+#endif
+
+/* Idle sleep, all times in timer1 counts (4us) */
+static uint8_t     fSleepEnabled;
+static uint16_t    uSleepCount;         /* times slept */
+static uint32_t    ulSleepTime;         /* time asleep */
+static uint32_t    ulAwakeTime;         /* time awake in between */
+static uint16_t    uWakeLatencyMax;     /* from timer interrupt to running again */
+static volatile uint16_t uTimerStamp;   /* timer1 count at the last timer interrupt */
+static uint16_t    uWakeMs;             /* last wake up moment */
+static uint16_t    uWakeCount;
 
 /***------------------------ Global Data --------------------------------***/
 
+/***------------------------ Local functions ----------------------------***/
+#if TIMER_TICKLESS
+/*--------------------------------------------------
+ Tickless: add the whole ms passed on timer1 since the last
+ update to the system timer (interrupts are disabled).
+ Must be called at least every 262ms.
+ --------------------------------------------------*/
+static void vUpdateSystemTimer( void )
+{
+   uint16_t    uMs;
+
+   uMs = (uint16_t) (TCNT1 - uLastMsCount) / ONE_MS;
+   uSystemTimerCounter += uMs;
+   uLastMsCount += uMs * ONE_MS;
+}
+#endif
+
+/*--------------------------------------------------
+ Start new sleep statistics (interrupts are disabled)
+ --------------------------------------------------*/
+static void vResetSleepStats( void )
+{
+   uSleepCount = 0;
+   ulSleepTime = 0;
+   ulAwakeTime = 0;
+   uWakeLatencyMax = 0;
+   uWakeMs = uSystemTimerCounter;
+   uWakeCount = TCNT1;
+}
+
+/*--------------------------------------------------
+ Timer1 counts between two moments; longer times only in ms
+ --------------------------------------------------*/
+uint32_t ulTimerCountsBetween( uint16_t uMs0, uint16_t uCount0, uint16_t uMs1, uint16_t uCount1 )
+{
+   if ( (uint16_t) (uMs1 - uMs0) < SHORTAWAKE_MS )
+   {
+      return (uint16_t) (uCount1 - uCount0);
+   }
+   return (uint32_t) (uint16_t) (uMs1 - uMs0) * ONE_MS;
+}
+
 /***------------------------ Global functions ---------------------------***/
 /*--------------------------------------------------
  Initialize hardware (interrupts are disabled)
  --------------------------------------------------*/
 void vInitTimer( void )
 {
+   uSystemTimerCounter = 0;
+
+   /* timer1 runs free at crystal/64 (4us on 16MHz): the fine time base */
+   TCCR1A = 0;
+   TCCR1B = 3;
+   TCNT1 = 0;
+#if TIMER_TICKLESS
+   /* timer1 compare A gives the ms time (no tick), at the latest every MAXSLEEP_MS */
+   TCCR0B = 0;                          /* timer0 not used */
+   TIMSK0 &= ~(1 << TOIE0);
+   uLastMsCount = 0;
+   OCR1A = MAXSLEEP_MS * ONE_MS;
+   TIFR1 = (1 << OCF1A);                /* clear OCF1A by writing a 1 */
+   TIMSK1 |= (1 << OCIE1A);
+#else
    TCCR0A = 0;                          /* compare COM0A and COM0B disconnected; WGM normal mode */
    TCCR0B  = 3; //0x04;                 /* Prescaler div 64; normal mode */
    TCNT0  = 256 - ONE_MS;               /* count starting at -58: every 5ms timer-overflow 117: 10ms*/
    TIMSK0 |= (1 << TOIE0);              /* At overflow enable interrupt */
    TIFR0 |=  (1 << TOV0);               /* clear TOV0 */
+#endif
 
-   uSystemTimerCounter = 0;
+   /* timer2 runs free for the 100us delays (compare B, polled) and the
+      marker width (compare A interrupt); the counter is never written */
+   TCCR2A = 0;                          /* normal mode */
+   TCCR2B = (1 << CS22);                /* clock is crystal/64 --> 4us on 16Mhz system */
+   TIMSK2 = 0;
+   TIFR2 = (1 << OCF2A) | (1 << OCF2B) | (1 << TOV2);  /* clear by writing a 1 */
 
-   /* timer1 is used as a 100us delay timer */
-   /* setup: normal mode WGM13:0 = 0, TCNT1 determines time until TOV1 will be 1 (overflow) */
-   TCCR1A = 0;
-   TCCR1B = 3; /* clock is crystal/64 --> 1us on 8MHz system, 0.5us on 16Mhz system */
-   TCNT1 = 65536 - T1TIME_100US;
-   TIFR1 |= (1 << TOV1);   /* clear TOV1 by writing a 1 */
+   fSleepEnabled = 1;
+   vResetSleepStats();
+}
+
+/*--------------------------------------------------
+ Idle sleep until the next interrupt. Called with interrupts
+ disabled, after checking there is no work; 'sei' executes the
+ next instruction (sleep) before any pending interrupt, so no wake
+ up is missed. Returns with interrupts enabled.
+ Tickless: the timer interrupt is programmed uDueMs ahead (from the
+ last whole ms), else the 1ms tick wakes.
+ --------------------------------------------------*/
+void vTimerSleep( uint16_t uDueMs )
+{
+   uint16_t    uMs;
+   uint16_t    uCount, uCountWake;
+
+   if ( fSleepEnabled == 0 )
+   {
+      sei();
+      return;
+   }
+#if TIMER_TICKLESS
+   vUpdateSystemTimer();
+   if ( uDueMs > MAXSLEEP_MS )
+   {
+      uDueMs = MAXSLEEP_MS;
+   }
+   OCR1A = uLastMsCount + (uDueMs * ONE_MS);
+   TIFR1 = (1 << OCF1A);
+   if ( (uint16_t) (TCNT1 - uLastMsCount) >= (uDueMs * ONE_MS) )
+   {
+      OCR1A = uLastMsCount + (MAXSLEEP_MS * ONE_MS);  /* already passed: keep the time updated */
+      sei();
+      return;
+   }
+#else
+   (void) uDueMs;
+#endif
+   uMs = uSystemTimerCounter;
+   uCount = TCNT1;
+   ulAwakeTime += ulTimerCountsBetween( uWakeMs, uWakeCount, uMs, uCount );
+   uTimerStamp = uCount;
+   set_sleep_mode( SLEEP_MODE_IDLE );   /* timers, UART and EEPROM keep running */
+   sleep_enable();
+   sei();
+   sleep_cpu();
+   sleep_disable();
+   cli();
+#if TIMER_TICKLESS
+   vUpdateSystemTimer();
+#endif
+   uCountWake = TCNT1;
+   if ( (uTimerStamp != uCount) && ((uint16_t) (uCountWake - uTimerStamp) > uWakeLatencyMax) )
+   {
+      uWakeLatencyMax = uCountWake - uTimerStamp;   /* woken by the timer */
+   }
+   ulSleepTime += (uint16_t) (uCountWake - uCount);  /* at most MAXSLEEP_MS or a tick */
+   uWakeMs = uSystemTimerCounter;
+   uWakeCount = uCountWake;
+   uSleepCount += (uSleepCount != UINT16_MAX);
+   if ( (ulSleepTime | ulAwakeTime) > (UINT32_MAX / 128) )
+   {
+      ulSleepTime >>= 1;                /* keep the ratio, not the amount (room for * 100) */
+      ulAwakeTime >>= 1;
+   }
+   sei();
+}
 
+/*--------------------------------------------------
+ Idle sleep on/off
+ --------------------------------------------------*/
+void vTimerSleepEnable( uint8_t fOn )
+{
+   fSleepEnabled = fOn;
+}
+
+uint8_t fTimerSleepEnabled( void )
+{
+   return fSleepEnabled;
+}
+
+/*--------------------------------------------------
+ Sleep statistics since the last call: number of sleeps, time
+ asleep in % and the maximum wake up latency in us. Null pointers
+ are allowed (reset only).
+ --------------------------------------------------*/
+void vTimerSleepStats( uint16_t *puCount, uint8_t *puIdle, uint16_t *puLatency )
+{
+   uint32_t    ulTotal;
+
+   cli();
+   ulTotal = ulSleepTime + ulAwakeTime;
+   if ( puCount != 0 )
+   {
+      *puCount = uSleepCount;
+   }
+   if ( puIdle != 0 )
+   {
+      *puIdle = (ulTotal == 0) ? 0 : (uint8_t) ((ulSleepTime * 100) / ulTotal);
+   }
+   if ( puLatency != 0 )
+   {
+      *puLatency = uWakeLatencyMax * 4;  /* 4us per count */
+   }
+   vResetSleepStats();
+   sei();
+}
+
+/*--------------------------------------------------
+ Put a ms boundary at this moment (a sync edge), moving the ms
+ grid to the nearest side; interrupts are disabled.
+ Returns the correction in timer1 counts (4us): negative when the
+ grid is moved later, positive when the next ms starts now.
+ --------------------------------------------------*/
+int16_t iTimerSyncAlign( void )
+{
+   uint16_t    uOffset;                 /* counts since the last ms boundary */
+
+#if TIMER_TICKLESS
+   uint16_t    uNow = TCNT1;
+
+   vUpdateSystemTimer();
+   uOffset = uNow - uLastMsCount;
+   uLastMsCount = uNow;
+   OCR1A = uNow + (MAXSLEEP_MS * ONE_MS);  /* keep the time updated */
+#else
+   if ( (TIFR0 & (1 << TOV0)) != 0 )    /* tick pending: count it here */
+   {
+      uSystemTimerCounter += 1;
+      uOffset = TCNT0;
+   }
+   else
+   {
+      uOffset = (uint8_t) (TCNT0 - (256 - ONE_MS));
+   }
+   TCNT0 = 256 - ONE_MS;
+   TIFR0 = (1 << TOV0);
+#endif
+   if ( uOffset >= (ONE_MS / 2) )
+   {
+      uSystemTimerCounter += 1;         /* closer to the next ms */
+      return (int16_t) (ONE_MS - uOffset);
+   }
+   return -(int16_t) uOffset;
+}
+
+/*--------------------------------------------------
+ The fine time base: timer1 count (4us)
+ --------------------------------------------------*/
+uint16_t uTimerFine( void )
+{
+   uint16_t    uCount;
+
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+   {
+      uCount = TCNT1;
+   }
+   return uCount;
 }
 
 
 /***------------------------ Interrupt functions ------------------------***/
+#if TIMER_TICKLESS
+/*--------------------------------------------------
+ System clock, tickless
+ Runs at the programmed due time, at the latest MAXSLEEP_MS
+ after the previous one
+ --------------------------------------------------*/
+#ifdef _lint
+void TIMER1_COMPA_vect( void )
+#else
+ISR(TIMER1_COMPA_vect)
+#endif
+{
+   uTimerStamp = OCR1A;                 /* the moment of the event */
+   vUpdateSystemTimer();
+   OCR1A = uLastMsCount + (MAXSLEEP_MS * ONE_MS);  /* keep the time updated */
+}
+#else
 /*--------------------------------------------------
  System clock
- Runs at 5/10/16 ms per tick (32 ticks per second)
+ Runs at 1 ms per tick
  --------------------------------------------------*/
 #ifdef _lint
 void TIMER0_OVF_vect( void )
@@ -74,32 +329,105 @@ void TIMER0_OVF_vect( void )
 ISR(TIMER0_OVF_vect)
 #endif
 {
-   TCNT0  = 256 - ONE_MS;   /* count starting at -58: every 5ms timer-overflow */
+   TCNT0  = 256 - ONE_MS;   /* count starting at -250: every 1ms timer-overflow */
    uSystemTimerCounter += 1;
+   uTimerStamp = TCNT1;
+}
+#endif
+
+/*--------------------------------------------------
+ Marker width: every 100us from its start, independent of the pulse
+ --------------------------------------------------*/
+#ifdef _lint
+void TIMER2_COMPA_vect( void )
+#else
+ISR(TIMER2_COMPA_vect)
+#endif
+{
+   OCR2A += T2TIME_100US;               /* next step, no drift */
+   if ( --uMarkerCount == 0 )
+   {
+      MARKER_OFF();
+      TIMSK2 &= ~(1 << OCIE2A);
+   }
+}
+
+/*--------------------------------------------------
+ Marker output on for uWidth * 100us (0: stays on until vMarkerStop).
+ The width counts from this call, on timer2, so it may outlast the pulse
+ --------------------------------------------------*/
+void vMarkerStart( uint16_t uWidth )
+{
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+   {
+      MARKER_ON();
+      uMarkerCount = uWidth;
+      if ( uWidth != 0 )
+      {
+         OCR2A = TCNT2 + T2TIME_100US;
+         TIFR2 = (1 << OCF2A);          /* clear OCF2A by writing a 1 */
+         TIMSK2 |= (1 << OCIE2A);
+      }
+      else
+      {
+         TIMSK2 &= ~(1 << OCIE2A);
+      }
+   }
+}
+
+/*--------------------------------------------------
+ Marker output off, a running width is ended
+ --------------------------------------------------*/
+void vMarkerStop( void )
+{
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+   {
+      TIMSK2 &= ~(1 << OCIE2A);
+      uMarkerCount = 0;
+      MARKER_OFF();
+   }
 }
 
 /*--------------------------------------------------
  Deliver a mutexed copy of the system timer
+ (the interrupt state is kept: also usable with interrupts disabled)
  --------------------------------------------------*/
 void vGetSystemTimer( uint16_t *puTimer )
 {
-   cli();
-   *puTimer = uSystemTimerCounter;
-   sei();
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+   {
+#if TIMER_TICKLESS
+      vUpdateSystemTimer();
+#endif
+      *puTimer = uSystemTimerCounter;
+   }
 }
 
 /*--------------------------------------------------
 Delay function for 100 us:  waits count times 100us
+ The watchdog is only kicked for a finished step of the timer; when
+ the timer does not run the delay ends (the pulse is shortened)
  --------------------------------------------------*/
 #pragma GCC push_options
 #pragma GCC optimize ("O0")             /* no optimization! */
 void delay_100us( uint16_t count )
 {
+   uint16_t uPoll;
+
+   OCR2B = TCNT2;
    while (count > 0)
    {
-      TCNT1 = 65536 - T1TIME_100US;
-      TIFR1 |= (1 << TOV1);                /* clear TOV1 by writing 1 */
-      loop_until_bit_is_set(TIFR1, TOV1);  /* wait until the flag is set */
+      OCR2B += T2TIME_100US;               /* steps follow each other without drift */
+      TIFR2 = (1 << OCF2B);                /* clear OCF2B by writing 1 */
+      uPoll = 0;
+      while ( bit_is_clear(TIFR2, OCF2B) ) /* wait until the flag is set */
+      {
+         if ( ++uPoll >= T2_POLL_MAX )
+         {
+            return;
+         }
+      }
+      WATCHDOG_KICK();                     /* long pulses are no hang */
       count--;                             /* next */
    }
 }
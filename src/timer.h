@@ -21,12 +21,19 @@
 /***------------------------- Includes ----------------------------------***/
 #include <stdint.h>
 
+/***------------------------- Defines ------------------------------------***/
+/* 1: no 1ms tick; timer1 is programmed for the next due event
+   0: timer0 gives a 1ms tick interrupt */
+#ifndef TIMER_TICKLESS
+#define TIMER_TICKLESS     1
+#endif
+
 /***------------------------- Types -------------------------------------***/
 
 
 /***------------------------ Global Data --------------------------------***/
 
-/*  The value increments every 2/5/10ms */
+/*  The value increments every ms (tickless: up to date after vGetSystemTimer) */
 extern uint16_t     uSystemTimerCounter;              /* counting */
 
 /***------------------------ Global functions ---------------------------***/
@@ -41,6 +48,48 @@ extern void vInitTimer( void );
  --------------------------------------------------*/
 extern void vGetSystemTimer( uint16_t *puTimer );
 
+/*--------------------------------------------------
+ Delay (busy waiting on timer2) of count * 100us
+ --------------------------------------------------*/
 extern void delay_100us( uint16_t count);
 
+/*--------------------------------------------------
+ Marker output on for uWidth * 100us on timer2 (0: until vMarkerStop),
+ and off
+ --------------------------------------------------*/
+extern void vMarkerStart( uint16_t uWidth );
+extern void vMarkerStop( void );
+
+/*--------------------------------------------------
+ The fine time base: free running timer1 count (4us)
+ --------------------------------------------------*/
+extern uint16_t uTimerFine( void );
+
+/*--------------------------------------------------
+ Timer1 counts (4us) between two moments, given as ms and timer1
+ count; from 200 ms on (timer1 wraps at 262 ms) in whole ms
+ --------------------------------------------------*/
+extern uint32_t ulTimerCountsBetween( uint16_t uMs0, uint16_t uCount0, uint16_t uMs1, uint16_t uCount1 );
+
+/*--------------------------------------------------
+ Start a ms at this moment (sync edge); interrupts disabled.
+ Returns the correction of the time grid in 4us counts
+ --------------------------------------------------*/
+extern int16_t iTimerSyncAlign( void );
+
+/*--------------------------------------------------
+ Idle sleep until the next interrupt; call with interrupts
+ disabled when no task has work for the next uDueMs (> 0) ms.
+ Returns with interrupts enabled.
+ --------------------------------------------------*/
+extern void vTimerSleep( uint16_t uDueMs );
+
+/*--------------------------------------------------
+ Idle sleep on/off, and the statistics since the last call:
+ sleeps, % of the time asleep, max. wake up latency (us)
+ --------------------------------------------------*/
+extern void vTimerSleepEnable( uint8_t fOn );
+extern uint8_t fTimerSleepEnabled( void );
+extern void vTimerSleepStats( uint16_t *puCount, uint8_t *puIdle, uint16_t *puLatency );
+
 #endif /* TIMER_H_ */
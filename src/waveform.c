@@ -13,6 +13,8 @@
 ------------------------------------------------------------------------------
 */
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
 #ifdef _lint
  #ifdef ____ATTR_PURE__
    #undef __ATTR_PURE__
@@ -24,12 +26,19 @@
  #define __attribute__(var)
 #endif
 #include <avr/pgmspace.h>
-#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "waveform.h"
+#include "settings.h"
 #include "timer.h"
 #include "log.h"
 #include "board.h"
 #include "serial.h"
+#include "terminal.h"
+#include "sync.h"
+#include "adc.h"
+#include "monitor.h"
 
 /***------------------------- Defines -----------------------------------***/
 
@@ -43,15 +52,128 @@ static uint16_t   currentTime[CHANNELCOUNT];   /* current time reference */
 static uint16_t   currentPeriod[CHANNELCOUNT];   /* current period (T4) reference */
 static uint16_t   currentCountPeriod[CHANNELCOUNT];   /* current pulses in this frequency period */
 static uint8_t    uChangedPeriods[CHANNELCOUNT];  /* total changes */
+static uint8_t    fBootReport;                    /* report the first pulse after power up */
+static int32_t    lChargeNet[CHANNELCOUNT];       /* accumulated net charge (0.01 V.ms) */
+
+/* Trigger input. The interrupt gives the first pulse of the channels with
+   T0 = 0 itself, when the main loop is not in vDoWaveform (armed); else,
+   and for the other channels, it latches and the main loop handles them */
+static uint8_t    uTriggerEdge;                   /* TRIGGER_OFF, _RISING or _FALLING */
+static uint16_t   uTriggerMask;                   /* channels (bit 0: channel 1) started by it */
+static uint8_t    uTriggerDebounce;               /* ms after a trigger to ignore edges */
+static uint16_t   uTriggerLast;                   /* ms of the last accepted trigger */
+static volatile uint16_t uTriggerPending;         /* triggered channels, not handled yet */
+static volatile uint16_t uTriggerTime;            /* ms of the trigger */
+static volatile uint16_t uTriggerStamp;           /* timer1 count in the trigger interrupt */
+static volatile uint16_t uTriggerStampMs;         /*   and its ms */
+static volatile uint16_t uTriggerCount;           /* triggers accepted */
+static volatile bool     fTriggerArmed;           /* the interrupt may give pulses */
+static volatile uint16_t uTriggerFire;            /* channels to pulse by the interrupt */
+static volatile uint16_t uTriggerFired;           /* pulsed by the interrupt, to report */
+static uint16_t   uFireStamp;                     /* timer1 count and ms of that interrupt */
+static uint16_t   uFireMs;
+static uint32_t   ulTriggerLatency[CHANNELCOUNT];     /* interrupt to edge (4us counts) */
+static uint32_t   ulTriggerLatencyMax[CHANNELCOUNT];  /*   and its maximum */
+
+/* Marker output (one pin, set per channel) */
+static uint8_t    uMarkerMode[CHANNELCOUNT];      /* MARKER_NONE .. MARKER_BURST */
+static uint16_t   uMarkerWidth[CHANNELCOUNT];     /* pulse marker width (100us) */
+static uint16_t   uMarkerBurst;                   /* channels with the burst marker on */
+
+/* Runtime statistics */
+static sChannelStats_t asStats[CHANNELCOUNT];
+static uint16_t   uEdgeMs[CHANNELCOUNT];          /* ms of the last pulse */
+static uint16_t   uEdgeFine[CHANNELCOUNT];        /* timer1 count of the last pulse */
+static uint8_t    uCheckpointMinutes;             /* 0: no automatic checkpoint */
+static uint8_t    uCheckpointCount;               /* minutes since the last one */
+static uint16_t   uCheckpointMs;                  /* start of the running minute */
+
+/* Deadlines: a pulse later than the tolerance after its scheduled time is a miss */
+static uint16_t   uDueMs[CHANNELCOUNT];           /* scheduled time of the next pulse */
+static uint8_t    uLateTolerance[CHANNELCOUNT];   /* ms */
+static uint16_t   uLateMax[CHANNELCOUNT];         /* ms, since the last read */
+static uint16_t   uLateAlarm;                     /* channels reporting every miss */
+
+/* Voltage calibration, kept in EEPROM */
+static sCalibration_t asCalibration[CHANNELCOUNT];
+
+/* The channel masks (trigger, marker burst, alarm) have a bit per channel */
+_Static_assert( CHANNELCOUNT <= 8 * sizeof(uTriggerMask), "a channel mask is too small for CHANNELCOUNT" );
 /***------------------------ Global Data --------------------------------***/
+uint8_t    uChargeImbalanceLimit;                 /* 0: no check */
+uint32_t   ulChargeLimit;                         /* 0: no check */
 
 //! Keep these in sequence and together, as they are stored in eeprom
 sSetting_t   sSetChannel[CHANNELCOUNT];
 
-uint8_t EEMEM  NonVolatileSettings[SETTING_SIZE];  /* eeprom copy */
-
 /***------------------------ Local functions ----------------------------***/
 
+/*--------------------------------------------------
+ End of a train: burst marker of this channel off
+ --------------------------------------------------*/
+static void vMarkerBurstEnd( uint8_t channel )
+{
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )  /* also set by the trigger interrupt */
+   {
+      if ( (uMarkerBurst & (1u << channel)) != 0 )
+      {
+         uMarkerBurst &= ~(1u << channel);
+         if ( uMarkerBurst == 0 )
+         {
+            MARKER_OFF();
+         }
+      }
+   }
+}
+
+/*--------------------------------------------------
+ Marker just before the positive edge (also from the trigger interrupt)
+ --------------------------------------------------*/
+static void vMarkerEdge( uint8_t channel )
+{
+   switch ( uMarkerMode[channel] )
+   {
+      case MARKER_PULSE :
+         vMarkerStart( uMarkerWidth[channel] );
+         break;
+      case MARKER_PERIOD :
+         MARKER_TOGGLE();
+         break;
+      case MARKER_BURST :
+         if ( currentCount[channel] == 0 )
+         {
+            ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+            {
+               uMarkerBurst |= (1u << channel);
+            }
+            MARKER_ON();
+         }
+         break;
+      default:
+         break;
+   }
+}
+
+/*--------------------------------------------------
+ 4us counts to us, saturating
+ --------------------------------------------------*/
+static uint32_t ulCountsToUs( uint32_t ulCounts )
+{
+   return ( ulCounts > (UINT32_MAX / 4) ) ? UINT32_MAX : (ulCounts * 4);
+}
+
+/*--------------------------------------------------
+ Set the FSM of a channel to the start point
+ --------------------------------------------------*/
+static void vResetChannel( uint8_t channel )
+{
+   vMarkerBurstEnd( channel );
+   currentState[channel] = 0;
+   currentCount[channel] = 0;
+   currentCountPeriod[channel] = 0;
+   uChangedPeriods[channel] = 0;
+}
+
 static void vUpdateCurrentTime(uint8_t channel)
 {
    if ( (sSetChannel[channel].pulseCount != 0) &&
@@ -60,7 +182,15 @@ static void vUpdateCurrentTime(uint8_t channel)
       vLogString(PSTR("FINISH"));
       print_uint16_base10( channel + 1 );
       vSendCR();
-      sSetChannel[channel].uStartFlag = 0;
+      vMarkerBurstEnd( channel );
+      if ( (uTriggerEdge != TRIGGER_OFF) && ((uTriggerMask & (1u << channel)) != 0) )
+      {
+         sSetChannel[channel].uStartFlag = START_TRIGGER;  /* wait for the next trigger */
+      }
+      else
+      {
+         sSetChannel[channel].uStartFlag = 0;
+      }
       return ;
    }
    if ( sSetChannel[channel].uDelta[0] == 0 )
@@ -93,7 +223,705 @@ static void vUpdateCurrentTime(uint8_t channel)
    }
 }
 
+/*--------------------------------------------------
+ Check a channel setting against the bounds of the terminal commands
+ --------------------------------------------------*/
+static bool fSettingValid( const sSetting_t *psSetting )
+{
+   return ( (psSetting->uStartFlag <= START_TRIGGER) &&
+            (psSetting->uVoltages[0] <= 50) &&
+            (psSetting->uVoltages[1] <= 50) &&
+            (psSetting->uDelta[2] <= 10) );
+}
+
+/*--------------------------------------------------
+ Add the charge of a pulse, saturating at the int32 limits
+ --------------------------------------------------*/
+static void vAddCharge( uint8_t channel, int32_t lCharge )
+{
+   if ( (lCharge > 0) && (lChargeNet[channel] > (INT32_MAX - lCharge)) )
+   {
+      lChargeNet[channel] = INT32_MAX;
+   }
+   else if ( (lCharge < 0) && (lChargeNet[channel] < (INT32_MIN - lCharge)) )
+   {
+      lChargeNet[channel] = INT32_MIN;
+   }
+   else
+   {
+      lChargeNet[channel] += lCharge;
+   }
+}
+
+/*--------------------------------------------------
+ Charge of both phases of a pulse: V1 * T1 + V2 * T3
+ --------------------------------------------------*/
+static uint32_t ulPulseChargeSum( uint8_t channel )
+{
+   return ((uint32_t) sSetChannel[channel].uVoltages[0] * sSetChannel[channel].uTimes[1]) +
+          ((uint32_t) sSetChannel[channel].uVoltages[1] * sSetChannel[channel].uTimes[3]);
+}
+
+/*--------------------------------------------------
+ Report a channel stopped or refused by the charge limits
+ --------------------------------------------------*/
+static void vReportUnbalanced( uint8_t channel )
+{
+   vLogString( PSTR( "UNBALANCED" ));
+   print_uint16_base10( channel + 1 );
+   vSendCR();
+}
+
+/*--------------------------------------------------
+ The pulse itself: positive phase, interphase and negative phase.
+ No serial output here. Also from the trigger interrupt, not while
+ the main loop is in vDoWaveform (the pots, the monitor)
+ --------------------------------------------------*/
+static void vFirePulse( uint8_t channel )
+{
+   LED_ON();
+   setPotCode(channel, sSetChannel[channel].uPotCodes[0]);  /* set positive output voltage */
+   uEdgeFine[channel] = uTimerFine();
+   vAdcMark( channel );                 /* in the sample stream */
+   vGetSystemTimer( &uEdgeMs[channel] );
+   vMarkerEdge( channel );              /* marker just before the positive edge */
+   setHBridgePositive(channel);  /* start the pulse */
+   if ( (uMonitorMode() != MONITOR_OFF) && (sSetChannel[channel].uTimes[1] != 0) )
+   {
+      delay_100us(sSetChannel[channel].uTimes[1] / 2);
+      vMonitorPhase( 0 );                 /* sample in the middle of the phase */
+      delay_100us(sSetChannel[channel].uTimes[1] - (sSetChannel[channel].uTimes[1] / 2));
+   }
+   else
+   {
+      delay_100us(sSetChannel[channel].uTimes[1]);
+   }
+   clearHBridge(channel);         /* no output */
+   if ( sSetChannel[channel].uTimes[2] > 0)
+   {
+      delay_100us(sSetChannel[channel].uTimes[2]);
+   }
+   setPotCode(channel, sSetChannel[channel].uPotCodes[1]);  /* set negative output voltage */
+   if ( sSetChannel[channel].uTimes[3] > 0)
+   {
+      setHBridgeNegative(channel);  /* start the pulse */
+      if ( uMonitorMode() != MONITOR_OFF )
+      {
+         delay_100us(sSetChannel[channel].uTimes[3] / 2);
+         vMonitorPhase( 1 );              /* sample in the middle of the phase */
+         delay_100us(sSetChannel[channel].uTimes[3] - (sSetChannel[channel].uTimes[3] / 2));
+      }
+      else
+      {
+         delay_100us(sSetChannel[channel].uTimes[3]);
+      }
+      clearHBridge(channel);         /* no output */
+   }
+   if ( (uMarkerMode[channel] == MARKER_PULSE) && (uMarkerWidth[channel] == 0) )
+   {
+      vMarkerStop();                 /* width 0: the whole pulse */
+   }
+   LED_OFF();
+}
+
+/*--------------------------------------------------
+ Compare the pulse with its scheduled time; a miss is counted in the
+ statistics and reported with 'LATE n, ms' when the alarm is on
+ --------------------------------------------------*/
+static void vCheckDeadline( uint8_t channel )
+{
+   uint16_t uLate = uEdgeMs[channel] - uDueMs[channel];
+
+   if ( uLate > 0x8000 )
+   {
+      return;                           /* early (the sync shifted the time) */
+   }
+   if ( uLate > uLateMax[channel] )
+   {
+      uLateMax[channel] = uLate;
+   }
+   if ( uLate > uLateTolerance[channel] )
+   {
+      asStats[channel].ulMisses++;
+      if ( (uLateAlarm & (1u << channel)) != 0 )
+      {
+         vLogString( PSTR( "LATE" ));
+         print_uint16_base10( channel + 1 );
+         SendCommaSpace();
+         print_uint16_base10( uLate );
+         vSendCR();
+      }
+   }
+}
+
+/*--------------------------------------------------
+ Statistics of a pulse (before the counts are updated). The period
+ is measured on timer1 (4us) when shorter than its wrap (262ms),
+ else in ms
+ --------------------------------------------------*/
+static void vCountPulse( uint8_t channel )
+{
+   sChannelStats_t   *psStats = &asStats[channel];
+   static uint16_t   uPrevMs[CHANNELCOUNT];
+   static uint16_t   uPrevFine[CHANNELCOUNT];
+   uint16_t          uMs;
+   uint32_t          ulPeriod;
+
+   psStats->ulPulses++;
+   psStats->ulOnTime += sSetChannel[channel].uTimes[1] + sSetChannel[channel].uTimes[3];
+   if ( currentCount[channel] == 0 )
+   {
+      psStats->ulRuns++;                /* first pulse of a run: no period */
+   }
+   else
+   {
+      uMs = uEdgeMs[channel] - uPrevMs[channel];
+      if ( uMs < 250 )
+      {
+         ulPeriod = (uint32_t) (uint16_t) (uEdgeFine[channel] - uPrevFine[channel]) * 4;
+      }
+      else
+      {
+         ulPeriod = (uint32_t) uMs * 1000;
+      }
+      if ( (psStats->ulPeriodMin == 0) || (ulPeriod < psStats->ulPeriodMin) )
+      {
+         psStats->ulPeriodMin = ulPeriod;
+      }
+      if ( ulPeriod > psStats->ulPeriodMax )
+      {
+         psStats->ulPeriodMax = ulPeriod;
+      }
+      vCheckDeadline( channel );
+   }
+   uPrevMs[channel] = uEdgeMs[channel];
+   uPrevFine[channel] = uEdgeFine[channel];
+}
+
+/*--------------------------------------------------
+ Bookkeeping after a pulse: charge, counts, next state
+ --------------------------------------------------*/
+static void vPulseDone( uint8_t channel )
+{
+   vCountPulse( channel );
+   vAddCharge( channel, lPulseCharge( channel ) );
+   currentState[channel] = 3;
+   currentCount[channel] += 1;               /* one pulse completed */
+   currentCountPeriod[channel] += 1;
+}
+
+/*--------------------------------------------------
+ Output monitor after a pulse: stop the channel on a bad load
+ --------------------------------------------------*/
+static void vCheckLoad( uint8_t channel )
+{
+   if ( fMonitorPulse( channel ) )
+   {
+      sSetChannel[channel].uStartFlag = 0;
+      currentState[channel] = 0;
+      vMarkerBurstEnd( channel );
+   }
+}
+
+/*--------------------------------------------------
+ Handle the channels latched by the trigger interrupt. Channels with
+ T0 = 0 got their first pulse in the interrupt, or get it right here,
+ all of them before any report, and go on waiting for the next
+ period; the others start with T0 (the trigger is the time origin)
+ --------------------------------------------------*/
+static void vHandleTrigger( void )
+{
+   uint8_t     i;
+   uint16_t    uPending;
+   uint16_t    uFired;
+   uint16_t    uTime;
+   uint16_t    uStamp;
+   uint16_t    uStampMs;
+
+   cli();
+   uPending = uTriggerPending;
+   uFired = uTriggerFired;
+   uTime = uTriggerTime;
+   uStamp = uTriggerStamp;
+   uStampMs = uTriggerStampMs;
+   uTriggerPending = 0;
+   uTriggerFired = 0;
+   sei();
+   if ( uPending == 0 )
+   {
+      return;
+   }
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      if ( ((uPending & ~uFired & (1u << i)) != 0) && (sSetChannel[i].uStartFlag == START_TRIGGER) &&
+           (sSetChannel[i].uTimes[0] == 0) && fChargeAllowed( i ) )
+      {
+         vFirePulse( i );
+         ulTriggerLatency[i] = ulTimerCountsBetween( uStampMs, uStamp, uEdgeMs[i], uEdgeFine[i] );
+         uFired |= (1u << i);
+      }
+   }
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      if ( ((uPending & (1u << i)) == 0) || (sSetChannel[i].uStartFlag != START_TRIGGER) )
+      {
+         continue;
+      }
+      vLogString( PSTR( "TRIGGER" ));
+      print_uint16_base10( i + 1 );
+      currentTime[i] = uTime;
+      currentPeriod[i] = sSetChannel[i].uTimes[4];
+      if ( (uFired & (1u << i)) != 0 )
+      {
+         sSetChannel[i].uStartFlag = START_PULSING;
+         vPulseDone( i );
+         SendCommaSpace();
+         print_uint32_base10( ulCountsToUs( ulTriggerLatency[i] ) );  /* us from the interrupt to the edge */
+         if ( ulTriggerLatency[i] > ulTriggerLatencyMax[i] )
+         {
+            ulTriggerLatencyMax[i] = ulTriggerLatency[i];
+         }
+      }
+      else
+      {
+         sSetChannel[i].uStartFlag = START_STARTING;
+         currentState[i] = 1;
+      }
+      vSendCR();
+      if ( (uFired & (1u << i)) != 0 )
+      {
+         vCheckLoad( i );
+      }
+   }
+}
+
 /***------------------------ Global functions ---------------------------***/
+/*--------------------------------------------------
+ Time (ms) until the first channel has something to do:
+ 0 when a channel has to start or pulse right now,
+ UINT16_MAX when no channel is waiting
+ --------------------------------------------------*/
+uint16_t uWaveformNextDue( void )
+{
+   uint8_t  i;
+   uint16_t uNow;
+   uint16_t uElapsed;
+   uint16_t uWait;
+   uint16_t uDue = UINT16_MAX;
+
+   if ( uTriggerPending != 0 )
+   {
+      return 0;
+   }
+   vGetSystemTimer( &uNow );
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      switch ( currentState[i] )
+      {
+         case 0 :
+            if ( (sSetChannel[i].uStartFlag == START_OFF) ||
+                 (sSetChannel[i].uStartFlag == START_ARMED) ||
+                 (sSetChannel[i].uStartFlag == START_TRIGGER) )
+            {
+               continue;                   /* off or waiting for the sync edge or trigger */
+            }
+            return 0;
+         case 1 :                          /* pre wait: T0 */
+            uWait = sSetChannel[i].uTimes[0];
+            break;
+         case 3 :                          /* next period */
+            uWait = currentPeriod[i];
+            break;
+         default:
+            return 0;
+      }
+      uElapsed = uNow - currentTime[i];
+      if ( uElapsed >= uWait )
+      {
+         return 0;
+      }
+      if ( (uWait - uElapsed) < uDue )
+      {
+         uDue = uWait - uElapsed;
+      }
+   }
+   return uDue;
+}
+
+/*--------------------------------------------------
+ Marker output of a channel: mode and width (100us)
+ --------------------------------------------------*/
+void vMarkerSetup( uint8_t channel, uint8_t uMode, uint16_t uWidth )
+{
+   vMarkerBurstEnd( channel );
+   if ( uMarkerMode[channel] == MARKER_PULSE )
+   {
+      vMarkerStop();                    /* a running width ends */
+   }
+   uMarkerMode[channel] = uMode;
+   uMarkerWidth[channel] = uWidth;
+}
+
+void vMarkerGetSetup( uint8_t channel, uint8_t *puMode, uint16_t *puWidth )
+{
+   *puMode = uMarkerMode[channel];
+   *puWidth = uMarkerWidth[channel];
+}
+
+/*--------------------------------------------------
+ Trigger input: edge, channels and debounce time (ms)
+ --------------------------------------------------*/
+void vTriggerSetup( uint8_t uEdge, uint16_t uMask, uint8_t uDebounce )
+{
+   cli();
+   uTriggerEdge = uEdge;
+   uTriggerMask = uMask;
+   uTriggerDebounce = uDebounce;
+   uTriggerPending = 0;
+   uTriggerFired = 0;
+   vBoardTriggerEnable( uEdge != TRIGGER_OFF );
+   sei();
+}
+
+void vTriggerGetSetup( uint8_t *puEdge, uint16_t *puMask, uint8_t *puDebounce )
+{
+   *puEdge = uTriggerEdge;
+   *puMask = uTriggerMask;
+   *puDebounce = uTriggerDebounce;
+}
+
+/*--------------------------------------------------
+ Triggers accepted and per channel the max. latency from the trigger
+ interrupt to the pulse edge (us), since the last call
+ --------------------------------------------------*/
+void vTriggerGetStats( uint16_t *puCount, uint32_t *pulLatencyMax )
+{
+   uint8_t  i;
+
+   cli();
+   *puCount = uTriggerCount;
+   uTriggerCount = 0;
+   sei();
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      pulLatencyMax[i] = ulCountsToUs( ulTriggerLatencyMax[i] );
+      ulTriggerLatencyMax[i] = 0;
+   }
+}
+
+/*--------------------------------------------------
+ Trigger pin changed (pin change interrupt, interrupts disabled).
+ Latches the waiting channels, the time and the timer1 count of the
+ handler. When the main loop is not in vDoWaveform the channels with
+ T0 = 0 are given to vTriggerPulses, the main loop only reports them
+ --------------------------------------------------*/
+bool fTriggerPinChange( bool fHigh )
+{
+   uint16_t    uStamp = uTimerFine();
+   uint16_t    uNow;
+   uint8_t     i;
+   uint16_t    uStart = 0;
+   uint16_t    uFire = 0;
+
+   if ( (uTriggerEdge == TRIGGER_OFF) ||
+        (fHigh != (uTriggerEdge == TRIGGER_RISING)) )
+   {
+      return false;                     /* not the edge */
+   }
+   vGetSystemTimer( &uNow );
+   if ( (uint16_t) (uNow - uTriggerLast) < uTriggerDebounce )
+   {
+      return false;                     /* bouncing */
+   }
+   uTriggerLast = uNow;
+   uTriggerCount += (uTriggerCount != UINT16_MAX);
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      if ( ((uTriggerMask & (1u << i)) != 0) &&
+           ((uTriggerPending & (1u << i)) == 0) &&
+           (sSetChannel[i].uStartFlag == START_TRIGGER) )
+      {
+         uStart |= (1u << i);
+         if ( fTriggerArmed && (sSetChannel[i].uTimes[0] == 0) && fChargeAllowed( i ) )
+         {
+            uFire |= (1u << i);
+         }
+      }
+   }
+   if ( uStart == 0 )
+   {
+      return false;
+   }
+   if ( uTriggerPending == 0 )
+   {
+      uTriggerStamp = uStamp;           /* latency from the first one */
+      uTriggerStampMs = uNow;
+   }
+   uTriggerPending |= uStart;
+   uTriggerTime = uNow;
+   uFireStamp = uStamp;
+   uFireMs = uNow;
+   uTriggerFire = uFire;
+   return ( uFire != 0 );
+}
+
+/*--------------------------------------------------
+ The first pulse of the channels latched by fTriggerPinChange, in
+ the interrupt with the interrupts enabled
+ --------------------------------------------------*/
+void vTriggerPulses( void )
+{
+   uint8_t     i;
+   uint16_t    uFire = uTriggerFire;
+
+   for ( i = 0; i < CHANNELCOUNT; i++ )
+   {
+      if ( (uFire & (1u << i)) != 0 )
+      {
+         vFirePulse( i );
+         ulTriggerLatency[i] = ulTimerCountsBetween( uFireMs, uFireStamp, uEdgeMs[i], uEdgeFine[i] );
+      }
+   }
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+   {
+      uTriggerFired |= uFire;
+      uTriggerFire = 0;
+   }
+}
+
+/*--------------------------------------------------
+ Net charge of one pulse: V1 * T1 - V2 * T3
+ --------------------------------------------------*/
+int32_t lPulseCharge( uint8_t channel )
+{
+   int32_t  lPositive, lNegative;
+
+   lPositive = (int32_t) ((uint32_t) sSetChannel[channel].uVoltages[0] * sSetChannel[channel].uTimes[1]);
+   lNegative = (int32_t) ((uint32_t) sSetChannel[channel].uVoltages[1] * sSetChannel[channel].uTimes[3]);
+   return lPositive - lNegative;
+}
+
+/*--------------------------------------------------
+ Imbalance of a pulse: |net| / (pos + neg) in %
+ --------------------------------------------------*/
+uint8_t uChargeImbalance( uint8_t channel )
+{
+   int32_t  lNet;
+   uint32_t ulTotal;
+
+   ulTotal = ulPulseChargeSum( channel );
+   if ( ulTotal == 0 )
+   {
+      return 0;
+   }
+   lNet = lPulseCharge( channel );
+   return (uint8_t) (((uint32_t) ((lNet < 0) ? -lNet : lNet) * 100) / ulTotal);
+}
+
+/*--------------------------------------------------
+ Accumulated net charge
+ --------------------------------------------------*/
+int32_t lChargeTotal( uint8_t channel )
+{
+   return lChargeNet[channel];
+}
+
+/*--------------------------------------------------
+ Check the next pulse against the limits. Without division:
+ |net| * 100 > limit * (pos + neg) is an imbalance over the limit.
+ --------------------------------------------------*/
+bool fChargeAllowed( uint8_t channel )
+{
+   int32_t  lNet;
+   int32_t  lNext;
+   uint32_t ulTotal;
+
+   lNet = lPulseCharge( channel );
+   if ( uChargeImbalanceLimit != 0 )
+   {
+      ulTotal = ulPulseChargeSum( channel );
+      if ( ((uint32_t) ((lNet < 0) ? -lNet : lNet) * 100) > (ulTotal * uChargeImbalanceLimit) )
+      {
+         return false;
+      }
+   }
+   if ( ulChargeLimit != 0 )
+   {
+      lNext = lChargeNet[channel];
+      if ( ((lNet > 0) && (lNext > (INT32_MAX - lNet))) ||
+           ((lNet < 0) && (lNext < (INT32_MIN - lNet))) )
+      {
+         return false;                  /* would saturate: far over any limit */
+      }
+      lNext += lNet;
+      if ( (uint32_t) ((lNext < 0) ? -lNext : lNext) > ulChargeLimit )
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+/*--------------------------------------------------
+ Clear the accumulated net charge
+ --------------------------------------------------*/
+void vChargeReset( uint8_t channel )
+{
+   ATOMIC_BLOCK( ATOMIC_RESTORESTATE )  /* read by the trigger interrupt */
+   {
+      lChargeNet[channel] = 0;
+   }
+}
+
+/*--------------------------------------------------
+ Runtime statistics of a channel
+ --------------------------------------------------*/
+void vStatsGet( uint8_t channel, sChannelStats_t *psStats )
+{
+   *psStats = asStats[channel];
+}
+
+void vStatsReset( uint8_t channel )
+{
+   memset( &asStats[channel], 0, sizeof(sChannelStats_t) );
+}
+
+/*--------------------------------------------------
+ Deadline check of a channel: tolerance (ms) and alarm on/off. The
+ maximum lateness is reset by reading it
+ --------------------------------------------------*/
+void vDeadlineSetup( uint8_t channel, uint8_t uTolerance, bool fAlarm )
+{
+   uLateTolerance[channel] = uTolerance;
+   if ( fAlarm )
+   {
+      uLateAlarm |= (1u << channel);
+   }
+   else
+   {
+      uLateAlarm &= ~(1u << channel);
+   }
+}
+
+void vDeadlineGet( uint8_t channel, uint8_t *puTolerance, bool *pfAlarm, uint16_t *puLateMax )
+{
+   *puTolerance = uLateTolerance[channel];
+   *pfAlarm = ((uLateAlarm & (1u << channel)) != 0);
+   *puLateMax = uLateMax[channel];
+   uLateMax[channel] = 0;
+}
+
+/*--------------------------------------------------
+ Checkpoint of the statistics to EEPROM, now or every uMinutes
+ --------------------------------------------------*/
+bool fStatsCheckpoint( void )
+{
+   if ( ! fSettingsSaveStats( asStats ) )
+   {
+      return false;                     /* busy: the task tries again */
+   }
+   uCheckpointCount = 0;
+   return true;
+}
+
+void vStatsAutoCheckpoint( uint8_t uMinutes )
+{
+   uCheckpointMinutes = uMinutes;
+   uCheckpointCount = 0;
+   vGetSystemTimer( &uCheckpointMs );
+}
+
+uint8_t uStatsAutoCheckpoint( void )
+{
+   return uCheckpointMinutes;
+}
+
+/*--------------------------------------------------
+ Pot code of a voltage with the calibration of the channel
+ --------------------------------------------------*/
+static uint8_t uPotCode( uint8_t channel, uint8_t uDecivolts )
+{
+   int16_t  iCode;
+
+   if ( uDecivolts == 0 )
+   {
+      return 0;                         /* no output, whatever the offset */
+   }
+   iCode = (int16_t) ((((uint32_t) uDecivolts * 5 * asCalibration[channel].uGain) + 500) / 1000);
+   iCode += asCalibration[channel].iOffset;
+   if ( iCode < 0 )
+   {
+      return 0;
+   }
+   return ( iCode > 255 ) ? 255 : (uint8_t) iCode;
+}
+
+/*--------------------------------------------------
+ Voltages of a channel and their pot codes
+ --------------------------------------------------*/
+void vSetVoltages( uint8_t channel, uint8_t uV1, uint8_t uV2 )
+{
+   sSetChannel[channel].uVoltages[0] = uV1;
+   sSetChannel[channel].uVoltages[1] = uV2;
+   sSetChannel[channel].uPotCodes[0] = uPotCode( channel, uV1 );
+   sSetChannel[channel].uPotCodes[1] = uPotCode( channel, uV2 );
+}
+
+void vPotCodesUpdate( void )
+{
+   uint8_t  cnt;
+
+   for ( cnt = 0; cnt < CHANNELCOUNT; cnt++ )
+   {
+      vSetVoltages( cnt, sSetChannel[cnt].uVoltages[0], sSetChannel[cnt].uVoltages[1] );
+   }
+}
+
+/*--------------------------------------------------
+ Calibration of a channel; stored at once
+ --------------------------------------------------*/
+bool fCalibrationSetup( uint8_t channel, uint16_t uGain, int8_t iOffset )
+{
+   if ( fSettingsBusy() )
+   {
+      return false;
+   }
+   asCalibration[channel].uGain = uGain;
+   asCalibration[channel].iOffset = iOffset;
+   vSetVoltages( channel, sSetChannel[channel].uVoltages[0], sSetChannel[channel].uVoltages[1] );
+   return fSettingsSaveCalibration( asCalibration );
+}
+
+void vCalibrationGet( uint8_t channel, sCalibration_t *psCalibration )
+{
+   *psCalibration = asCalibration[channel];
+}
+
+/*--------------------------------------------------
+ Automatic checkpoint; the loop runs at least every 200ms, so the
+ 16 bit ms time is enough to count minutes. Retried while the
+ EEPROM is busy
+ --------------------------------------------------*/
+static void vCheckpointTask( void )
+{
+   uint16_t uNow;
+
+   if ( uCheckpointMinutes == 0 )
+   {
+      return;
+   }
+   vGetSystemTimer( &uNow );
+   if ( (uint16_t) (uNow - uCheckpointMs) >= 60000 )
+   {
+      uCheckpointMs += 60000;
+      uCheckpointCount++;
+   }
+   if ( uCheckpointCount >= uCheckpointMinutes )
+   {
+      (void) fStatsCheckpoint();
+   }
+}
+
 /*----------------------------------------------------------------------
     vInitWaveform
       Initialize this module
@@ -102,8 +930,6 @@ static void vUpdateCurrentTime(uint8_t channel)
 void vInitWaveform( void )
 {
    uint8_t  cnt;
-   uint8_t  size;
-   uint8_t  *ptr = &sSetChannel[0].uStartFlag;      /* initialize at beginning of settings */
 
    for ( cnt = 0; cnt < CHANNELCOUNT; cnt++ )
    {
@@ -111,11 +937,53 @@ void vInitWaveform( void )
       currentState[cnt] = 0;
       currentCountPeriod[cnt] = 0;
       uChangedPeriods[cnt] = 0;
+      lChargeNet[cnt] = 0;
+      uLateTolerance[cnt] = LATE_TOLERANCE;
+   }
+   uTriggerEdge = TRIGGER_OFF;
+   uChargeImbalanceLimit = 0;
+   ulChargeLimit = 0;
+   if ( ! fSettingsLoadStats( asStats ) )  /* totals from the last checkpoint */
+   {
+      memset( asStats, 0, sizeof(asStats) );
    }
-   for ( size = 0; size < SETTING_SIZE; size++ )  /* read all settings from eeprom */
+   if ( ! fSettingsLoadCalibration( asCalibration ) )
    {
-      *ptr = eeprom_read_byte(&NonVolatileSettings[size]);
-      ptr++;
+      for ( cnt = 0; cnt < CHANNELCOUNT; cnt++ )
+      {
+         asCalibration[cnt].uGain = CAL_GAIN_DEFAULT;  /* nominal: value * 5 */
+         asCalibration[cnt].iOffset = 0;
+      }
+   }
+   if ( ! fSettingsLoad( 0 ) )          /* read the power up settings from eeprom */
+   {
+      vSettingsDefaults();
+      vLogInfo( PSTR( "No valid settings in EEPROM; defaults used" ));
+   }
+   vPotCodesUpdate();                   /* with the calibration of this board */
+   fBootReport = 0;
+   for ( cnt = 0; cnt < CHANNELCOUNT; cnt++ )
+   {
+      if ( ! fSettingValid( &sSetChannel[cnt] ) )
+      {
+         sSetChannel[cnt].uStartFlag = 0;
+         vLogString( PSTR( "INVALID" ));
+         print_uint16_base10( cnt + 1 );
+         vSendCR();
+      }
+      else if ( sSetChannel[cnt].uStartFlag != 0 )
+      {
+         /* Auto-start: arm the channel directly in the pre wait, with the start
+            of the timer (power up) as time origin for all channels */
+         sSetChannel[cnt].uStartFlag = 1;
+         currentState[cnt] = 1;
+         currentTime[cnt] = 0;
+         currentPeriod[cnt] = sSetChannel[cnt].uTimes[4];
+         fBootReport = 1;
+         vLogString( PSTR( "AUTOSTART" ));
+         print_uint16_base10( cnt + 1 );
+         vSendCR();
+      }
    }
 }
 
@@ -126,15 +994,26 @@ void vDoWaveform( void )
 {
    uint8_t     i;
    uint16_t    temp;
+   uint16_t    uOrigin;
+   int16_t     iCorrection;
+   bool        fSync;
+
+   fTriggerArmed = false;               /* no pulses from the trigger interrupt in here */
+   vHandleTrigger();
+   vCheckpointTask();
+   fSync = fSyncTakeOrigin( &uOrigin, &iCorrection );
+   if ( fSync )
+   {
+      vLogString( PSTR( "SYNC" ));        /* with the phase correction of the own ms grid (us) */
+      print_int16_base10( iCorrection );
+      vSendCR();
+   }
 
    for ( i = 0; i < CHANNELCOUNT; i++)
    {
-      if ( (sSetChannel[i].uStartFlag == 0) || (sSetChannel[i].uStartFlag > 3) )  /* if set to 'off': set the FSM to startpoint */
+      if ( (sSetChannel[i].uStartFlag == 0) || (sSetChannel[i].uStartFlag > START_TRIGGER) )  /* if set to 'off': set the FSM to startpoint */
       {
-         currentState[i] = 0;
-         currentCount[i] = 0;
-         currentCountPeriod[i] = 0;
-         uChangedPeriods[i] = 0;
+         vResetChannel( i );
       }
       vGetSystemTimer(&temp);              /* get the time */
 
@@ -149,7 +1028,21 @@ void vDoWaveform( void )
                currentState[i] = 1;        /* go to pre wait for starting pulsing */
                currentTime[i] = temp;      /* set current time */
                currentPeriod[i] = sSetChannel[i].uTimes[4];  /* set period reference */
-            } else
+            }
+            else if ( sSetChannel[i].uStartFlag == START_ARMED )
+            {
+               if ( fSync )                /* start on the common origin */
+               {
+                  vLogString(PSTR("START"));
+                  print_uint16_base10( i + 1 );
+                  vSendCR();
+                  sSetChannel[i].uStartFlag = START_STARTING;
+                  currentState[i] = 1;
+                  currentTime[i] = uOrigin;
+                  currentPeriod[i] = sSetChannel[i].uTimes[4];
+               }
+            }
+            else if ( sSetChannel[i].uStartFlag != START_TRIGGER )  /* trigger: wait */
             {
                sSetChannel[i].uStartFlag = 0;
             }
@@ -171,29 +1064,31 @@ void vDoWaveform( void )
             }
             break;
          case 2 :                          /* uninterupted pos.pulse,interphase,and neg.pulse */
-            LED_ON();
-            vSerialPutChar( 'A'+i );   /* show pulse on channel */
-            // vDebugHex(PSTR("\r\nPulse "),(uint8_t *) &temp, 2);
-            setVoltage(i, sSetChannel[i].uVoltages[0]);  /* set positive output voltage */
-            setHBridgePositive(i);  /* start the pulse */
-            delay_100us(sSetChannel[i].uTimes[1]);
-            clearHBridge(i);         /* no output */
-            if ( sSetChannel[i].uTimes[2] > 0)
+            if ( ! fChargeAllowed( i ) )     /* settings or total out of the charge limits */
             {
-               delay_100us(sSetChannel[i].uTimes[2]);
+               sSetChannel[i].uStartFlag = 0;
+               currentState[i] = 0;
+               vReportUnbalanced( i );
+               break;
             }
-            setVoltage(i, sSetChannel[i].uVoltages[1]);  /* set negative output voltage */
-            if ( sSetChannel[i].uTimes[3] > 0)
+            if ( ! fTerminalChained() && ! fTerminalHostMode() )
             {
-               setHBridgeNegative(i);  /* start the pulse */
-               delay_100us(sSetChannel[i].uTimes[3]);
-               clearHBridge(i);         /* no output */
+               vSerialPutChar( 'A'+i );   /* show pulse on channel */
+            }
+            // vDebugHex(PSTR("\r\nPulse "),(uint8_t *) &temp, 2);
+            vFirePulse( i );
+            if ( fBootReport != 0 )             /* first pulse after power up */
+            {
+               fBootReport = 0;
+               vLogString( PSTR( "BOOT" ));
+               print_uint16_base10( i + 1 );
+               SendCommaSpace();
+               print_uint16_base10( currentTime[i] );  /* ms from power up (incl. T0) */
+               vSendCR();
             }
+            vPulseDone( i );
+            vCheckLoad( i );
             vGetSystemTimer(&temp);
-            currentState[i] = 3;
-            currentCount[i] += 1;               /* one pulse completed */
-            currentCountPeriod[i] += 1;
-            LED_OFF();
             break;
          case 3 :                          /* Waiting for next pulse (in between the terminal can work) */
             if ( temp >= currentTime[i] )  /* time isn't rolled-over */
@@ -203,10 +1098,16 @@ void vDoWaveform( void )
             {
                temp = temp  + (UINT16_MAX - currentTime[i]);  /* rolled-over! */
             }
-            if ( temp >= sSetChannel[i].uTimes[4])     /* check period */
+            if ( temp >= currentPeriod[i] )            /* check period (T4, or changed by DT) */
             {
+               uDueMs[i] = currentTime[i] + currentPeriod[i];  /* the scheduled time */
                vUpdateCurrentTime(i);                 /* change -if applicable- the period time, */
                                                       /* and check max pulses */
+               if ( sSetChannel[i].uStartFlag == START_TRIGGER )
+               {
+                  vResetChannel( i );                 /* train done: wait for the next trigger */
+                  break;
+               }
                currentState[i] = 2;                   /* going to pulse gen */
                vGetSystemTimer(&currentTime[i]);      /* save current timecount */
                // vDebugHex(PSTR("\r\ntime3 "),(uint8_t *) &currentTime[i], 2);
@@ -217,6 +1118,7 @@ void vDoWaveform( void )
             break;
       }
    }
+   fTriggerArmed = true;
 }
 
 
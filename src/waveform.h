@@ -15,17 +15,25 @@
 #ifndef WAVE_H_
 #define WAVE_H_
 
-#define CHANNELCOUNT       4            /* how many channels */
 #define TIMECOUNT          5            /* all timing elements */
 
 #include <stdint.h>
-#include <avr/eeprom.h>
+#include <stdbool.h>
+#include "board.h"                      /* CHANNELCOUNT, from the board description */
 
 /***------------------------ Global Data --------------------------------***/
+/* uStartFlag */
+#define START_OFF          0
+#define START_STARTING     1
+#define START_PULSING      2
+#define START_ARMED        3            /* waiting for the sync pulse */
+#define START_TRIGGER      4            /* waiting for the trigger input */
+
 typedef struct sSetting_t
 {
-   uint8_t  uStartFlag;                /* Running flags 0=stopped, 1=starting, 2=pulsing */
+   uint8_t  uStartFlag;                /* Running flags 0=stopped, 1=starting, 2=pulsing, 3=armed, 4=trigger */
    uint8_t  uVoltages[2];              /* Voltage setting pos/neg (V1 and V2) */
+   uint8_t  uPotCodes[2];              /* their pot codes, calibrated (vSetVoltages) */
    uint16_t uTimes[TIMECOUNT];         /* Timing: start-pause, pos.pulse T1, interphase T2, neg.pule T3, period T4 */
    uint16_t uDelta[3];                 /* Decrease delta (frequency increase; DT, DP, DM) */
    uint16_t pulseCount;                /* maximum pulses  (RPT) */
@@ -34,7 +42,36 @@ typedef struct sSetting_t
 extern sSetting_t   sSetChannel[CHANNELCOUNT];
 #define  SETTING_SIZE   (sizeof(sSetting_t) * CHANNELCOUNT)
 
-extern uint8_t  EEMEM NonVolatileSettings[SETTING_SIZE];
+/* Runtime statistics of a channel; kept over power cycles by a checkpoint */
+typedef struct sChannelStats_t
+{
+   uint32_t ulPulses;                  /* pulses delivered */
+   uint32_t ulRuns;                    /* runs (trains) started */
+   uint32_t ulOnTime;                  /* output time, pos. and neg. phase (100us) */
+   uint32_t ulPeriodMin;               /* measured period between pulses of a run (us) */
+   uint32_t ulPeriodMax;
+   uint32_t ulMisses;                  /* pulses later than the tolerance (deadline missed) */
+} sChannelStats_t;
+
+/* Voltage calibration of a channel */
+typedef struct sCalibration_t
+{
+   uint16_t uGain;                     /* permille */
+   int8_t   iOffset;                   /* pot steps (20 mV) */
+} sCalibration_t;
+
+#define CAL_GAIN_DEFAULT   1000
+#define CAL_GAIN_MIN       500
+#define CAL_GAIN_MAX       2000
+#define CAL_OFFSET_MAX     50           /* plus or minus */
+
+/*--------------------------------------------------
+ Charge balance. The charge of a phase is estimated as voltage * time
+ (a resistive load), in units of 0.1V * 100us = 0.01 V.ms.
+ A limit of 0 means 'no check'.
+ --------------------------------------------------*/
+extern uint8_t    uChargeImbalanceLimit;   /* max. net/total charge of a pulse (%) */
+extern uint32_t   ulChargeLimit;           /* max. accumulated net charge of a channel */
 
 /***------------------------ Global functions ---------------------------***/
 /*----------------------------------------------------------------------
@@ -49,6 +86,108 @@ extern void vInitWaveform( void );
  --------------------------------------------------*/
 extern void vDoWaveform( void );
 
+/*--------------------------------------------------
+ Time (ms) until a channel has something to do (0: now)
+ --------------------------------------------------*/
+extern uint16_t uWaveformNextDue( void );
+
+/*--------------------------------------------------
+ Trigger input: channels in the mask (bit 0: channel 1) which are
+ started ('RU') wait for the edge; each edge starts a train (RPT
+ pulses, the trigger is the time origin) and the channel waits again
+ --------------------------------------------------*/
+#define TRIGGER_OFF        0
+#define TRIGGER_RISING     1
+#define TRIGGER_FALLING    2
+
+extern void vTriggerSetup( uint8_t uEdge, uint16_t uMask, uint8_t uDebounce );
+extern void vTriggerGetSetup( uint8_t *puEdge, uint16_t *puMask, uint8_t *puDebounce );
+
+/*--------------------------------------------------
+ Triggers accepted and per channel (pulLatencyMax[CHANNELCOUNT]) the
+ max. latency from the trigger interrupt to the pulse edge (us),
+ since the last call
+ --------------------------------------------------*/
+extern void vTriggerGetStats( uint16_t *puCount, uint32_t *pulLatencyMax );
+
+/*--------------------------------------------------
+ From the pin change interrupt (interrupts disabled): latch the
+ trigger; true when there are pulses to give now, by vTriggerPulses
+ (from the interrupt, with the interrupts enabled)
+ --------------------------------------------------*/
+extern bool fTriggerPinChange( bool fHigh );
+extern void vTriggerPulses( void );
+
+/*--------------------------------------------------
+ Marker output: per channel a mode; the marker is set just before
+ the positive edge of a pulse
+   MARKER_PULSE   high for 'width' * 100us at every pulse, at most
+                  until the end of the pulse (0: the whole pulse)
+   MARKER_PERIOD  toggles at every pulse (edges mark the periods)
+   MARKER_BURST   high from the first pulse of a train to its end
+ --------------------------------------------------*/
+#define MARKER_NONE        0
+#define MARKER_PULSE       1
+#define MARKER_PERIOD      2
+#define MARKER_BURST       3
+
+extern void vMarkerSetup( uint8_t channel, uint8_t uMode, uint16_t uWidth );
+extern void vMarkerGetSetup( uint8_t channel, uint8_t *puMode, uint16_t *puWidth );
+
+/*--------------------------------------------------
+ Charge balance of a channel:
+   lPulseCharge   net charge of one pulse with the current settings
+   uChargeImbalance  |net| / (pos + neg) charge of one pulse in %
+   lChargeTotal   accumulated net charge of the given pulses
+   fChargeAllowed the next pulse stays within the limits
+   vChargeReset   clear the accumulated net charge
+ --------------------------------------------------*/
+extern int32_t lPulseCharge( uint8_t channel );
+extern uint8_t uChargeImbalance( uint8_t channel );
+extern int32_t lChargeTotal( uint8_t channel );
+extern bool    fChargeAllowed( uint8_t channel );
+extern void    vChargeReset( uint8_t channel );
+
+/*--------------------------------------------------
+ Deadlines: a pulse given more than the tolerance (ms) after its
+ scheduled time counts as a miss (statistics), and gives an alarm
+ 'LATE <channel>, <ms>' when set. The maximum lateness (ms) since
+ the last call is given (and reset)
+ --------------------------------------------------*/
+#define LATE_TOLERANCE     1            /* default: the resolution of the ms time */
+
+extern void vDeadlineSetup( uint8_t channel, uint8_t uTolerance, bool fAlarm );
+extern void vDeadlineGet( uint8_t channel, uint8_t *puTolerance, bool *pfAlarm, uint16_t *puLateMax );
+
+/*--------------------------------------------------
+ Runtime statistics: copy and reset of a channel. The checkpoint
+ writes all to EEPROM (in the background; false when busy); with
+ uMinutes > 0 (CHECKPOINT_MINUTES_MIN or more) this is done every
+ uMinutes
+ --------------------------------------------------*/
+extern void vStatsGet( uint8_t channel, sChannelStats_t *psStats );
+extern void vStatsReset( uint8_t channel );
+#define CHECKPOINT_MINUTES_MIN  5       /* shortest automatic interval */
+
+extern bool fStatsCheckpoint( void );
+extern void vStatsAutoCheckpoint( uint8_t uMinutes );
+extern uint8_t uStatsAutoCheckpoint( void );
+
+/*--------------------------------------------------
+ Output voltage. The pot code of a voltage is
+ decivolts * 5 * gain / 1000 + offset (0..255; 0V stays 0), computed
+ when the voltages, the settings or the calibration change, so a
+ pulse only writes the code:
+   vSetVoltages     V1 and V2 of a channel, with their codes
+   vPotCodesUpdate  codes of all channels (after loading settings)
+ Setting the calibration writes it to EEPROM (in the background;
+ false when busy, the calibration is then not changed)
+ --------------------------------------------------*/
+extern void vSetVoltages( uint8_t channel, uint8_t uV1, uint8_t uV2 );
+extern void vPotCodesUpdate( void );
+extern bool fCalibrationSetup( uint8_t channel, uint16_t uGain, int8_t iOffset );
+extern void vCalibrationGet( uint8_t channel, sCalibration_t *psCalibration );
+
 
 #endif /* WAVE_H_ */
 